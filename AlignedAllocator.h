@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <new>
+
+namespace dae
+{
+	//Allocator that aligns the storage of a std::vector, e.g. to the start of a cache line
+	template<typename T, size_t Alignment>
+	struct AlignedAllocator
+	{
+		static_assert(Alignment >= alignof(T), "Alignment is smaller than the natural alignment of T");
+
+		using value_type = T;
+
+		template<typename U>
+		struct rebind
+		{
+			using other = AlignedAllocator<U, Alignment>;
+		};
+
+		AlignedAllocator() noexcept = default;
+
+		template<typename U>
+		AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+		T* allocate(size_t count)
+		{
+			return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t{ Alignment }));
+		}
+
+		void deallocate(T* pointer, size_t) noexcept
+		{
+			::operator delete(pointer, std::align_val_t{ Alignment });
+		}
+
+		template<typename U>
+		bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+
+		template<typename U>
+		bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+	};
+}
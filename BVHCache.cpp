@@ -0,0 +1,247 @@
+#include "BVHCache.h"
+
+//Standard includes
+#include <cstring>
+#include <fstream>
+
+//Platform includes
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//Project includes
+#include "BVHNode.h"
+
+namespace dae
+{
+	namespace
+	{
+		constexpr char g_Magic[4]{ 'B', 'V', 'H', 'C' };
+
+		//Bump when the layout of the file or of BVHNode changes
+		constexpr uint32_t g_Version{ 4 };
+
+		struct CacheHeader
+		{
+			char magic[4];
+			uint32_t version;
+			uint64_t meshHash;
+
+			//Build settings that change the tree
+			int32_t buildMode;
+			int32_t binCount;
+			int32_t wideMortonCodes;
+			float traversalCost;
+			float leafCost;
+			float spatialSplitOverlap;
+			float maxDuplication;
+			int32_t leafPackWidth;
+
+			int32_t nodeCount;
+			int32_t triangleCount;
+
+			//Length of the leaf order, more than triangleCount when the SBVH split triangles
+			int32_t referenceCount;
+		};
+
+		//Read-only view of a whole file, unmapped when it goes out of scope
+		class MappedFile final
+		{
+		public:
+			explicit MappedFile(const std::string& path)
+			{
+#ifdef _WIN32
+				m_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+				if (m_File == INVALID_HANDLE_VALUE) return;
+
+				LARGE_INTEGER size{};
+				if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0) return;
+
+				m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (!m_Mapping) return;
+
+				m_pData = static_cast<const unsigned char*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+				if (m_pData) m_Size = static_cast<size_t>(size.QuadPart);
+#else
+				m_File = open(path.c_str(), O_RDONLY);
+				if (m_File < 0) return;
+
+				struct stat status{};
+				if (fstat(m_File, &status) != 0 || status.st_size == 0) return;
+
+				void* pData = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, m_File, 0);
+				if (pData == MAP_FAILED) return;
+
+				m_pData = static_cast<const unsigned char*>(pData);
+				m_Size = static_cast<size_t>(status.st_size);
+#endif
+			}
+
+			~MappedFile()
+			{
+#ifdef _WIN32
+				if (m_pData) UnmapViewOfFile(m_pData);
+				if (m_Mapping) CloseHandle(m_Mapping);
+				if (m_File != INVALID_HANDLE_VALUE) CloseHandle(m_File);
+#else
+				if (m_pData) munmap(const_cast<unsigned char*>(m_pData), m_Size);
+				if (m_File >= 0) close(m_File);
+#endif
+			}
+
+			MappedFile(const MappedFile&) = delete;
+			MappedFile(MappedFile&&) noexcept = delete;
+			MappedFile& operator=(const MappedFile&) = delete;
+			MappedFile& operator=(MappedFile&&) noexcept = delete;
+
+			const unsigned char* GetData() const { return m_pData; }
+			size_t GetSize() const { return m_Size; }
+
+		private:
+#ifdef _WIN32
+			HANDLE m_File{ INVALID_HANDLE_VALUE };
+			HANDLE m_Mapping{};
+#else
+			int m_File{ -1 };
+#endif
+			const unsigned char* m_pData{};
+			size_t m_Size{};
+		};
+
+		void HashBytes(uint64_t& hash, const void* pData, size_t size)
+		{
+			constexpr uint64_t prime{ 0x100000001b3ull };
+
+			const auto* pBytes = static_cast<const unsigned char*>(pData);
+			for (size_t i{}; i < size; ++i)
+			{
+				hash ^= pBytes[i];
+				hash *= prime;
+			}
+		}
+
+		template<typename T>
+		void HashVector(uint64_t& hash, const std::vector<T>& values)
+		{
+			//The size goes in as well, so moving values from one array to the next changes the hash
+			const uint64_t count = values.size();
+			HashBytes(hash, &count, sizeof(count));
+			HashBytes(hash, values.data(), values.size() * sizeof(T));
+		}
+
+		//A damaged file must not send the traversal outside of the arrays
+		bool IsValidTree(const BVHNode* nodes, int nodeCount, const int* leafOrder, int referenceCount, int triangleCount)
+		{
+			if (nodeCount < 2) return false;
+
+			for (int nodeIdx{}; nodeIdx < nodeCount; ++nodeIdx)
+			{
+				//Padding node
+				if (nodeIdx == 1) continue;
+
+				const BVHNode& node = nodes[nodeIdx];
+				if (node.isLeaf())
+				{
+					if (node.leftFirst < 0 || node.leftFirst + node.triangleCount > referenceCount) return false;
+				}
+				else
+				{
+					//Refit relies on children coming after their parent
+					if (node.leftFirst <= nodeIdx || node.leftFirst + 1 >= nodeCount) return false;
+				}
+			}
+
+			for (int i{}; i < referenceCount; ++i)
+			{
+				if (leafOrder[i] < 0 || leafOrder[i] >= triangleCount) return false;
+			}
+
+			return true;
+		}
+	}
+
+	std::string BVHCache::GetCachePath(const std::string& assetPath)
+	{
+		return assetPath + ".bvh";
+	}
+
+	uint64_t BVHCache::HashMesh(const TriangleMesh& mesh)
+	{
+		uint64_t hash{ 0xcbf29ce484222325ull };
+		HashVector(hash, mesh.positionsX);
+		HashVector(hash, mesh.positionsY);
+		HashVector(hash, mesh.positionsZ);
+		HashVector(hash, mesh.indices);
+		return hash;
+	}
+
+	bool BVHCache::Load(const std::string& cachePath, const TriangleMesh& mesh, BVH& bvh)
+	{
+		const MappedFile file{ cachePath };
+		if (file.GetSize() < sizeof(CacheHeader)) return false;
+
+		CacheHeader header{};
+		std::memcpy(&header, file.GetData(), sizeof(CacheHeader));
+
+		if (std::memcmp(header.magic, g_Magic, sizeof(g_Magic)) != 0 || header.version != g_Version) return false;
+
+		//A different mesh or different settings would give a different tree
+		const BVHBuildSettings& settings = bvh.buildSettings;
+		if (header.meshHash != HashMesh(mesh)) return false;
+		if (header.buildMode != static_cast<int32_t>(settings.mode) || header.binCount != settings.binCount) return false;
+		if (header.wideMortonCodes != static_cast<int32_t>(settings.useWideMortonCodes)) return false;
+		if (header.traversalCost != settings.traversalCost || header.leafCost != settings.leafCost) return false;
+		if (header.spatialSplitOverlap != settings.spatialSplitOverlap || header.maxDuplication != settings.maxDuplication) return false;
+		if (header.leafPackWidth != settings.leafPackWidth) return false;
+		if (header.triangleCount != static_cast<int32_t>(mesh.GetAmountOfTriangles())) return false;
+
+		const size_t nodesSize = sizeof(BVHNode) * static_cast<size_t>(header.nodeCount);
+		const size_t leafOrderSize = sizeof(int) * static_cast<size_t>(header.referenceCount);
+		if (header.nodeCount < 0 || header.referenceCount < 0 || file.GetSize() != sizeof(CacheHeader) + nodesSize + leafOrderSize) return false;
+
+		//The header keeps the arrays aligned to 4 bytes, which is all BVHNode and int need
+		const auto* pNodes = reinterpret_cast<const BVHNode*>(file.GetData() + sizeof(CacheHeader));
+		const auto* pLeafOrder = reinterpret_cast<const int*>(file.GetData() + sizeof(CacheHeader) + nodesSize);
+		if (!IsValidTree(pNodes, header.nodeCount, pLeafOrder, header.referenceCount, header.triangleCount)) return false;
+
+		bvh.RestoreBLAS(mesh, pNodes, header.nodeCount, pLeafOrder, header.referenceCount);
+		return true;
+	}
+
+	bool BVHCache::Save(const std::string& cachePath, const TriangleMesh& mesh, const BVH& bvh)
+	{
+		if (!bvh.isBuild) return false;
+
+		std::ofstream file{ cachePath, std::ios::binary | std::ios::trunc };
+		if (!file) return false;
+
+		CacheHeader header{};
+		std::memcpy(header.magic, g_Magic, sizeof(g_Magic));
+		header.version = g_Version;
+		header.meshHash = HashMesh(mesh);
+		header.buildMode = static_cast<int32_t>(bvh.buildSettings.mode);
+		header.binCount = bvh.buildSettings.binCount;
+		header.wideMortonCodes = static_cast<int32_t>(bvh.buildSettings.useWideMortonCodes);
+		header.traversalCost = bvh.buildSettings.traversalCost;
+		header.leafCost = bvh.buildSettings.leafCost;
+		header.spatialSplitOverlap = bvh.buildSettings.spatialSplitOverlap;
+		header.maxDuplication = bvh.buildSettings.maxDuplication;
+		header.leafPackWidth = bvh.buildSettings.leafPackWidth;
+		header.nodeCount = bvh.nodesUsed;
+		header.triangleCount = bvh.amountOfTriangles;
+		header.referenceCount = static_cast<int32_t>(bvh.triangleIndex.size());
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(bvh.bvhNode.data()), sizeof(BVHNode) * bvh.nodesUsed);
+		file.write(reinterpret_cast<const char*>(bvh.triangleIndex.data()), sizeof(int) * bvh.triangleIndex.size());
+
+		return static_cast<bool>(file);
+	}
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace dae
+{
+	struct BVH;
+	struct TriangleMesh;
+
+	//Stores the object space BVH of a static mesh on disk, next to the asset it was built from.
+	//The file holds the nodes, the leaf order of the triangles, the build settings and a hash of the mesh;
+	//it is only used when the hash and the settings still match, otherwise the BVH is built again.
+	namespace BVHCache
+	{
+		//"Resources/lowpoly_bunny.obj" -> "Resources/lowpoly_bunny.obj.bvh"
+		std::string GetCachePath(const std::string& assetPath);
+
+		//FNV-1a over the positions and indices, the only mesh data the tree depends on
+		uint64_t HashMesh(const TriangleMesh& mesh);
+
+		//Memory maps the file and restores the BVH from it, returns false when there is no usable cache
+		bool Load(const std::string& cachePath, const TriangleMesh& mesh, BVH& bvh);
+		bool Save(const std::string& cachePath, const TriangleMesh& mesh, const BVH& bvh);
+	}
+}
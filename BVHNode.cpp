@@ -1,231 +1,1913 @@
 ﻿#include "BVHNode.h"
 #include "Utils.h"
 #include "Scene.h"
+#include "RayPacket.h"
+#include "TraversalStack.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <future>
+#include <thread>
 
 namespace dae
 {
-    bool BVH::IntersectBVH(const Ray& ray, const int nodeIdx)
+    namespace
     {
+        //Calls chunkFunction(chunkIdx, begin, end) for every chunk of chunkSize items in [0, count).
+        //The chunks are handed out to up to threadCount threads, the calling thread helps along.
+        template<typename ChunkFunction>
+        void ForEachChunk(int count, int chunkSize, int threadCount, const ChunkFunction& chunkFunction)
+        {
+            const int chunkCount = (count + chunkSize - 1) / chunkSize;
+
+            std::atomic<int> nextChunk{ 0 };
+            const auto worker = [&]()
+            {
+                for (int chunkIdx = nextChunk++; chunkIdx < chunkCount; chunkIdx = nextChunk++)
+                {
+                    chunkFunction(chunkIdx, chunkIdx * chunkSize, std::min(count, (chunkIdx + 1) * chunkSize));
+                }
+            };
+
+            std::vector<std::future<void>> helpers{};
+            for (int i = 1; i < std::min(threadCount, chunkCount); ++i)
+            {
+                helpers.emplace_back(std::async(std::launch::async, worker));
+            }
+
+            worker();
+            for (auto& helper : helpers)
+            {
+                helper.get();
+            }
+        }
+
+        AABB GetSphereBounds(const Sphere& sphere)
+        {
+            const float radius = std::abs(sphere.radius);
+            const Vector3 extent{ radius, radius, radius };
+            return AABB{ sphere.origin - extent, sphere.origin + extent };
+        }
+
+        //Spreads the lowest 21 bits out to every third bit
+        uint64_t ExpandMortonBits(uint64_t value)
+        {
+            value &= 0x1fffff;
+            value = (value | value << 32) & 0x1f00000000ffffull;
+            value = (value | value << 16) & 0x1f0000ff0000ffull;
+            value = (value | value << 8) & 0x100f00f00f00f00full;
+            value = (value | value << 4) & 0x10c30c30c30c30c3ull;
+            value = (value | value << 2) & 0x1249249249249249ull;
+            return value;
+        }
 
+        //A box that was clipped away entirely has its minimum past its maximum
+        bool IsEmpty(const AABB& bounds)
+        {
+            return bounds.min.x > bounds.max.x || bounds.min.y > bounds.max.y || bounds.min.z > bounds.max.z;
+        }
+
+        //Equal width bins over the node bounds on one axis, the SBVH split search and partition have to agree on every bin
+        struct SpatialBinning
+        {
+            SpatialBinning(float boundsMin, float boundsMax, int binCount)
+                : boundsMin{ boundsMin }
+                , binWidth{ (boundsMax - boundsMin) / static_cast<float>(binCount) }
+                , scale{ boundsMax > boundsMin ? static_cast<float>(binCount) / (boundsMax - boundsMin) : 0.f }
+                , binCount{ binCount }
+            {
+            }
+
+            bool CanSplit() const { return scale > 0.f; }
+            int GetBin(float position) const { return std::clamp(static_cast<int>((position - boundsMin) * scale), 0, binCount - 1); }
+
+            //Plane i lies between bin i - 1 and bin i
+            float GetPlane(int planeIdx) const { return boundsMin + binWidth * static_cast<float>(planeIdx); }
+
+            float boundsMin;
+            float binWidth;
+            float scale;
+            int binCount;
+        };
+    }
+
+    bool BVH::IsOccluded(const Ray& ray, int* pOccluder, BVHTraversalStats* pStats) const
+    {
         //If the tree is not build we can not hit
         if(!isBuild) return false;
-        
-        BVHNode& node = bvhNode[nodeIdx];
-        HitRecord hit_record{};
 
-        //if the AABB is not hit, return false
-        const bool AABB = IntersectAABB(ray, node.aabbMin, node.aabbMax, hit_record);
+        if (m_TraversalMode == BVHTraversalMode::Wide4) return m_BVH4.IsOccluded(ray, *this, pOccluder, pStats);
+        if (m_TraversalMode == BVHTraversalMode::Wide8) return m_BVH8.IsOccluded(ray, *this, pOccluder, pStats);
+        if (m_TraversalMode == BVHTraversalMode::Quantized16) return m_QuantizedBVH16.IsOccluded(ray, *this, pOccluder, pStats);
+        if (m_TraversalMode == BVHTraversalMode::Quantized8) return m_QuantizedBVH8.IsOccluded(ray, *this, pOccluder, pStats);
+
+        //Any hit will do, so the search interval never shrinks below the end of the ray (the light for a shadow ray)
+        const float maxDistance = ray.max;
+
+        const BVHNode* node = &bvhNode[rootNodeIdx];
+        if (pStats) ++pStats->boxTests;
+        if (IntersectAABB(ray, node->aabbMin, node->aabbMax, maxDistance) == FLT_MAX) return false;
 
-        //If the ray does not hit the bounding box we won't hit the mesh
-        if(!AABB) return false;
+        TraversalStack<int, m_MaxStackDepth> stack{ m_StackSize };
+        int stackPtr = 0;
 
-        //If nod is an ending node, check if we hit the triangle
-        if (node.isLeaf())
+        while (true)
         {
-            bool didHit = false;
+            if (pStats) ++pStats->nodesVisited;
 
-            //Hit-test every triangle in the node
-            for (int i{}; i < node.triangleCount; ++i )
+            //If node is an ending node, check if we hit any of its primitives
+            if (node->isLeaf())
             {
-               didHit =  GeometryUtils::HitTest_Triangle(GetTriangleByIndex(triangleIndex[node.firstPrim + i]), ray, hit_record);
+                if (IsLeafOccluding(node->leftFirst, node->triangleCount, ray, pOccluder, pStats)) return true;
 
-                //If we hit, return true
-               if(didHit) {return true;}
-            }                       
+                if (stackPtr == 0) return false;
+                node = &bvhNode[stack[--stackPtr]];
+                continue;
+            }
+
+            //Visit the nearer child first, it is the most likely one to contain a hit
+            if (pStats) pStats->boxTests += 2;
+            const int childIdx = node->leftFirst;
+            float childDistance = IntersectAABB(ray, bvhNode[childIdx].aabbMin, bvhNode[childIdx].aabbMax, maxDistance);
+            float otherDistance = IntersectAABB(ray, bvhNode[childIdx + 1].aabbMin, bvhNode[childIdx + 1].aabbMax, maxDistance);
+            int nearIdx = childIdx;
+            int farIdx = childIdx + 1;
+
+            if (childDistance > otherDistance)
+            {
+                std::swap(childDistance, otherDistance);
+                std::swap(nearIdx, farIdx);
+            }
+
+            //Both children missed, continue with the next node on the stack
+            if (childDistance == FLT_MAX)
+            {
+                if (stackPtr == 0) return false;
+                node = &bvhNode[stack[--stackPtr]];
+                continue;
+            }
+
+            node = &bvhNode[nearIdx];
+            if (otherDistance != FLT_MAX)
+            {
+                assert(stackPtr < m_StackSize && "BVH is deeper than the traversal stack");
+                stack[stackPtr++] = farIdx;
+            }
         }
-        
-        //Go deeper in the tree
-        else
+    }
+
+    bool BVH::IsOccludedBy(const Ray& ray, int occluder) const
+    {
+        if (!isBuild || occluder < 0) return false;
+
+        if (occluder & BVHNode::sphereLeafFlag)
         {
-            const bool next = IntersectBVH( ray, node.firstPrim);
-            const bool nextR = IntersectBVH( ray, node.firstPrim + 1);
-        
-            if(next || nextR) return true;
+            const int sphereIdx = occluder & ~BVHNode::sphereLeafFlag;
+            return sphereIdx < static_cast<int>(spheres.size()) && GeometryUtils::HitTest_Sphere(spheres[sphereIdx], ray);
         }
 
-        //Should this false be here?
-        return false;
+        return occluder < static_cast<int>(triangles.size()) && GeometryUtils::HitTest_Triangle(triangles[occluder], ray);
     }
 
-    
-    void BVH::IntersectBVH(const Ray& ray, const int nodeIdx, HitRecord& hitRecord)
+    void BVH::IntersectBVH(const Ray& ray, HitRecord& hitRecord, BVHTraversalStats* pStats) const
     {
         if(!isBuild) return;
-        
-        BVHNode& node = bvhNode[nodeIdx];
-        
-        if (!IntersectAABB( ray, node.aabbMin, node.aabbMax, hitRecord)) return;
 
-        if (node.isLeaf())
+        if (m_TraversalMode == BVHTraversalMode::Wide4) return m_BVH4.Intersect(ray, *this, hitRecord, pStats);
+        if (m_TraversalMode == BVHTraversalMode::Wide8) return m_BVH8.Intersect(ray, *this, hitRecord, pStats);
+        if (m_TraversalMode == BVHTraversalMode::Quantized16) return m_QuantizedBVH16.Intersect(ray, *this, hitRecord, pStats);
+        if (m_TraversalMode == BVHTraversalMode::Quantized8) return m_QuantizedBVH8.Intersect(ray, *this, hitRecord, pStats);
+
+        const BVHNode* node = &bvhNode[rootNodeIdx];
+        if (pStats) ++pStats->boxTests;
+        if (IntersectAABB(ray, node->aabbMin, node->aabbMax, hitRecord.t) == FLT_MAX) return;
+
+        //Every entry remembers the distance at which the ray enters the node,
+        //when the closest hit moved in front of it by the time it is popped, the node is skipped
+        struct StackEntry
         {
-            for (int i{}; i < node.triangleCount; ++i )
+            int nodeIdx;
+            float distance;
+        };
+
+        TraversalStack<StackEntry, m_MaxStackDepth> stack{ m_StackSize };
+        int stackPtr = 0;
+
+        while (true)
+        {
+            if (pStats) ++pStats->nodesVisited;
+
+            bool popNext = false;
+
+            if (node->isLeaf())
+            {
+                IntersectLeaf(node->leftFirst, node->triangleCount, ray, hitRecord, pStats);
+                popNext = true;
+            }
+            else
             {
-                GeometryUtils::HitTest_Triangle(GetTriangleByIndex(triangleIndex[node.firstPrim + i]), ray, hitRecord);
-            }                       
+                //Visit the nearer child first, a hit in there shrinks the interval for the far child
+                if (pStats) pStats->boxTests += 2;
+                const int childIdx = node->leftFirst;
+                float childDistance = IntersectAABB(ray, bvhNode[childIdx].aabbMin, bvhNode[childIdx].aabbMax, hitRecord.t);
+                float otherDistance = IntersectAABB(ray, bvhNode[childIdx + 1].aabbMin, bvhNode[childIdx + 1].aabbMax, hitRecord.t);
+                int nearIdx = childIdx;
+                int farIdx = childIdx + 1;
+
+                if (childDistance > otherDistance)
+                {
+                    std::swap(childDistance, otherDistance);
+                    std::swap(nearIdx, farIdx);
+                }
+
+                if (childDistance == FLT_MAX)
+                {
+                    popNext = true;
+                }
+                else
+                {
+                    node = &bvhNode[nearIdx];
+                    if (otherDistance != FLT_MAX)
+                    {
+                        assert(stackPtr < m_StackSize && "BVH is deeper than the traversal stack");
+                        stack[stackPtr++] = { farIdx, otherDistance };
+                    }
+                }
+            }
+
+            if (!popNext) continue;
+
+            //Pop until we find a node that still lies in front of the closest hit
+            do
+            {
+                if (stackPtr == 0) return;
+                --stackPtr;
+            }
+            while (stack[stackPtr].distance >= hitRecord.t);
+
+            node = &bvhNode[stack[stackPtr].nodeIdx];
         }
-        else
+    }
+    
+    template<typename LeafTest>
+    void BVH::TraversePacket(const RayPacket& packet, const LeafTest& leafTest, BVHTraversalStats* pStats) const
+    {
+        const RayPacketBounds bounds{ packet };
+        const int groupCount = packet.GetGroupCount();
+
+        //Every entry remembers the first group that entered the parent, the groups before it can't enter the child either
+        struct StackEntry
+        {
+            int nodeIdx;
+            int firstGroup;
+        };
+
+        TraversalStack<StackEntry, m_MaxStackDepth> stack{ m_StackSize };
+        int stackPtr = 0;
+        stack[stackPtr++] = { rootNodeIdx, 0 };
+
+        while (stackPtr > 0)
         {
-            IntersectBVH( ray, node.firstPrim, hitRecord );
-            IntersectBVH( ray, node.firstPrim + 1 , hitRecord);
+            const StackEntry entry = stack[--stackPtr];
+            const BVHNode& node = bvhNode[entry.nodeIdx];
+
+            //The group that entered the parent usually enters the child too, when it doesn't the bounds can reject the node for the whole packet
+            int firstGroup = entry.firstGroup;
+            int hitMask = PacketUtils::IntersectGroupAABB(packet, firstGroup, node.aabbMin, node.aabbMax);
+            if (pStats) pStats->boxTests += RayPacket::groupSize;
+            if (!hitMask)
+            {
+                if (!bounds.Intersects(node.aabbMin, node.aabbMax)) continue;
+
+                while (!hitMask && ++firstGroup < groupCount)
+                {
+                    hitMask = PacketUtils::IntersectGroupAABB(packet, firstGroup, node.aabbMin, node.aabbMax);
+                    if (pStats) pStats->boxTests += RayPacket::groupSize;
+                }
+                if (!hitMask) continue;
+            }
+
+            if (pStats) ++pStats->nodesVisited;
+
+            if (node.isLeaf())
+            {
+                if (leafTest(node, firstGroup, hitMask)) return;
+                continue;
+            }
+
+            //The first ray that entered the node picks the order, the near child is popped first
+            const int rayIdx = firstGroup * RayPacket::groupSize + std::countr_zero(static_cast<unsigned>(hitMask));
+            if (pStats) pStats->boxTests += 2;
+            const int childIdx = node.leftFirst;
+            const float childDistance = PacketUtils::IntersectRayAABB(packet, rayIdx, bvhNode[childIdx].aabbMin, bvhNode[childIdx].aabbMax);
+            const float otherDistance = PacketUtils::IntersectRayAABB(packet, rayIdx, bvhNode[childIdx + 1].aabbMin, bvhNode[childIdx + 1].aabbMax);
+            const int nearIdx = childDistance <= otherDistance ? childIdx : childIdx + 1;
+
+            assert(stackPtr + 2 <= m_StackSize && "BVH is deeper than the traversal stack");
+            stack[stackPtr++] = { nearIdx == childIdx ? childIdx + 1 : childIdx, firstGroup };
+            stack[stackPtr++] = { nearIdx, firstGroup };
         }
     }
-    
-    void BVH::BuildBVH(const std::vector<TriangleMesh>& triangleMeshes)
+
+    void BVH::IntersectPacket(RayPacket& packet, HitRecord* hitRecords, BVHTraversalStats* pStats) const
     {
-        if(triangleMeshes.empty()) return;
+        if (!isBuild) return;
 
-        
-        //Get the mesh
-        Meshes = triangleMeshes;
-        
-        //Add the triangle count
-        for(const auto& mesh : Meshes)
+        //Hits that were found before, e.g. on the planes, shorten the rays
+        for (int rayIdx{}; rayIdx < packet.rayCount; ++rayIdx)
         {
-            amountOfTriangles += static_cast<int>(mesh.GetAmountOfTriangles());
+            packet.maxDistance[rayIdx] = std::min(packet.maxDistance[rayIdx], hitRecords[rayIdx].t);
         }
 
-        //Resize nodes and index of triangles
-        bvhNode.resize(static_cast<size_t>(amountOfTriangles) * 2);
-        triangleIndex.resize(amountOfTriangles);
-        
-        // populate triangle index array
-        for (int i{}; i < amountOfTriangles; ++i)
+        if (!packet.HasCommonDirectionSigns())
         {
-            triangleIndex[i] = i;
+            for (int rayIdx{}; rayIdx < packet.rayCount; ++rayIdx)
+            {
+                if (packet.IsActive(rayIdx)) IntersectBVH(packet.GetRay(rayIdx), hitRecords[rayIdx], pStats);
+            }
+            return;
         }
-        
-        // assign all triangles to root node
-        BVHNode& root = bvhNode[rootNodeIdx];
-        root.firstPrim = 0;
-        root.triangleCount = amountOfTriangles;
-        
-        UpdateNodeBounds( rootNodeIdx );
-        
-        // subdivide recursively
-        Subdivide( rootNodeIdx );
 
-        isBuild = true;
+        TraversePacket(packet, [&](const BVHNode& leaf, int firstGroup, int hitMask)
+        {
+            const int count = leaf.primitiveCount();
+            for (int groupIdx = firstGroup; groupIdx < packet.GetGroupCount(); ++groupIdx)
+            {
+                const int activeMask = groupIdx == firstGroup ? hitMask : PacketUtils::IntersectGroupAABB(packet, groupIdx, leaf.aabbMin, leaf.aabbMax);
+                if (!activeMask) continue;
+
+                const int firstRay = groupIdx * RayPacket::groupSize;
+                if (leaf.isSphereLeaf())
+                {
+                    if (pStats) pStats->spheresTested += count * std::popcount(static_cast<unsigned>(activeMask));
+
+                    for (int mask = activeMask; mask; mask &= mask - 1)
+                    {
+                        const int rayIdx = firstRay + std::countr_zero(static_cast<unsigned>(mask));
+                        const Ray ray = packet.GetRay(rayIdx);
+                        for (int i{}; i < count; ++i)
+                        {
+                            GeometryUtils::HitTest_Sphere(spheres[leaf.leftFirst + i], ray, hitRecords[rayIdx]);
+                        }
+                        packet.maxDistance[rayIdx] = std::min(packet.maxDistance[rayIdx], hitRecords[rayIdx].t);
+                    }
+                    continue;
+                }
+
+                if (pStats) pStats->trianglesTested += count * std::popcount(static_cast<unsigned>(activeMask));
+
+                for (int i{}; i < count; ++i)
+                {
+                    const BVHTriangle& triangle = triangles[leaf.leftFirst + i];
+
+                    alignas(16) float distances[RayPacket::groupSize];
+                    for (int mask = PacketUtils::IntersectGroupTriangle(packet, groupIdx, activeMask, triangle, distances); mask; mask &= mask - 1)
+                    {
+                        const int lane = std::countr_zero(static_cast<unsigned>(mask));
+                        const int rayIdx = firstRay + lane;
+                        const float t = distances[lane];
+
+                        HitRecord& hitRecord = hitRecords[rayIdx];
+                        hitRecord.t = t;
+                        hitRecord.didHit = true;
+                        hitRecord.materialIndex = triangle.materialIndex;
+                        hitRecord.origin = Vector3{ packet.originX[rayIdx], packet.originY[rayIdx], packet.originZ[rayIdx] }
+                            + (t * Vector3{ packet.directionX[rayIdx], packet.directionY[rayIdx], packet.directionZ[rayIdx] });
+                        hitRecord.normal = triangle.normal;
+                        packet.maxDistance[rayIdx] = t;
+                    }
+                }
+            }
+            return false;
+        }, pStats);
     }
-    
-    void BVH::UpdateNodeBounds( int nodeIdx )
+
+    void BVH::IsPacketOccluded(RayPacket& packet, bool* pOccluded, int* pOccluder, BVHTraversalStats* pStats) const
     {
-        BVHNode& node = bvhNode[nodeIdx];
+        if (!isBuild) return;
 
-        const Triangle firstTriangle = GetTriangleByIndex(triangleIndex[node.firstPrim]);
-        node.aabbMin = node.aabbMax = firstTriangle.v0;
-        
-        for (int first = node.firstPrim, i = 0; i < node.triangleCount; ++i)
+        int activeCount{};
+        for (int rayIdx{}; rayIdx < packet.rayCount; ++rayIdx)
         {
-            const int leafTriIdx = triangleIndex[first + i];
-            Triangle leafTri = GetTriangleByIndex(leafTriIdx);
-    
-            node.aabbMin = Vector3::Min(node.aabbMin, leafTri.v0);
-            node.aabbMin = Vector3::Min(node.aabbMin, leafTri.v1);
-            node.aabbMin = Vector3::Min(node.aabbMin, leafTri.v2);
+            if (pOccluded[rayIdx]) packet.SetInactive(rayIdx);
+            if (packet.IsActive(rayIdx)) ++activeCount;
+        }
+
+        if (activeCount == 0) return;
+
+        if (!packet.HasCommonDirectionSigns())
+        {
+            for (int rayIdx{}; rayIdx < packet.rayCount; ++rayIdx)
+            {
+                if (packet.IsActive(rayIdx)) pOccluded[rayIdx] = IsOccluded(packet.GetRay(rayIdx), pOccluder, pStats);
+            }
+            return;
+        }
+
+        //A blocked ray is done, it is deactivated so the rest of the traversal skips it
+        const auto setOccluded = [&](int rayIdx, int occluder)
+        {
+            if (pOccluder) *pOccluder = occluder;
+            pOccluded[rayIdx] = true;
+            packet.SetInactive(rayIdx);
+            --activeCount;
+        };
+
+        TraversePacket(packet, [&](const BVHNode& leaf, int firstGroup, int hitMask)
+        {
+            const int count = leaf.primitiveCount();
+            for (int groupIdx = firstGroup; groupIdx < packet.GetGroupCount(); ++groupIdx)
+            {
+                int activeMask = groupIdx == firstGroup ? hitMask : PacketUtils::IntersectGroupAABB(packet, groupIdx, leaf.aabbMin, leaf.aabbMax);
+                if (!activeMask) continue;
+
+                const int firstRay = groupIdx * RayPacket::groupSize;
+                if (leaf.isSphereLeaf())
+                {
+                    if (pStats) pStats->spheresTested += count * std::popcount(static_cast<unsigned>(activeMask));
+
+                    for (; activeMask; activeMask &= activeMask - 1)
+                    {
+                        const int rayIdx = firstRay + std::countr_zero(static_cast<unsigned>(activeMask));
+                        const Ray ray = packet.GetRay(rayIdx);
+                        for (int i{}; i < count; ++i)
+                        {
+                            if (!GeometryUtils::HitTest_Sphere(spheres[leaf.leftFirst + i], ray)) continue;
+
+                            setOccluded(rayIdx, (leaf.leftFirst + i) | BVHNode::sphereLeafFlag);
+                            break;
+                        }
+                    }
+                    continue;
+                }
+
+                if (pStats) pStats->trianglesTested += count * std::popcount(static_cast<unsigned>(activeMask));
+
+                for (int i{}; i < count && activeMask; ++i)
+                {
+                    alignas(16) float distances[RayPacket::groupSize];
+                    const int occludedMask = PacketUtils::IntersectGroupTriangle(packet, groupIdx, activeMask, triangles[leaf.leftFirst + i], distances);
+                    for (int mask = occludedMask; mask; mask &= mask - 1)
+                    {
+                        setOccluded(firstRay + std::countr_zero(static_cast<unsigned>(mask)), leaf.leftFirst + i);
+                    }
+                    activeMask &= ~occludedMask;
+                }
+            }
+            return activeCount == 0;
+        }, pStats);
+    }
     
-            node.aabbMax = Vector3::Max(node.aabbMax, leafTri.v0);
-            node.aabbMax = Vector3::Max(node.aabbMax, leafTri.v1);
-            node.aabbMax = Vector3::Max(node.aabbMax, leafTri.v2);
+    void BVH::BuildBVH(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries)
+    {
+        if(triangleMeshes.empty() && sphereGeometries.empty()) return;
+
+        //Gather every triangle of every mesh once
+        m_BuildTriangles.clear();
+        for(const auto& mesh : triangleMeshes)
+        {
+            AppendMeshTriangles(mesh, false);
         }
+
+        m_BuildSpheres = sphereGeometries;
+
+        BuildFromGatheredPrimitives();
     }
-    void BVH::Subdivide( int nodeIdx )
+
+    void BVH::BuildBLAS(const TriangleMesh& mesh)
     {
-        // terminate recursion when there is nothing more to split
-        BVHNode& node = bvhNode[nodeIdx];
-        if (node.triangleCount <= 2) return;
+        m_BuildTriangles.clear();
+        m_BuildSpheres.clear();
+        AppendMeshTriangles(mesh, true);
 
-        // determine split axis and position
-        Vector3 extent = node.aabbMax - node.aabbMin;
-        int axis = 0;
-        if (extent.y > extent.x) axis = 1;
-        if (extent.z > extent[axis]) axis = 2;
+        BuildFromGatheredPrimitives();
+    }
 
-        // Calculate the position of the splitting plane (median of the chosen axis)
-        const float splitPos = node.aabbMin[axis] + extent[axis] * 0.5f;
-        
-        //Left pointer starts at the beginning of the array
-        //Right pointer starts at the end of the array
-        int leftPointer = node.firstPrim;
-        int rightPointer = leftPointer + node.triangleCount - 1;
+    void BVH::BuildBLAS(const std::vector<Sphere>& sphereGeometries)
+    {
+        m_BuildTriangles.clear();
+        m_BuildSpheres = sphereGeometries;
+
+        BuildFromGatheredPrimitives();
+    }
+
+    void BVH::BuildFromGatheredPrimitives()
+    {
+        //Start from a clean tree, the BVH gets rebuilt when meshes move
+        amountOfTriangles = static_cast<int>(m_BuildTriangles.size());
+        amountOfSpheres = static_cast<int>(m_BuildSpheres.size());
+        const int primitiveCount = amountOfTriangles + amountOfSpheres;
+        nodesUsed = 2;
+
+        //Worst case is a leaf per primitive: the root, the unused node and 2 * (primitives - 1) children
+        bvhNode.resize(std::max(static_cast<size_t>(primitiveCount) * 2, size_t{ 2 }));
+        triangleIndex.resize(primitiveCount);
         
-        while (leftPointer <= rightPointer)
+        // populate primitive index array, the spheres come after the triangles
+        for (int i{}; i < primitiveCount; ++i)
         {
-            // Check if the center coordinate of the current triangle is on the left side of the splitting plane
-            if (GetTriangleByIndex(triangleIndex[leftPointer]).center[axis] < splitPos)
-            {
-                ++leftPointer;
-            }
-            else
+            triangleIndex[i] = i;
+        }
+
+        const int threadCount = GetBuildThreadCount();
+
+        //Cache the center and bounds of every primitive, the builder reads them over and over
+        m_PrimitiveCenters.resize(primitiveCount);
+        m_PrimitiveBounds.resize(primitiveCount);
+        ForEachChunk(amountOfTriangles, m_BuildChunkSize, threadCount, [this](int, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
             {
-                // If the center coordinate is on the right side of the splitting plane, swap the triangles
-                // This moves the right-side pointer to the left while maintaining order
-                std::swap( triangleIndex[leftPointer], triangleIndex[rightPointer--] );
+                const BVHTriangle& triangle = m_BuildTriangles[i];
+                const Vector3 v1 = triangle.v0 + triangle.edge1;
+                const Vector3 v2 = triangle.v0 + triangle.edge2;
+
+                m_PrimitiveCenters[i] = (triangle.v0 + v1 + v2) / 3.0f;
+
+                m_PrimitiveBounds[i] = AABB{};
+                m_PrimitiveBounds[i].Grow(triangle.v0);
+                m_PrimitiveBounds[i].Grow(v1);
+                m_PrimitiveBounds[i].Grow(v2);
             }
-                
+        });
+
+        for (int i{}; i < amountOfSpheres; ++i)
+        {
+            m_PrimitiveCenters[amountOfTriangles + i] = m_BuildSpheres[i].origin;
+            m_PrimitiveBounds[amountOfTriangles + i] = GetSphereBounds(m_BuildSpheres[i]);
         }
         
-        //Abort split if one of the sides is empty
-        const int leftCount = leftPointer - node.firstPrim;
-        
-        if (leftCount == 0 || leftCount == node.triangleCount) return;
+        // assign all primitives to root node
+        BVHNode& root = bvhNode[rootNodeIdx];
+        root.leftFirst = 0;
+        root.triangleCount = primitiveCount;
         
-        // Create child nodes for the left and right sub-nodes
-        const int leftChildIdx = nodesUsed++;
-        const int rightChildIdx = nodesUsed++;
+        //Spatial splits duplicate references, the ranges of the nodes grow while building
+        if (buildSettings.mode == BVHBuildMode::SpatialSAH)
+        {
+            BuildSpatialSplitTree(threadCount);
+        }
+        else
+        {
+            //The LBVH splits on the Morton order instead of on the node bounds
+            if (buildSettings.mode == BVHBuildMode::LBVH) SortByMortonCode(threadCount);
+            else UpdateNodeBounds( root, threadCount );
 
-        // Update child node properties
-        bvhNode[leftChildIdx].firstPrim = node.firstPrim;
-        bvhNode[leftChildIdx].triangleCount = leftCount;
-        bvhNode[rightChildIdx].firstPrim = leftPointer;
-        bvhNode[rightChildIdx].triangleCount = node.triangleCount - leftCount;
-        node.firstPrim = leftChildIdx;
-        node.triangleCount = 0;
-        
-        // Update the bounding boxes of child nodes
-        UpdateNodeBounds( leftChildIdx );
-        UpdateNodeBounds( rightChildIdx );
+            //Split the top of the tree in place, the large nodes there spread their work over the threads.
+            //The cut depends on the primitive count only, so the tree is the same for every thread count.
+            std::vector<int> subtreeRoots{};
+            BuildContext context{};
+            context.pNodes = bvhNode.data();
+            context.nodesUsed = nodesUsed;
+            context.threadCount = threadCount;
+            context.subtreeSize = std::max(m_MinSubtreeSize, primitiveCount / m_SubtreeTaskCount);
+            context.pSubtreeRoots = &subtreeRoots;
+
+            Subdivide( context, rootNodeIdx );
+            const int topNodeCount = context.nodesUsed;
+            BuildSubtrees( context, subtreeRoots, threadCount );
+            nodesUsed = context.nodesUsed;
+
+            //The subtree tasks fitted their own nodes, only the top is left
+            if (buildSettings.mode == BVHBuildMode::LBVH)
+            {
+                FitNodeBounds(bvhNode.data(), topNodeCount, true);
+
+                //Only needed while splitting, and PartitionByType keeps them in step with triangleIndex as long as they are there
+                m_MortonCodes.clear();
+                m_MortonCodes.shrink_to_fit();
+            }
+        }
+
+        //Most leaves hold more than one primitive, give back the nodes that were never used
+        bvhNode.resize(nodesUsed);
+        bvhNode.shrink_to_fit();
 
-        // Subdivide teh left and right children
-        Subdivide( leftChildIdx );
-        Subdivide( rightChildIdx );
+        AssignLeafRanges();
+        FinishTree(threadCount);
     }
-    
-    Triangle BVH::GetTriangleByIndex(int index) const
+
+    void BVH::AssignLeafRanges()
     {
-        for (const auto& mesh : Meshes)
+        //Without spheres every leaf already indexes the triangles directly
+        if (amountOfSpheres == 0) return;
+
+        //Index of every slot of triangleIndex in the array of its own type
+        std::vector<int> typedIndex(triangleIndex.size());
+        int triangleCount{};
+        int sphereCount{};
+        for (size_t slot{}; slot < triangleIndex.size(); ++slot)
+        {
+            typedIndex[slot] = IsSphere(triangleIndex[slot]) ? sphereCount++ : triangleCount++;
+        }
+
+        for (int nodeIdx{}; nodeIdx < nodesUsed; ++nodeIdx)
         {
-            const int numTrianglesInMesh = static_cast<int>(mesh.GetAmountOfTriangles());
+            BVHNode& node = bvhNode[nodeIdx];
+            if (nodeIdx == 1 || !node.isLeaf()) continue;
 
-            if (index < numTrianglesInMesh)
+            if (IsSphere(triangleIndex[node.leftFirst])) node.triangleCount |= BVHNode::sphereLeafFlag;
+            node.leftFirst = typedIndex[node.leftFirst];
+        }
+
+        //Triangles first, both in leaf order
+        std::stable_partition(triangleIndex.begin(), triangleIndex.end(), [this](int primitiveIdx) { return !IsSphere(primitiveIdx); });
+    }
+
+    void BVH::RestoreBLAS(const TriangleMesh& mesh, const BVHNode* nodes, int nodeCount, const int* leafOrder, int referenceCount)
+    {
+        m_BuildTriangles.clear();
+        m_BuildSpheres.clear();
+        AppendMeshTriangles(mesh, true);
+
+        amountOfTriangles = static_cast<int>(m_BuildTriangles.size());
+        amountOfSpheres = 0;
+        nodesUsed = nodeCount;
+        rootNodeIdx = 0;
+
+        bvhNode.assign(nodes, nodes + nodeCount);
+        triangleIndex.assign(leafOrder, leafOrder + referenceCount);
+
+        FinishTree(GetBuildThreadCount());
+    }
+
+    void BVH::FinishTree(int threadCount)
+    {
+        //Store the primitives in leaf order, so a leaf is one contiguous run of triangles or spheres
+        const int triangleReferenceCount = GetTriangleReferenceCount();
+        triangles.resize(triangleReferenceCount);
+        ForEachChunk(triangleReferenceCount, m_BuildChunkSize, threadCount, [this](int, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
             {
-                return mesh.GetTriangleByIndex(index);
+                triangles[i] = m_BuildTriangles[triangleIndex[i]];
             }
+        });
 
-            index -= numTrianglesInMesh;
+        spheres.resize(triangleIndex.size() - triangleReferenceCount);
+        for (size_t i{}; i < spheres.size(); ++i)
+        {
+            spheres[i] = m_BuildSpheres[triangleIndex[triangleReferenceCount + i] - amountOfTriangles];
         }
-        return {};
+
+        //Without primitives there is no root box to traverse
+        isBuild = amountOfTriangles + amountOfSpheres > 0;
+
+        //A traversal holds at most one entry per level, the packet traversal and the SAH walk one more for the second child of the last level
+        m_StackSize = isBuild ? CalculateMaxDepth() + 1 : 1;
+
+        //Remember how good the fresh tree is, refitting can only make it worse
+        m_BuildSAHCost = CalculateSAHCost();
+
+        m_LeafPackWidth = GetLeafPackWidth();
+        UpdateTrianglePacks();
+        UpdateTraversalLayout();
+    }
+
+    void BVH::SetTraversalMode(BVHTraversalMode mode)
+    {
+        m_TraversalMode = mode;
+        UpdateTraversalLayout();
     }
 
-    bool BVH::IntersectAABB( const Ray& ray, const Vector3 bmin, const Vector3 bmax, const HitRecord& hitRecord)
+    void BVH::UpdateTraversalLayout()
     {
-        const float tx1 = (bmin.x - ray.origin.x) / ray.direction.x;
-        const float tx2 = (bmax.x - ray.origin.x) / ray.direction.x;
+        //Only the layout that is traversed is kept, the others are freed
+        m_BVH4.Clear();
+        m_BVH8.Clear();
+        m_QuantizedBVH16.Clear();
+        m_QuantizedBVH8.Clear();
+        if (!isBuild) return;
+
+        switch (m_TraversalMode)
+        {
+        case BVHTraversalMode::Wide4:
+            m_BVH4.Collapse(bvhNode.data(), nodesUsed, rootNodeIdx, m_StackSize - 1);
+            break;
+        case BVHTraversalMode::Wide8:
+            m_BVH8.Collapse(bvhNode.data(), nodesUsed, rootNodeIdx, m_StackSize - 1);
+            break;
+        case BVHTraversalMode::Quantized16:
+            m_QuantizedBVH16.Quantize(bvhNode.data(), nodesUsed, rootNodeIdx, m_StackSize - 1);
+            break;
+        case BVHTraversalMode::Quantized8:
+            m_QuantizedBVH8.Quantize(bvhNode.data(), nodesUsed, rootNodeIdx, m_StackSize - 1);
+            break;
+        default:
+            break;
+        }
+    }
 
-        float tMin = std::min( tx1, tx2 );
-        float tMax = std::max( tx1, tx2 );
+    void BVH::UpdateTrianglePacks()
+    {
+        m_TrianglePacks4.Clear();
+        m_TrianglePacks8.Clear();
+        if (!isBuild) return;
 
-        const float ty1 = (bmin.y - ray.origin.y) / ray.direction.y;
-        const float ty2 = (bmax.y - ray.origin.y) / ray.direction.y;
+        if (m_LeafPackWidth == 4) m_TrianglePacks4.Build(bvhNode.data(), nodesUsed, triangles);
+        else if (m_LeafPackWidth == 8) m_TrianglePacks8.Build(bvhNode.data(), nodesUsed, triangles);
+    }
 
-        tMin = std::max( tMin, std::min( ty1, ty2 ) );
-        tMax = std::min( tMax, std::max( ty1, ty2 ) );
+    void BVH::UpdateBVH(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries)
+    {
+        //Refitting needs the topology of a tree over exactly the same primitives
+        int triangleCount{};
+        for (const auto& mesh : triangleMeshes)
+        {
+            triangleCount += static_cast<int>(mesh.GetAmountOfTriangles());
+        }
 
-        const float tz1 = (bmin.z - ray.origin.z) / ray.direction.z;
-        const float tz2 = (bmax.z - ray.origin.z) / ray.direction.z;
+        if (!isBuild || triangleCount != amountOfTriangles || static_cast<int>(sphereGeometries.size()) != amountOfSpheres)
+        {
+            BuildBVH(triangleMeshes, sphereGeometries);
+            return;
+        }
 
-        tMin = std::max( tMin, std::min( tz1, tz2 ) );
-        tMax = std::min( tMax, std::max( tz1, tz2 ) );
-        
-        return tMax >= tMin && tMin < hitRecord.t && tMax > 0;
+        Refit(triangleMeshes, sphereGeometries);
+
+        //Primitives that moved apart blow up the node bounds, rebuild when the tree got too slow
+        if (CalculateSAHCost() > m_BuildSAHCost * buildSettings.rebuildThreshold)
+        {
+            BuildBVH(triangleMeshes, sphereGeometries);
+        }
+    }
+
+    void BVH::Refit(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries)
+    {
+        if (!isBuild) return;
+
+        //Gather the moved triangles and put them back in the leaf order of the existing tree
+        m_BuildTriangles.clear();
+        m_BuildTriangles.reserve(amountOfTriangles);
+        for (const auto& mesh : triangleMeshes)
+        {
+            AppendMeshTriangles(mesh, false);
+        }
+
+        assert(static_cast<int>(m_BuildTriangles.size()) == amountOfTriangles && "Refit needs the triangles the BVH was built with");
+        assert(static_cast<int>(sphereGeometries.size()) == amountOfSpheres && "Refit needs the spheres the BVH was built with");
+
+        const int triangleReferenceCount = static_cast<int>(triangles.size());
+        for (int i{}; i < triangleReferenceCount; ++i)
+        {
+            triangles[i] = m_BuildTriangles[triangleIndex[i]];
+        }
+
+        for (size_t i{}; i < spheres.size(); ++i)
+        {
+            spheres[i] = sphereGeometries[triangleIndex[triangleReferenceCount + i] - amountOfTriangles];
+        }
+
+        //Children are always created after their parent, so walking the nodes backwards is a bottom-up walk
+        for (int nodeIdx = nodesUsed - 1; nodeIdx >= 0; --nodeIdx)
+        {
+            //Padding node, it has no children to take bounds from
+            if (nodeIdx == 1) continue;
+
+            BVHNode& node = bvhNode[nodeIdx];
+
+            AABB bounds{};
+            if (node.isSphereLeaf())
+            {
+                for (int i{}; i < node.primitiveCount(); ++i)
+                {
+                    bounds.Grow(GetSphereBounds(spheres[node.leftFirst + i]));
+                }
+            }
+            else if (node.isLeaf())
+            {
+                for (int i{}; i < node.triangleCount; ++i)
+                {
+                    const BVHTriangle& triangle = triangles[node.leftFirst + i];
+                    bounds.Grow(triangle.v0);
+                    bounds.Grow(triangle.v0 + triangle.edge1);
+                    bounds.Grow(triangle.v0 + triangle.edge2);
+                }
+            }
+            else
+            {
+                const BVHNode& leftChild = bvhNode[node.leftFirst];
+                const BVHNode& rightChild = bvhNode[node.leftFirst + 1];
+                bounds.Grow(AABB{ leftChild.aabbMin, leftChild.aabbMax });
+                bounds.Grow(AABB{ rightChild.aabbMin, rightChild.aabbMax });
+            }
+
+            node.aabbMin = bounds.min;
+            node.aabbMax = bounds.max;
+        }
+
+        //The packs and the wide or quantized tree copied the old positions
+        UpdateTrianglePacks();
+        UpdateTraversalLayout();
+    }
+
+    int BVH::CalculateMaxDepth() const
+    {
+        //Node and depth, the tree can be deeper than any fixed stack
+        std::vector<std::pair<int, int>> stack{ { rootNodeIdx, 0 } };
+        int maxDepth{};
+
+        while (!stack.empty())
+        {
+            const auto [nodeIdx, depth] = stack.back();
+            stack.pop_back();
+
+            const BVHNode& node = bvhNode[nodeIdx];
+            if (node.isLeaf())
+            {
+                maxDepth = std::max(maxDepth, depth);
+                continue;
+            }
+
+            stack.emplace_back(node.leftFirst, depth + 1);
+            stack.emplace_back(node.leftFirst + 1, depth + 1);
+        }
+
+        return maxDepth;
+    }
+
+    float BVH::CalculateSAHCost() const
+    {
+        if (!isBuild) return 0.f;
+
+        const float rootArea = AABB{ bvhNode[rootNodeIdx].aabbMin, bvhNode[rootNodeIdx].aabbMax }.Area();
+        if (rootArea <= 0.f) return 0.f;
+
+        //Expected cost of a ray that hits the root: every node is weighted by the chance that the ray also hits it
+        float cost{};
+        TraversalStack<int, m_MaxStackDepth> stack{ m_StackSize };
+        int stackPtr = 0;
+        stack[stackPtr++] = rootNodeIdx;
+
+        while (stackPtr > 0)
+        {
+            const BVHNode& node = bvhNode[stack[--stackPtr]];
+            const float hitChance = AABB{ node.aabbMin, node.aabbMax }.Area() / rootArea;
+
+            if (node.isLeaf())
+            {
+                //Spheres are never packed
+                const float testCount = node.isSphereLeaf() ? static_cast<float>(node.primitiveCount()) : GetLeafTestCount(node.triangleCount);
+                cost += hitChance * buildSettings.leafCost * testCount;
+            }
+            else
+            {
+                cost += hitChance * buildSettings.traversalCost;
+                stack[stackPtr++] = node.leftFirst;
+                stack[stackPtr++] = node.leftFirst + 1;
+            }
+        }
+
+        return cost;
+    }
+    
+    float BVH::GetDuplicationRatio() const
+    {
+        const int primitiveCount = amountOfTriangles + amountOfSpheres;
+        if (primitiveCount == 0) return 1.f;
+
+        return static_cast<float>(triangleIndex.size()) / static_cast<float>(primitiveCount);
+    }
+
+    BVHStats BVH::CalculateStats() const
+    {
+        BVHStats stats{};
+        stats.builder = GetBuildModeName(buildSettings.mode);
+        stats.leafPackWidth = m_LeafPackWidth;
+        stats.sahCost = CalculateSAHCost();
+        stats.duplicationRatio = GetDuplicationRatio();
+
+        stats.memoryUsed = bvhNode.size() * sizeof(BVHNode) + triangleIndex.size() * sizeof(int)
+            + triangles.size() * sizeof(BVHTriangle) + spheres.size() * sizeof(Sphere)
+            + m_BVH4.GetMemoryUsed() + m_BVH8.GetMemoryUsed() + m_QuantizedBVH16.GetMemoryUsed() + m_QuantizedBVH8.GetMemoryUsed()
+            + m_TrianglePacks4.GetMemoryUsed() + m_TrianglePacks8.GetMemoryUsed();
+
+        if (!isBuild) return stats;
+
+        //Node and depth
+        std::vector<std::pair<int, int>> stack{ { rootNodeIdx, 0 } };
+        int64_t depthSum{};
+        float overlapSum{};
+
+        while (!stack.empty())
+        {
+            const auto [nodeIdx, depth] = stack.back();
+            stack.pop_back();
+
+            const BVHNode& node = bvhNode[nodeIdx];
+            ++stats.nodeCount;
+
+            if (node.isLeaf())
+            {
+                ++stats.leafCount;
+                stats.maxDepth = std::max(stats.maxDepth, depth);
+                depthSum += depth;
+
+                const int primitiveCount = node.primitiveCount();
+                if (primitiveCount >= static_cast<int>(stats.leafSizeHistogram.size())) stats.leafSizeHistogram.resize(primitiveCount + 1);
+                ++stats.leafSizeHistogram[primitiveCount];
+                continue;
+            }
+
+            const BVHNode& leftChild = bvhNode[node.leftFirst];
+            const BVHNode& rightChild = bvhNode[node.leftFirst + 1];
+            const AABB overlap{ Vector3::Max(leftChild.aabbMin, rightChild.aabbMin), Vector3::Min(leftChild.aabbMax, rightChild.aabbMax) };
+            const float nodeArea = AABB{ node.aabbMin, node.aabbMax }.Area();
+            if (!IsEmpty(overlap) && nodeArea > 0.f) overlapSum += overlap.Area() / nodeArea;
+
+            stack.emplace_back(node.leftFirst, depth + 1);
+            stack.emplace_back(node.leftFirst + 1, depth + 1);
+        }
+
+        stats.averageDepth = static_cast<float>(static_cast<double>(depthSum) / stats.leafCount);
+
+        const int interiorCount = stats.nodeCount - stats.leafCount;
+        if (interiorCount > 0) stats.overlapRatio = overlapSum / static_cast<float>(interiorCount);
+
+        return stats;
+    }
+
+    int BVH::GetTriangleReferenceCount() const
+    {
+        //The triangles come first in the leaf order, see AssignLeafRanges
+        const auto firstSphere = std::partition_point(triangleIndex.begin(), triangleIndex.end(), [this](int primitiveIdx) { return !IsSphere(primitiveIdx); });
+        return static_cast<int>(firstSphere - triangleIndex.begin());
+    }
+
+    int BVH::GetBuildThreadCount() const
+    {
+        if (buildSettings.threadCount > 0) return buildSettings.threadCount;
+        return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    void BVH::UpdateNodeBounds( BVHNode& node, int threadCount ) const
+    {
+        const auto chunkBounds = [&](int begin, int end)
+        {
+            AABB bounds{};
+            for (int i = begin; i < end; ++i)
+            {
+                bounds.Grow(m_PrimitiveBounds[triangleIndex[node.leftFirst + i]]);
+            }
+            return bounds;
+        };
+
+        AABB bounds{};
+        if (node.triangleCount < m_ParallelNodeSize)
+        {
+            bounds = chunkBounds(0, node.triangleCount);
+        }
+        else
+        {
+            std::vector<AABB> chunks((node.triangleCount + m_BuildChunkSize - 1) / m_BuildChunkSize);
+            ForEachChunk(node.triangleCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+            {
+                chunks[chunkIdx] = chunkBounds(begin, end);
+            });
+
+            for (const AABB& chunk : chunks)
+            {
+                bounds.Grow(chunk);
+            }
+        }
+
+        node.aabbMin = bounds.min;
+        node.aabbMax = bounds.max;
+    }
+
+    void BVH::Subdivide( BuildContext& context, int nodeIdx )
+    {
+        BVHNode* nodes = context.pNodes;
+        BVHNode& node = nodes[nodeIdx];
+
+        // determine split axis and position
+        int axis{};
+        float splitPos{};
+        int rightFirst = node.leftFirst;
+
+        if (buildSettings.mode == BVHBuildMode::Midpoint)
+        {
+            // stop splitting when there is nothing more to split
+            if (node.triangleCount > 2)
+            {
+                FindMidpointSplitPlane(node, axis, splitPos);
+                rightFirst = PartitionTriangles(node, axis, splitPos, context.threadCount);
+            }
+        }
+        else if (buildSettings.mode == BVHBuildMode::LBVH)
+        {
+            // the primitives are sorted already, the split is just a position in the Morton order. Packed leaves are filled up to a whole pack
+            if (node.triangleCount > std::max(m_MortonLeafSize, GetLeafPackWidth())) rightFirst = FindMortonSplit(node);
+        }
+        else if (node.triangleCount > 1)
+        {
+            // stop splitting when it is more expensive than testing every primitive
+            const float splitCost = FindBestSplitPlane(node, context.threadCount, axis, splitPos);
+            if (splitCost < CalculateLeafCost(node)) rightFirst = PartitionTriangles(node, axis, splitPos, context.threadCount);
+        }
+
+        int leftCount = rightFirst - node.leftFirst;
+        
+        //This node becomes a leaf, unless it holds both triangles and spheres: a leaf holds one kind only, so split by type instead
+        if (leftCount == 0 || leftCount == node.triangleCount)
+        {
+            rightFirst = PartitionByType(node);
+            leftCount = rightFirst - node.leftFirst;
+
+            if (leftCount == 0 || leftCount == node.triangleCount) return;
+        }
+        
+        // Create child nodes for the left and right sub-nodes
+        const int leftChildIdx = context.nodesUsed++;
+        const int rightChildIdx = context.nodesUsed++;
+
+        // Update child node properties
+        nodes[leftChildIdx].leftFirst = node.leftFirst;
+        nodes[leftChildIdx].triangleCount = leftCount;
+        nodes[rightChildIdx].leftFirst = rightFirst;
+        nodes[rightChildIdx].triangleCount = node.triangleCount - leftCount;
+        node.leftFirst = leftChildIdx;
+        node.triangleCount = 0;
+        
+        // Update the bounding boxes of child nodes, the LBVH fits them afterwards in a single bottom-up pass
+        if (buildSettings.mode != BVHBuildMode::LBVH)
+        {
+            UpdateNodeBounds( nodes[leftChildIdx], context.threadCount );
+            UpdateNodeBounds( nodes[rightChildIdx], context.threadCount );
+        }
+
+        // Subdivide the children, or leave small ones for a subtree task
+        for (const int childIdx : { leftChildIdx, rightChildIdx })
+        {
+            if (context.pSubtreeRoots && nodes[childIdx].triangleCount < context.subtreeSize)
+            {
+                context.pSubtreeRoots->emplace_back(childIdx);
+            }
+            else
+            {
+                Subdivide( context, childIdx );
+            }
+        }
+    }
+
+    void BVH::BuildSubtrees(BuildContext& context, const std::vector<int>& subtreeRoots, int threadCount)
+    {
+        //Subtrees own disjoint ranges of triangleIndex, so they can be built at the same time.
+        //Every one gets its own node buffer with a copy of its root at index 0.
+        std::vector<std::vector<BVHNode>> subtreeNodes(subtreeRoots.size());
+        ForEachChunk(static_cast<int>(subtreeRoots.size()), 1, threadCount, [&](int subtreeIdx, int, int)
+        {
+            const BVHNode& root = context.pNodes[subtreeRoots[subtreeIdx]];
+
+            std::vector<BVHNode>& nodes = subtreeNodes[subtreeIdx];
+            nodes.resize(static_cast<size_t>(root.triangleCount) * 2);
+            nodes[0] = root;
+
+            BuildContext subtreeContext{};
+            subtreeContext.pNodes = nodes.data();
+            subtreeContext.nodesUsed = 1;
+
+            Subdivide( subtreeContext, 0 );
+            nodes.resize(subtreeContext.nodesUsed);
+
+            if (buildSettings.mode == BVHBuildMode::LBVH) FitNodeBounds(nodes.data(), subtreeContext.nodesUsed, false);
+        });
+
+        //Stitch them in the order they were found, not in the order they finished
+        for (size_t subtreeIdx{}; subtreeIdx < subtreeRoots.size(); ++subtreeIdx)
+        {
+            std::vector<BVHNode>& nodes = subtreeNodes[subtreeIdx];
+
+            //Local node 1 lands on the first free node, which starts a cache line like every left child
+            const int offset = context.nodesUsed - 1;
+            for (BVHNode& node : nodes)
+            {
+                if (!node.isLeaf()) node.leftFirst += offset;
+            }
+
+            context.pNodes[subtreeRoots[subtreeIdx]] = nodes[0];
+            std::copy(nodes.begin() + 1, nodes.end(), context.pNodes + context.nodesUsed);
+            context.nodesUsed += static_cast<int>(nodes.size()) - 1;
+        }
+    }
+
+    int BVH::PartitionTriangles(const BVHNode& node, int axis, float splitPos, int threadCount)
+    {
+        const auto isLeft = [&](int triIdx) { return m_PrimitiveCenters[triIdx][axis] < splitPos; };
+
+        if (node.triangleCount < m_ParallelNodeSize)
+        {
+            //Left pointer starts at the beginning of the array
+            //Right pointer starts at the end of the array
+            int leftPointer = node.leftFirst;
+            int rightPointer = leftPointer + node.triangleCount - 1;
+
+            while (leftPointer <= rightPointer)
+            {
+                // Check if the center coordinate of the current triangle is on the left side of the splitting plane
+                if (isLeft(triangleIndex[leftPointer]))
+                {
+                    ++leftPointer;
+                }
+                else
+                {
+                    // If the center coordinate is on the right side of the splitting plane, swap the triangles
+                    // This moves the right-side pointer to the left while maintaining order
+                    std::swap( triangleIndex[leftPointer], triangleIndex[rightPointer--] );
+                }
+            }
+
+            return leftPointer;
+        }
+
+        //Stable partition in two passes: count the left triangles of every chunk,
+        //then every chunk copies its triangles to its own offsets on both sides
+        const int chunkCount = (node.triangleCount + m_BuildChunkSize - 1) / m_BuildChunkSize;
+        std::vector<int> leftOffsets(chunkCount);
+        ForEachChunk(node.triangleCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+        {
+            int leftCount{};
+            for (int i = begin; i < end; ++i)
+            {
+                if (isLeft(triangleIndex[node.leftFirst + i])) ++leftCount;
+            }
+            leftOffsets[chunkIdx] = leftCount;
+        });
+
+        int totalLeft{};
+        for (int& leftOffset : leftOffsets)
+        {
+            const int leftCount = leftOffset;
+            leftOffset = totalLeft;
+            totalLeft += leftCount;
+        }
+
+        std::vector<int> partitioned(node.triangleCount);
+        ForEachChunk(node.triangleCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+        {
+            int leftIdx = leftOffsets[chunkIdx];
+            int rightIdx = totalLeft + begin - leftOffsets[chunkIdx];
+            for (int i = begin; i < end; ++i)
+            {
+                const int triIdx = triangleIndex[node.leftFirst + i];
+                if (isLeft(triIdx)) partitioned[leftIdx++] = triIdx;
+                else partitioned[rightIdx++] = triIdx;
+            }
+        });
+
+        std::copy(partitioned.begin(), partitioned.end(), triangleIndex.begin() + node.leftFirst);
+        return node.leftFirst + totalLeft;
+    }
+
+    void BVH::SortByMortonCode(int threadCount)
+    {
+        const int primitiveCount = static_cast<int>(triangleIndex.size());
+        const int chunkCount = (primitiveCount + m_BuildChunkSize - 1) / m_BuildChunkSize;
+
+        //Quantize the centers to a grid over their bounds
+        std::vector<AABB> chunkBounds(chunkCount);
+        ForEachChunk(primitiveCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                chunkBounds[chunkIdx].Grow(m_PrimitiveCenters[i]);
+            }
+        });
+
+        AABB centerBounds{};
+        for (const AABB& bounds : chunkBounds)
+        {
+            centerBounds.Grow(bounds);
+        }
+
+        const int bitsPerAxis = buildSettings.useWideMortonCodes ? 21 : 10;
+        const float maxCell = static_cast<float>((1 << bitsPerAxis) - 1);
+
+        Vector3 scale{};
+        for (int axis{}; axis < 3; ++axis)
+        {
+            const float extent = centerBounds.max[axis] - centerBounds.min[axis];
+            scale[axis] = extent > 0.f ? maxCell / extent : 0.f;
+        }
+
+        std::vector<uint64_t> codes(primitiveCount);
+        ForEachChunk(primitiveCount, m_BuildChunkSize, threadCount, [&](int, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                uint64_t code{};
+                for (int axis{}; axis < 3; ++axis)
+                {
+                    const float cell = std::clamp((m_PrimitiveCenters[i][axis] - centerBounds.min[axis]) * scale[axis], 0.f, maxCell);
+                    code |= ExpandMortonBits(static_cast<uint64_t>(cell)) << (2 - axis);
+                }
+                codes[i] = code;
+            }
+        });
+
+        //Least significant digit radix sort, 8 bits per pass. Every chunk counts its digits,
+        //then scatters to offsets that put the chunks in order, which keeps the sort stable and the same for every thread count.
+        constexpr int digitBits{ 8 };
+        constexpr int digitCount{ 1 << digitBits };
+        const int passCount = (3 * bitsPerAxis + digitBits - 1) / digitBits;
+
+        std::vector<uint64_t> sortedCodes(primitiveCount);
+        std::vector<int> sortedIndices(primitiveCount);
+        std::vector<std::array<int, digitCount>> chunkOffsets(chunkCount);
+
+        for (int pass{}; pass < passCount; ++pass)
+        {
+            const int shift = pass * digitBits;
+
+            ForEachChunk(primitiveCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+            {
+                std::array<int, digitCount>& histogram = chunkOffsets[chunkIdx];
+                histogram.fill(0);
+                for (int i = begin; i < end; ++i)
+                {
+                    ++histogram[(codes[i] >> shift) & (digitCount - 1)];
+                }
+            });
+
+            int offset{};
+            for (int digit{}; digit < digitCount; ++digit)
+            {
+                for (std::array<int, digitCount>& histogram : chunkOffsets)
+                {
+                    const int count = histogram[digit];
+                    histogram[digit] = offset;
+                    offset += count;
+                }
+            }
+
+            ForEachChunk(primitiveCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+            {
+                std::array<int, digitCount>& offsets = chunkOffsets[chunkIdx];
+                for (int i = begin; i < end; ++i)
+                {
+                    const int dst = offsets[(codes[i] >> shift) & (digitCount - 1)]++;
+                    sortedCodes[dst] = codes[i];
+                    sortedIndices[dst] = triangleIndex[i];
+                }
+            });
+
+            codes.swap(sortedCodes);
+            triangleIndex.swap(sortedIndices);
+        }
+
+        m_MortonCodes = std::move(codes);
+    }
+
+    int BVH::FindMortonSplit(const BVHNode& node) const
+    {
+        const int first = node.leftFirst;
+        const int last = node.leftFirst + node.triangleCount - 1;
+        const uint64_t firstCode = m_MortonCodes[first];
+        const uint64_t lastCode = m_MortonCodes[last];
+
+        //Centers in the same cell can't be told apart, split the range in half
+        if (firstCode == lastCode) return first + node.triangleCount / 2;
+
+        //Binary search for the last code that shares more leading bits with the first code than the last code does
+        const int commonPrefix = std::countl_zero(firstCode ^ lastCode);
+        int split = first;
+        int step = last - first;
+        do
+        {
+            step = (step + 1) / 2;
+            const int candidate = split + step;
+            if (candidate < last && std::countl_zero(firstCode ^ m_MortonCodes[candidate]) > commonPrefix) split = candidate;
+        }
+        while (step > 1);
+
+        return split + 1;
+    }
+
+    void BVH::FitNodeBounds(BVHNode* nodes, int nodeCount, bool hasPaddingNode) const
+    {
+        for (int nodeIdx = nodeCount - 1; nodeIdx >= 0; --nodeIdx)
+        {
+            if (hasPaddingNode && nodeIdx == 1) continue;
+
+            BVHNode& node = nodes[nodeIdx];
+
+            AABB bounds{};
+            if (node.isLeaf())
+            {
+                for (int i{}; i < node.triangleCount; ++i)
+                {
+                    bounds.Grow(m_PrimitiveBounds[triangleIndex[node.leftFirst + i]]);
+                }
+            }
+            else
+            {
+                bounds.Grow(AABB{ nodes[node.leftFirst].aabbMin, nodes[node.leftFirst].aabbMax });
+                bounds.Grow(AABB{ nodes[node.leftFirst + 1].aabbMin, nodes[node.leftFirst + 1].aabbMax });
+            }
+
+            node.aabbMin = bounds.min;
+            node.aabbMax = bounds.max;
+        }
+    }
+
+    void BVH::BuildSpatialSplitTree(int threadCount)
+    {
+        const int primitiveCount = amountOfTriangles + amountOfSpheres;
+        if (primitiveCount == 0) return;
+
+        //Room for the duplicates the budget allows, every reference can still end up in a leaf of its own
+        const int referenceBudget = primitiveCount + static_cast<int>(static_cast<float>(primitiveCount) * std::max(0.f, buildSettings.maxDuplication));
+        triangleIndex.resize(referenceBudget);
+        bvhNode.resize(static_cast<size_t>(referenceBudget) * 2);
+        m_PrimitiveCenters.reserve(referenceBudget);
+        m_PrimitiveBounds.reserve(referenceBudget);
+
+        //Every primitive starts out as a reference to itself
+        m_ReferencePrimitives.resize(primitiveCount);
+        for (int i{}; i < primitiveCount; ++i)
+        {
+            m_ReferencePrimitives[i] = i;
+        }
+
+        BVHNode& root = bvhNode[rootNodeIdx];
+        UpdateNodeBounds( root, threadCount );
+        m_MinSpatialSplitOverlap = buildSettings.spatialSplitOverlap * AABB{ root.aabbMin, root.aabbMax }.Area();
+
+        SubdivideSpatial( rootNodeIdx, referenceBudget, threadCount );
+
+        //Close the gaps the unused slots left between the leaves, depth first so neighbouring leaves stay close in memory
+        std::vector<int> leafOrder{};
+        leafOrder.reserve(m_PrimitiveBounds.size());
+
+        std::vector<int> stack{ rootNodeIdx };
+        while (!stack.empty())
+        {
+            BVHNode& node = bvhNode[stack.back()];
+            stack.pop_back();
+
+            if (!node.isLeaf())
+            {
+                stack.emplace_back(node.leftFirst + 1);
+                stack.emplace_back(node.leftFirst);
+                continue;
+            }
+
+            const int first = static_cast<int>(leafOrder.size());
+            for (int i{}; i < node.triangleCount; ++i)
+            {
+                leafOrder.emplace_back(m_ReferencePrimitives[triangleIndex[node.leftFirst + i]]);
+            }
+            node.leftFirst = first;
+        }
+
+        triangleIndex = std::move(leafOrder);
+
+        //The split off parts are only needed while building
+        m_ReferencePrimitives.clear();
+        m_PrimitiveCenters.resize(primitiveCount);
+        m_PrimitiveBounds.resize(primitiveCount);
+    }
+
+    void BVH::SubdivideSpatial(int nodeIdx, int sliceEnd, int threadCount)
+    {
+        BVHNode& node = bvhNode[nodeIdx];
+        const int first = node.leftFirst;
+
+        int leftCount{};
+        if (node.triangleCount > 1)
+        {
+            int axis{};
+            float splitPos{};
+            const float objectCost = FindBestSplitPlane(node, threadCount, axis, splitPos);
+
+            //Area the children of the object split share, when every center is in the same spot only a spatial split can separate them
+            const auto getObjectSplitOverlap = [&]()
+            {
+                if (objectCost == FLT_MAX) return FLT_MAX;
+
+                AABB leftBounds{};
+                AABB rightBounds{};
+                for (int i{}; i < node.triangleCount; ++i)
+                {
+                    const int referenceIdx = triangleIndex[first + i];
+                    AABB& side = m_PrimitiveCenters[referenceIdx][axis] < splitPos ? leftBounds : rightBounds;
+                    side.Grow(m_PrimitiveBounds[referenceIdx]);
+                }
+
+                const AABB overlap{ Vector3::Max(leftBounds.min, rightBounds.min), Vector3::Min(leftBounds.max, rightBounds.max) };
+                return IsEmpty(overlap) ? 0.f : overlap.Area();
+            };
+
+            //Only look for a spatial split when there are free slots and the object split leaves the children overlapping
+            float spatialCost = FLT_MAX;
+            int spatialAxis{};
+            int splitBin{};
+            if (sliceEnd - first > node.triangleCount && getObjectSplitOverlap() > m_MinSpatialSplitOverlap)
+            {
+                int referenceCount{};
+                spatialCost = FindBestSpatialSplit(node, spatialAxis, splitBin, referenceCount);
+
+                //The duplicates would not fit in the slots of this subtree
+                if (referenceCount > sliceEnd - first) spatialCost = FLT_MAX;
+            }
+
+            // stop splitting when it is more expensive than testing every primitive
+            const float leafCost = CalculateLeafCost(node);
+            if (spatialCost < objectCost && spatialCost < leafCost) leftCount = PartitionSpatial(node, spatialAxis, splitBin);
+            if (leftCount == 0 && objectCost < leafCost) leftCount = PartitionTriangles(node, axis, splitPos, threadCount) - first;
+        }
+
+        //Same as Subdivide, a leaf holds a single kind of primitive
+        if (leftCount == 0 || leftCount == node.triangleCount)
+        {
+            leftCount = PartitionByType(node) - first;
+            if (leftCount == 0 || leftCount == node.triangleCount) return;
+        }
+
+        const int rightCount = node.triangleCount - leftCount;
+
+        //Hand the free slots to the children in proportion to their references, the right references move up to make room for the left ones
+        const int freeCount = sliceEnd - first - node.triangleCount;
+        const int leftSliceEnd = first + leftCount + static_cast<int>(static_cast<int64_t>(freeCount) * leftCount / node.triangleCount);
+        const auto rightReferences = triangleIndex.begin() + first + leftCount;
+        std::copy_backward(rightReferences, rightReferences + rightCount, triangleIndex.begin() + leftSliceEnd + rightCount);
+
+        // Create child nodes for the left and right sub-nodes
+        const int leftChildIdx = nodesUsed++;
+        const int rightChildIdx = nodesUsed++;
+
+        bvhNode[leftChildIdx].leftFirst = first;
+        bvhNode[leftChildIdx].triangleCount = leftCount;
+        bvhNode[rightChildIdx].leftFirst = leftSliceEnd;
+        bvhNode[rightChildIdx].triangleCount = rightCount;
+        node.leftFirst = leftChildIdx;
+        node.triangleCount = 0;
+
+        UpdateNodeBounds( bvhNode[leftChildIdx], threadCount );
+        UpdateNodeBounds( bvhNode[rightChildIdx], threadCount );
+
+        SubdivideSpatial( leftChildIdx, leftSliceEnd, threadCount );
+        SubdivideSpatial( rightChildIdx, sliceEnd, threadCount );
+    }
+
+    float BVH::FindBestSpatialSplit(const BVHNode& node, int& axis, int& splitBin, int& referenceCount) const
+    {
+        struct Bin
+        {
+            AABB bounds{};
+
+            //References that start and end in this bin
+            int entryCount{};
+            int exitCount{};
+        };
+
+        const int binCount = std::clamp(buildSettings.binCount, 2, BVHBuildSettings::maxBinCount);
+        float bestCost = FLT_MAX;
+
+        for (int currentAxis{}; currentAxis < 3; ++currentAxis)
+        {
+            const SpatialBinning binning{ node.aabbMin[currentAxis], node.aabbMax[currentAxis], binCount };
+
+            //The node is flat on this axis
+            if (!binning.CanSplit()) continue;
+
+            //Every bin only grows by the part of a reference inside of it
+            std::array<Bin, BVHBuildSettings::maxBinCount> bins{};
+            for (int i{}; i < node.triangleCount; ++i)
+            {
+                const int referenceIdx = triangleIndex[node.leftFirst + i];
+                const AABB& bounds = m_PrimitiveBounds[referenceIdx];
+
+                const int entryBin = binning.GetBin(bounds.min[currentAxis]);
+                const int exitBin = binning.GetBin(bounds.max[currentAxis]);
+                ++bins[entryBin].entryCount;
+                ++bins[exitBin].exitCount;
+
+                if (entryBin == exitBin)
+                {
+                    bins[entryBin].bounds.Grow(bounds);
+                    continue;
+                }
+
+                for (int binIdx = entryBin; binIdx <= exitBin; ++binIdx)
+                {
+                    const float planeMin = binIdx == entryBin ? -FLT_MAX : binning.GetPlane(binIdx);
+                    const float planeMax = binIdx == exitBin ? FLT_MAX : binning.GetPlane(binIdx + 1);
+
+                    const AABB clipped = ClipReference(referenceIdx, currentAxis, planeMin, planeMax);
+                    if (!IsEmpty(clipped)) bins[binIdx].bounds.Grow(clipped);
+                }
+            }
+
+            //Sweep from both sides, a reference that straddles a plane counts on both of its sides
+            float leftArea[BVHBuildSettings::maxBinCount - 1]{};
+            float rightArea[BVHBuildSettings::maxBinCount - 1]{};
+            int leftCount[BVHBuildSettings::maxBinCount - 1]{};
+            int rightCount[BVHBuildSettings::maxBinCount - 1]{};
+
+            AABB leftBounds{};
+            AABB rightBounds{};
+            int leftSum{};
+            int rightSum{};
+
+            for (int i{}; i < binCount - 1; ++i)
+            {
+                leftSum += bins[i].entryCount;
+                leftCount[i] = leftSum;
+                leftBounds.Grow(bins[i].bounds);
+                leftArea[i] = leftBounds.Area();
+
+                rightSum += bins[binCount - 1 - i].exitCount;
+                rightCount[binCount - 2 - i] = rightSum;
+                rightBounds.Grow(bins[binCount - 1 - i].bounds);
+                rightArea[binCount - 2 - i] = rightBounds.Area();
+            }
+
+            for (int i{}; i < binCount - 1; ++i)
+            {
+                if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+
+                const float cost = GetLeafTestCount(leftCount[i]) * leftArea[i] + GetLeafTestCount(rightCount[i]) * rightArea[i];
+                if (cost < bestCost)
+                {
+                    axis = currentAxis;
+                    splitBin = i;
+                    referenceCount = leftCount[i] + rightCount[i];
+                    bestCost = cost;
+                }
+            }
+        }
+
+        if (bestCost == FLT_MAX) return FLT_MAX;
+
+        const AABB nodeBounds{ node.aabbMin, node.aabbMax };
+        return buildSettings.traversalCost + buildSettings.leafCost * bestCost / nodeBounds.Area();
+    }
+
+    int BVH::PartitionSpatial(BVHNode& node, int axis, int splitBin)
+    {
+        const int binCount = std::clamp(buildSettings.binCount, 2, BVHBuildSettings::maxBinCount);
+        const SpatialBinning binning{ node.aabbMin[axis], node.aabbMax[axis], binCount };
+        const float splitPos = binning.GetPlane(splitBin + 1);
+
+        struct StraddlingReference
+        {
+            int referenceIdx{};
+            AABB leftBounds{};
+            AABB rightBounds{};
+        };
+
+        //Decide the side of every reference first, so nothing has changed yet when a side turns out empty
+        std::vector<int> leftReferences{};
+        std::vector<int> rightReferences{};
+        std::vector<StraddlingReference> straddlingReferences{};
+
+        for (int i{}; i < node.triangleCount; ++i)
+        {
+            const int referenceIdx = triangleIndex[node.leftFirst + i];
+            const AABB& bounds = m_PrimitiveBounds[referenceIdx];
+
+            if (binning.GetBin(bounds.max[axis]) <= splitBin)
+            {
+                leftReferences.emplace_back(referenceIdx);
+            }
+            else if (binning.GetBin(bounds.min[axis]) > splitBin)
+            {
+                rightReferences.emplace_back(referenceIdx);
+            }
+            else
+            {
+                const AABB leftBounds = ClipReference(referenceIdx, axis, -FLT_MAX, splitPos);
+                const AABB rightBounds = ClipReference(referenceIdx, axis, splitPos, FLT_MAX);
+
+                //A primitive that only touches the plane has nothing on one of its sides
+                if (IsEmpty(rightBounds)) leftReferences.emplace_back(referenceIdx);
+                else if (IsEmpty(leftBounds)) rightReferences.emplace_back(referenceIdx);
+                else straddlingReferences.push_back({ referenceIdx, leftBounds, rightBounds });
+            }
+        }
+
+        if (leftReferences.size() + straddlingReferences.size() == 0 || rightReferences.size() + straddlingReferences.size() == 0) return 0;
+
+        //The reference keeps the part left of the plane, the part right of it becomes a new reference
+        for (const StraddlingReference& straddling : straddlingReferences)
+        {
+            const int rightReferenceIdx = static_cast<int>(m_PrimitiveBounds.size());
+            m_PrimitiveBounds.emplace_back(straddling.rightBounds);
+            m_PrimitiveCenters.emplace_back((straddling.rightBounds.min + straddling.rightBounds.max) * 0.5f);
+            m_ReferencePrimitives.emplace_back(m_ReferencePrimitives[straddling.referenceIdx]);
+
+            m_PrimitiveBounds[straddling.referenceIdx] = straddling.leftBounds;
+            m_PrimitiveCenters[straddling.referenceIdx] = (straddling.leftBounds.min + straddling.leftBounds.max) * 0.5f;
+
+            leftReferences.emplace_back(straddling.referenceIdx);
+            rightReferences.emplace_back(rightReferenceIdx);
+        }
+
+        const auto first = triangleIndex.begin() + node.leftFirst;
+        std::copy(rightReferences.begin(), rightReferences.end(), std::copy(leftReferences.begin(), leftReferences.end(), first));
+        node.triangleCount = static_cast<int>(leftReferences.size() + rightReferences.size());
+
+        return static_cast<int>(leftReferences.size());
+    }
+
+    AABB BVH::ClipReference(int referenceIdx, int axis, float planeMin, float planeMax) const
+    {
+        const AABB& bounds = m_PrimitiveBounds[referenceIdx];
+        const int primitiveIdx = m_ReferencePrimitives[referenceIdx];
+
+        //A sphere is not clipped exactly, its box is
+        AABB clipped{ bounds };
+        if (!IsSphere(primitiveIdx))
+        {
+            const BVHTriangle& triangle = m_BuildTriangles[primitiveIdx];
+            const Vector3 vertices[3]{ triangle.v0, triangle.v0 + triangle.edge1, triangle.v0 + triangle.edge2 };
+
+            //The clipped polygon consists of the vertices between the planes and the points where the edges cross them
+            clipped = AABB{};
+            for (int i{}; i < 3; ++i)
+            {
+                const Vector3& start = vertices[i];
+                const Vector3& end = vertices[(i + 1) % 3];
+
+                if (start[axis] >= planeMin && start[axis] <= planeMax) clipped.Grow(start);
+
+                for (const float plane : { planeMin, planeMax })
+                {
+                    if ((start[axis] < plane) == (end[axis] < plane)) continue;
+
+                    const float t = (plane - start[axis]) / (end[axis] - start[axis]);
+                    clipped.Grow(start + (end - start) * t);
+                }
+            }
+        }
+
+        //Earlier splits already cut the reference down to its bounds, and the crossings can be off the planes by a rounding error
+        clipped.min = Vector3::Max(clipped.min, bounds.min);
+        clipped.max = Vector3::Min(clipped.max, bounds.max);
+        clipped.min[axis] = std::max(clipped.min[axis], planeMin);
+        clipped.max[axis] = std::min(clipped.max[axis], planeMax);
+        return clipped;
+    }
+
+    int BVH::PartitionByType(const BVHNode& node)
+    {
+        if (amountOfSpheres == 0) return node.leftFirst + node.triangleCount;
+
+        //The SBVH partitions references, they point back at their primitive
+        const auto isTriangle = [this](int primitiveIdx)
+        {
+            return !IsSphere(m_ReferencePrimitives.empty() ? primitiveIdx : m_ReferencePrimitives[primitiveIdx]);
+        };
+
+        const auto first = triangleIndex.begin() + node.leftFirst;
+        if (m_MortonCodes.empty())
+        {
+            const auto spheresFirst = std::partition(first, first + node.triangleCount, isTriangle);
+            return static_cast<int>(spheresFirst - triangleIndex.begin());
+        }
+
+        //LBVH: the codes move along and both parts stay in Morton order, so FindMortonSplit still works on the children
+        std::vector<std::pair<int, uint64_t>> primitives(node.triangleCount);
+        for (int i{}; i < node.triangleCount; ++i)
+        {
+            primitives[i] = { triangleIndex[node.leftFirst + i], m_MortonCodes[node.leftFirst + i] };
+        }
+
+        const auto spheresFirst = std::stable_partition(primitives.begin(), primitives.end(), [&isTriangle](const std::pair<int, uint64_t>& primitive)
+        {
+            return isTriangle(primitive.first);
+        });
+
+        for (int i{}; i < node.triangleCount; ++i)
+        {
+            triangleIndex[node.leftFirst + i] = primitives[i].first;
+            m_MortonCodes[node.leftFirst + i] = primitives[i].second;
+        }
+        return node.leftFirst + static_cast<int>(spheresFirst - primitives.begin());
+    }
+
+    void BVH::FindMidpointSplitPlane(const BVHNode& node, int& axis, float& splitPos)
+    {
+        //Split the longest axis of the node
+        const Vector3 extent = node.aabbMax - node.aabbMin;
+        axis = 0;
+        if (extent.y > extent.x) axis = 1;
+        if (extent.z > extent[axis]) axis = 2;
+
+        // Calculate the position of the splitting plane (median of the chosen axis)
+        splitPos = node.aabbMin[axis] + extent[axis] * 0.5f;
+    }
+
+    float BVH::FindBestSplitPlane(const BVHNode& node, int threadCount, int& axis, float& splitPos) const
+    {
+        struct Bin
+        {
+            AABB bounds{};
+            int triangleCount{};
+        };
+
+        using AxisBins = std::array<std::array<Bin, BVHBuildSettings::maxBinCount>, 3>;
+
+        const int binCount = std::clamp(buildSettings.binCount, 2, BVHBuildSettings::maxBinCount);
+        float bestCost = FLT_MAX;
+
+        //Bin over the bounds of the triangle centers, not over the node bounds.
+        //This way no bins are wasted on the space the triangles stick out of.
+        const auto chunkCenterBounds = [&](int begin, int end)
+        {
+            AABB bounds{};
+            for (int i = begin; i < end; ++i)
+            {
+                bounds.Grow(m_PrimitiveCenters[triangleIndex[node.leftFirst + i]]);
+            }
+            return bounds;
+        };
+
+        //Drop every triangle in the bin its center falls in, on every axis at once
+        Vector3 scale{};
+        const auto chunkBins = [&](const AABB& centerBounds, int begin, int end, AxisBins& bins)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                const int triIdx = triangleIndex[node.leftFirst + i];
+                for (int currentAxis{}; currentAxis < 3; ++currentAxis)
+                {
+                    const float offset = m_PrimitiveCenters[triIdx][currentAxis] - centerBounds.min[currentAxis];
+                    const int binIdx = std::min(binCount - 1, static_cast<int>(offset * scale[currentAxis]));
+
+                    ++bins[currentAxis][binIdx].triangleCount;
+                    bins[currentAxis][binIdx].bounds.Grow(m_PrimitiveBounds[triIdx]);
+                }
+            }
+        };
+
+        //Large nodes are binned in chunks spread over the threads, merging boxes and counts gives the exact same bins
+        AABB centerBounds{};
+        AxisBins bins{};
+        const auto setScale = [&]()
+        {
+            for (int currentAxis{}; currentAxis < 3; ++currentAxis)
+            {
+                const float extent = centerBounds.max[currentAxis] - centerBounds.min[currentAxis];
+                scale[currentAxis] = extent > 0.f ? static_cast<float>(binCount) / extent : 0.f;
+            }
+        };
+
+        if (node.triangleCount < m_ParallelNodeSize)
+        {
+            centerBounds = chunkCenterBounds(0, node.triangleCount);
+            setScale();
+            chunkBins(centerBounds, 0, node.triangleCount, bins);
+        }
+        else
+        {
+            const int chunkCount = (node.triangleCount + m_BuildChunkSize - 1) / m_BuildChunkSize;
+
+            std::vector<AABB> chunkBounds(chunkCount);
+            ForEachChunk(node.triangleCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+            {
+                chunkBounds[chunkIdx] = chunkCenterBounds(begin, end);
+            });
+
+            for (const AABB& bounds : chunkBounds)
+            {
+                centerBounds.Grow(bounds);
+            }
+            setScale();
+
+            std::vector<AxisBins> binsPerChunk(chunkCount);
+            ForEachChunk(node.triangleCount, m_BuildChunkSize, threadCount, [&](int chunkIdx, int begin, int end)
+            {
+                chunkBins(centerBounds, begin, end, binsPerChunk[chunkIdx]);
+            });
+
+            for (const AxisBins& chunk : binsPerChunk)
+            {
+                for (int currentAxis{}; currentAxis < 3; ++currentAxis)
+                {
+                    for (int binIdx{}; binIdx < binCount; ++binIdx)
+                    {
+                        bins[currentAxis][binIdx].triangleCount += chunk[currentAxis][binIdx].triangleCount;
+                        bins[currentAxis][binIdx].bounds.Grow(chunk[currentAxis][binIdx].bounds);
+                    }
+                }
+            }
+        }
+
+        for (int currentAxis{}; currentAxis < 3; ++currentAxis)
+        {
+            const float boundsMin = centerBounds.min[currentAxis];
+            const float boundsMax = centerBounds.max[currentAxis];
+
+            //All centers lie on the same plane, this axis can't be split
+            if (boundsMin == boundsMax) continue;
+
+            const Bin* axisBins = bins[currentAxis].data();
+
+            //Sweep from both sides to get the area and triangle count on each side of every plane between two bins
+            float leftArea[BVHBuildSettings::maxBinCount - 1]{};
+            float rightArea[BVHBuildSettings::maxBinCount - 1]{};
+            int leftCount[BVHBuildSettings::maxBinCount - 1]{};
+            int rightCount[BVHBuildSettings::maxBinCount - 1]{};
+
+            AABB leftBounds{};
+            AABB rightBounds{};
+            int leftSum{};
+            int rightSum{};
+
+            for (int i{}; i < binCount - 1; ++i)
+            {
+                leftSum += axisBins[i].triangleCount;
+                leftCount[i] = leftSum;
+                leftBounds.Grow(axisBins[i].bounds);
+                leftArea[i] = leftBounds.Area();
+
+                rightSum += axisBins[binCount - 1 - i].triangleCount;
+                rightCount[binCount - 2 - i] = rightSum;
+                rightBounds.Grow(axisBins[binCount - 1 - i].bounds);
+                rightArea[binCount - 2 - i] = rightBounds.Area();
+            }
+
+            //Evaluate the cost of every plane
+            const float planeWidth = (boundsMax - boundsMin) / static_cast<float>(binCount);
+            for (int i{}; i < binCount - 1; ++i)
+            {
+                if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+
+                const float cost = GetLeafTestCount(leftCount[i]) * leftArea[i] + GetLeafTestCount(rightCount[i]) * rightArea[i];
+                if (cost < bestCost)
+                {
+                    axis = currentAxis;
+                    splitPos = boundsMin + planeWidth * static_cast<float>(i + 1);
+                    bestCost = cost;
+                }
+            }
+        }
+
+        if (bestCost == FLT_MAX) return FLT_MAX;
+
+        //Turn the summed area into the expected cost of a ray that hits this node
+        const AABB nodeBounds{ node.aabbMin, node.aabbMax };
+        return buildSettings.traversalCost + buildSettings.leafCost * bestCost / nodeBounds.Area();
+    }
+
+    float BVH::CalculateLeafCost(const BVHNode& node) const
+    {
+        return buildSettings.leafCost * GetLeafTestCount(node.triangleCount);
+    }
+
+    float BVH::GetLeafTestCount(int primitiveCount) const
+    {
+        const int packWidth = GetLeafPackWidth();
+        return static_cast<float>((primitiveCount + packWidth - 1) / packWidth);
+    }
+
+    int BVH::GetLeafPackWidth() const
+    {
+        //Widths without a pack layout test one triangle at a time
+        return buildSettings.leafPackWidth == 4 || buildSettings.leafPackWidth == 8 ? buildSettings.leafPackWidth : 1;
+    }
+    
+    void BVH::AppendMeshTriangles(const TriangleMesh& mesh, bool objectSpace)
+    {
+        const auto& positionsX = objectSpace ? mesh.positionsX : mesh.transformedPositionsX;
+        const auto& positionsY = objectSpace ? mesh.positionsY : mesh.transformedPositionsY;
+        const auto& positionsZ = objectSpace ? mesh.positionsZ : mesh.transformedPositionsZ;
+        const auto& normalsX = objectSpace ? mesh.normalsX : mesh.transformedNormalsX;
+        const auto& normalsY = objectSpace ? mesh.normalsY : mesh.transformedNormalsY;
+        const auto& normalsZ = objectSpace ? mesh.normalsZ : mesh.transformedNormalsZ;
+
+        if(positionsX.empty() || normalsX.empty())
+        {
+            assert(objectSpace || !"Transformed positions or normals are empty. Did you forget to call UpdateTransforms?");
+            return;
+        }
+
+        const auto& indices = mesh.indices;
+        for (size_t triIdx{}; triIdx < mesh.GetAmountOfTriangles(); ++triIdx)
+        {
+            const size_t vertexIdx = triIdx * 3;
+            const int i0 = indices[vertexIdx];
+            const int i1 = indices[vertexIdx + 1];
+            const int i2 = indices[vertexIdx + 2];
+
+            const Vector3 v0{ positionsX[i0], positionsY[i0], positionsZ[i0] };
+            const Vector3 v1{ positionsX[i1], positionsY[i1], positionsZ[i1] };
+            const Vector3 v2{ positionsX[i2], positionsY[i2], positionsZ[i2] };
+
+            BVHTriangle triangle{};
+            triangle.v0 = v0;
+            triangle.edge1 = v1 - v0;
+            triangle.edge2 = v2 - v0;
+
+            //The normals are normalized when the mesh is created and in UpdateTransforms already
+            triangle.normal = { normalsX[triIdx], normalsY[triIdx], normalsZ[triIdx] };
+            triangle.cullMode = mesh.cullMode;
+            triangle.materialIndex = mesh.materialIndex;
+
+            m_BuildTriangles.emplace_back(triangle);
+        }
     }
 }
\ No newline at end of file
@@ -1,47 +1,485 @@
 ﻿#pragma once
 #include "Vector3.h"
 #include "DataTypes.h"
+#include "WideBVH.h"
+#include "QuantizedBVH.h"
+#include "TrianglePack.h"
+#include "AlignedAllocator.h"
+#include "BVHStats.h"
+#include "Utils.h"
+#include <algorithm>
+#include <cstdint>
 
 namespace dae
 {
 struct Ray;    
+struct RayPacket;
+//32 bytes, the two children of a node are allocated next to each other and share a cache line
 struct BVHNode
 {
     Vector3 aabbMin;
-    Vector3 aabbMax;  
-    int leftChild;  
-    int  rightChild;
-    
-    int firstPrim; 
+
+    //Interior node: index of the left child, the right child follows it. Leaf: first triangle or sphere
+    int leftFirst;
+
+    Vector3 aabbMax;
+
+    //Leaf: amount of primitives, with sphereLeafFlag set when they are spheres
     int triangleCount;
+
+    //A leaf holds a single kind of primitive, so its count can say which one
+    static constexpr int sphereLeafFlag{ 1 << 30 };
     
-    bool isLeaf() {return triangleCount > 0;}
-    void Setup();
+    bool isLeaf() const {return triangleCount > 0;}
+    bool isSphereLeaf() const {return (triangleCount & sphereLeafFlag) != 0;}
+    int primitiveCount() const {return triangleCount & ~sphereLeafFlag;}
+};
+
+static_assert(sizeof(BVHNode) == 32, "Two BVH nodes have to fit in a cache line");
+
+struct AABB
+{
+    Vector3 min{ FLT_MAX, FLT_MAX, FLT_MAX };
+    Vector3 max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    void Grow(const Vector3& point)
+    {
+        min = Vector3::Min(min, point);
+        max = Vector3::Max(max, point);
+    }
+
+    void Grow(const AABB& other)
+    {
+        min = Vector3::Min(min, other.min);
+        max = Vector3::Max(max, other.max);
+    }
+
+    //Half of the surface area, the factor 2 cancels out in every SAH ratio
+    float Area() const
+    {
+        const Vector3 extent = max - min;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
 };
 
+    enum class BVHBuildMode
+    {
+        //Splits the longest axis in half, fast to build but can produce unbalanced trees
+        Midpoint,
+
+        //Bins the primitive centers and picks the split with the lowest surface area heuristic cost
+        BinnedSAH,
+
+        //Sorts the primitive centers along a Morton curve and splits where the highest differing bit flips.
+        //Builds in linear time for geometry that deforms every frame, the tree is slower to trace than a SAH tree
+        LBVH,
+
+        //Binned SAH that may also split the primitives straddling a plane, so long thin triangles stop inflating the boxes.
+        //Primitives end up in more than one leaf and the build is several times slower, meant for static geometry
+        SpatialSAH
+    };
+
+    inline const char* GetBuildModeName(BVHBuildMode mode)
+    {
+        switch (mode)
+        {
+        case BVHBuildMode::Midpoint: return "midpoint";
+        case BVHBuildMode::LBVH: return "LBVH";
+        case BVHBuildMode::SpatialSAH: return "SBVH";
+        default: return "binned SAH";
+        }
+    }
+
+    struct BVHBuildSettings
+    {
+        BVHBuildMode mode{ BVHBuildMode::BinnedSAH };
+
+        //Amount of bins per axis the SAH builder evaluates (clamped to [2, maxBinCount])
+        int binCount{ 16 };
+
+        //Cost of visiting a node, relative to leafCost
+        float traversalCost{ 1.f };
+
+        //Cost of testing a single primitive in a leaf
+        float leafCost{ 1.f };
+
+        //UpdateBVH rebuilds once refitting made the SAH cost this many times worse than after the last build
+        float rebuildThreshold{ 1.5f };
+
+        //Threads the builder may use, 0 uses every hardware thread. The tree does not depend on it
+        int threadCount{ 0 };
+
+        //LBVH: 63 instead of 30 bit Morton codes, for scenes that put many centers in the same cell of a 1024^3 grid
+        bool useWideMortonCodes{ false };
+
+        //SBVH: spatial splits are only searched when the children of the best object split overlap by more than this fraction of the root area
+        float spatialSplitOverlap{ 1e-5f };
+
+        //SBVH: references the spatial splits may add, as a fraction of the amount of primitives
+        float maxDuplication{ 0.3f };
+
+        //Triangles tested with one SIMD test, 4 or 8 stores the triangle leaves as TrianglePacks and 1 tests them one by one.
+        //The builder then counts packs instead of triangles in the leaf cost, so it prefers leaves that fill whole packs
+        int leafPackWidth{ 1 };
+
+        static constexpr int maxBinCount{ 64 };
+    };
+
+    enum class BVHTraversalMode
+    {
+        //Walks the binary tree, two box tests per node
+        Binary,
+
+        //Walks the tree collapsed to 4 children per node, the child boxes are tested with SSE
+        Wide4,
+
+        //Walks the tree collapsed to 8 children per node, the child boxes are tested with AVX when available
+        Wide8,
+
+        //Walks a copy of the binary tree with every box stored in 16 or 8 bits per coordinate, relative to its parent
+        Quantized16,
+        Quantized8,
+
+        COUNT
+    };
+
+    inline const char* GetTraversalModeName(BVHTraversalMode mode)
+    {
+        switch (mode)
+        {
+        case BVHTraversalMode::Wide4: return "4 wide";
+        case BVHTraversalMode::Wide8: return "8 wide";
+        case BVHTraversalMode::Quantized16: return "16 bit quantized";
+        case BVHTraversalMode::Quantized8: return "8 bit quantized";
+        default: return "binary";
+        }
+    }
+
+    //Per ray counters, filled in by the traversal when asked for
+    struct BVHTraversalStats
+    {
+        int nodesVisited{};
+        int boxTests{};
+        int trianglesTested{};
+        int spheresTested{};
+    };
+
+    //What blocked the last shadow ray towards a light, the next one is tested against it before any traversal
+    struct OcclusionHint
+    {
+        //TLAS instance, unused by a single BVH
+        int instanceIdx{ -1 };
+
+        //Index in the leaf order arrays, with BVHNode::sphereLeafFlag set for spheres
+        int primitiveIdx{ -1 };
+
+        bool IsValid() const { return primitiveIdx >= 0; }
+    };
 
     struct BVH
     {
-        void IntersectBVH(const Ray& ray, const int nodeIdx, HitRecord& hitRecord);
-        bool IntersectBVH(const Ray& ray, const int nodeIdx);
+        //Closest hit, iterative and front-to-back
+        void IntersectBVH(const Ray& ray, HitRecord& hitRecord, BVHTraversalStats* pStats = nullptr) const;
+
+        //Occlusion query for shadow rays: stops at the first hit in [ray.min, ray.max] and fills in no hit attributes.
+        //pOccluder receives the primitive that was hit, in the format of OcclusionHint::primitiveIdx.
+        bool IsOccluded(const Ray& ray, int* pOccluder = nullptr, BVHTraversalStats* pStats = nullptr) const;
+
+        //Tests a single primitive that IsOccluded returned before, stale indices after a rebuild simply miss
+        bool IsOccludedBy(const Ray& ray, int occluder) const;
+
+        //Closest hits of a packet of coherent rays, hitRecords holds a record per ray of the packet.
+        //Always walks the binary tree, a packet whose rays go different ways is traced one ray at a time.
+        void IntersectPacket(RayPacket& packet, HitRecord* hitRecords, BVHTraversalStats* pStats = nullptr) const;
+
+        //Occlusion of a packet of shadow rays, pOccluded holds a flag per ray. Flagged rays are skipped, the blocked ones get flagged.
+        //pOccluder receives the last primitive that blocked a ray, see IsOccluded
+        void IsPacketOccluded(RayPacket& packet, bool* pOccluded, int* pOccluder = nullptr, BVHTraversalStats* pStats = nullptr) const;
         
-        void BuildBVH(const std::vector<TriangleMesh>& triangleMeshes);
-        void UpdateNodeBounds( int nodeIdx );
-        static bool IntersectAABB(const Ray& ray, const Vector3 bmin, const Vector3 bmax, const HitRecord& hitRecord);
-        void Subdivide( int nodeIdx );
+        //Builds over the world space triangles of the meshes and the spheres, planes are unbounded and stay outside
+        void BuildBVH(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries = {});
+
+        //Builds over the untransformed (object space) triangles of a single mesh, used as bottom level of a TLAS
+        void BuildBLAS(const TriangleMesh& mesh);
+
+        //Builds over spheres only, they are already in world space
+        void BuildBLAS(const std::vector<Sphere>& sphereGeometries);
+
+        //Takes over a tree that was built over this mesh before, instead of building it again (see BVHCache)
+        void RestoreBLAS(const TriangleMesh& mesh, const BVHNode* nodes, int nodeCount, const int* leafOrder, int referenceCount);
+
+        //Refits when the meshes and spheres are still the ones the tree was built with, rebuilds when the quality degraded too far
+        void UpdateBVH(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries = {});
+
+        //Keeps the topology and recomputes the node bounds bottom-up from the transformed positions
+        void Refit(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries = {});
+
+        //Collapses or quantizes the tree into the layout the mode needs, can be changed at any time
+        void SetTraversalMode(BVHTraversalMode mode);
+        BVHTraversalMode GetTraversalMode() const { return m_TraversalMode; }
+
+        //Surface area heuristic cost of the whole tree, relative to the root
+        float CalculateSAHCost() const;
+
+        //References in the leaves per primitive, above 1 when the SBVH split primitives
+        float GetDuplicationRatio() const;
+
+        //Walks the whole tree for its depth, leaf sizes, overlap and memory, for comparing builders and layouts
+        BVHStats CalculateStats() const;
+
+        //Returns the distance at which the ray enters the box, or FLT_MAX when it misses or enters beyond maxDistance
+        static float IntersectAABB(const Ray& ray, const Vector3& bmin, const Vector3& bmax, float maxDistance);
+
+        //Tests the primitives of a leaf, count is the raw leaf count including the sphere flag.
+        //Shared by every traversal mode, the wide and quantized trees keep the leaves of the binary tree.
+        void IntersectLeaf(int first, int count, const Ray& ray, HitRecord& hitRecord, BVHTraversalStats* pStats) const;
+        bool IsLeafOccluding(int first, int count, const Ray& ray, int* pOccluder, BVHTraversalStats* pStats) const;
 
         // triangle count
-        std::vector<TriangleMesh> Meshes;
-        
-        //TriangleMesh m_Mesh;
-        int amountOfTriangles;
-        std::vector<BVHNode> bvhNode;
+        int amountOfTriangles{};
+        int amountOfSpheres{};
+        //Node 0 is the root, node 1 is never used so every pair of children starts on a cache line
+        std::vector<BVHNode, AlignedAllocator<BVHNode, 64>> bvhNode;
+
+        //Original index of every primitive, the spheres are numbered after the triangles.
+        //Holds the triangles in leaf order, followed by the spheres in leaf order. The SBVH lists a split primitive once per leaf it is in.
         std::vector<int> triangleIndex; 
+
+        //Primitives in leaf order, a leaf references triangles or spheres[leftFirst, leftFirst + primitiveCount())
+        std::vector<BVHTriangle> triangles;
+        std::vector<Sphere> spheres;
         int rootNodeIdx = 0;
-        int nodesUsed = 1;
+        int nodesUsed = 2;
 
         bool isBuild = false;
 
-        Triangle GetTriangleByIndex(int index) const;
+        BVHBuildSettings buildSettings{};
+
+    private:
+        //Stacks up to this size live on the stack of the thread, see TraversalStack
+        static constexpr int m_MaxStackDepth{ 64 };
+
+        void AppendMeshTriangles(const TriangleMesh& mesh, bool objectSpace);
+        void BuildFromGatheredPrimitives();
+
+        //Points the leaves into the per-type arrays and flags the sphere leaves, see triangleIndex
+        void AssignLeafRanges();
+
+        //Puts the gathered primitives in leaf order and prepares the tree for traversal
+        void FinishTree(int threadCount);
+
+        //Depth of the deepest leaf, the root is at depth 0
+        int CalculateMaxDepth() const;
+
+        //Where a part of the build writes its nodes to.
+        //The top of the tree goes straight into bvhNode, every subtree task fills its own buffer that is stitched in afterwards.
+        struct BuildContext
+        {
+            BVHNode* pNodes{};
+            int nodesUsed{};
+
+            //Threads the passes over a single large node may use
+            int threadCount{ 1 };
+
+            //Children with fewer primitives are handed to a subtree task instead of being split in place
+            int subtreeSize{};
+            std::vector<int>* pSubtreeRoots{};
+        };
+
+        //Nodes with at least this many primitives are binned and partitioned in chunks, spread over the build threads
+        static constexpr int m_ParallelNodeSize{ 16384 };
+        static constexpr int m_BuildChunkSize{ 4096 };
+
+        //The top of the tree is cut into about this many subtrees, which are built as independent tasks
+        static constexpr int m_SubtreeTaskCount{ 64 };
+        static constexpr int m_MinSubtreeSize{ 256 };
+
+        //The LBVH has no cost to stop at, ranges up to this size become a leaf
+        static constexpr int m_MortonLeafSize{ 4 };
+
+        int GetBuildThreadCount() const;
+        void Subdivide(BuildContext& context, int nodeIdx);
+        void BuildSubtrees(BuildContext& context, const std::vector<int>& subtreeRoots, int threadCount);
+        void UpdateNodeBounds(BVHNode& node, int threadCount) const;
+
+        //LBVH: radix sorts triangleIndex by the Morton code of the primitive centers, m_MortonCodes follows the same order
+        void SortByMortonCode(int threadCount);
+
+        //LBVH: returns where the right child starts, the first primitive whose code differs from the first one in the highest bit
+        int FindMortonSplit(const BVHNode& node) const;
+
+        //LBVH: the topology is built without bounds, this fills them in bottom-up.
+        //Children always come after their parent, node 1 is skipped when it is the padding node.
+        void FitNodeBounds(BVHNode* nodes, int nodeCount, bool hasPaddingNode) const;
+
+        //SBVH: builds the whole tree single threaded, except for the passes over large nodes.
+        //Every node owns the slots of triangleIndex up to a slice end, the ones past its references leave room for the duplicates of its subtree.
+        //While building, triangleIndex holds references: the original primitives, followed by the parts split off of them (see m_ReferencePrimitives).
+        void BuildSpatialSplitTree(int threadCount);
+        void SubdivideSpatial(int nodeIdx, int sliceEnd, int threadCount);
+
+        //SBVH: bins the clipped references on the node bounds, the counts of both sides include the references that straddle the plane
+        float FindBestSpatialSplit(const BVHNode& node, int& axis, int& splitBin, int& referenceCount) const;
+
+        //SBVH: puts the references of the node on both sides of the plane, the left ones from leftFirst on, the right ones after them.
+        //The node grows by the references that were split, returns the amount of left references or 0 when a side would stay empty.
+        int PartitionSpatial(BVHNode& node, int axis, int splitBin);
+
+        //SBVH: bounds of the part of the reference between the planes, empty when the reference does not get there
+        AABB ClipReference(int referenceIdx, int axis, float planeMin, float planeMax) const;
+
+        //Moves the primitives of the node with their center left of the plane to the front, returns where the right side starts
+        int PartitionTriangles(const BVHNode& node, int axis, float splitPos, int threadCount);
+
+        //Moves the triangles of the node in front of its spheres, returns where the spheres start
+        int PartitionByType(const BVHNode& node);
+        bool IsSphere(int primitiveIdx) const { return primitiveIdx >= amountOfTriangles; }
+
+        //Triangles in the leaf order arrays, more than amountOfTriangles when the SBVH split some of them
+        int GetTriangleReferenceCount() const;
+
+        //Returns the SAH cost of the best split, or FLT_MAX when there is no valid split
+        float FindBestSplitPlane(const BVHNode& node, int threadCount, int& axis, float& splitPos) const;
+        float CalculateLeafCost(const BVHNode& node) const;
+
+        //Primitive tests a leaf of this many triangles costs, the amount of packs it takes when the leaves are packed
+        float GetLeafTestCount(int primitiveCount) const;
+        int GetLeafPackWidth() const;
+        static void FindMidpointSplitPlane(const BVHNode& node, int& axis, float& splitPos);
+
+        //Walks the binary tree with a coherent packet, a node is visited when any active ray of the packet enters it.
+        //leafTest(leaf, firstGroup, hitMask) gets the first group that entered the leaf and which of its rays did, it returns true when the packet is done
+        template<typename LeafTest>
+        void TraversePacket(const RayPacket& packet, const LeafTest& leafTest, BVHTraversalStats* pStats) const;
+
+        //Brings the wide or quantized tree of the current traversal mode up to date with the binary tree
+        void UpdateTraversalLayout();
+
+        //Copies the triangle leaves into the packs of the width the tree was built for
+        void UpdateTrianglePacks();
+
+        float m_BuildSAHCost{};
+
+        BVHTraversalMode m_TraversalMode{ BVHTraversalMode::Binary };
+        BVH4 m_BVH4{};
+        BVH8 m_BVH8{};
+        QuantizedBVH16 m_QuantizedBVH16{};
+        QuantizedBVH8 m_QuantizedBVH8{};
+
+        //Only the packs of m_LeafPackWidth are filled, 1 when the leaves are tested one triangle at a time
+        int m_LeafPackWidth{ 1 };
+
+        //Most entries a traversal of the binary tree holds at once, set by FinishTree
+        int m_StackSize{ 1 };
+        TrianglePacks<4> m_TrianglePacks4{};
+        TrianglePacks<8> m_TrianglePacks8{};
+
+        //Build-time cache, so the builder does not walk the meshes for every triangle it touches
+        std::vector<BVHTriangle> m_BuildTriangles{};
+        std::vector<Sphere> m_BuildSpheres{};
+        std::vector<Vector3> m_PrimitiveCenters{};
+        std::vector<AABB> m_PrimitiveBounds{};
+        std::vector<uint64_t> m_MortonCodes{};
+
+        //SBVH: primitive of every reference, the bounds and centers of the references are in m_PrimitiveBounds and m_PrimitiveCenters
+        std::vector<int> m_ReferencePrimitives{};
+        float m_MinSpatialSplitOverlap{};
     };
+
+    inline float BVH::IntersectAABB(const Ray& ray, const Vector3& bmin, const Vector3& bmax, float maxDistance)
+    {
+        //Slab test on the precomputed inverse direction, only multiplies and min/max, so it compiles to branchless code
+        const float tx1 = (bmin.x - ray.origin.x) * ray.inverseDirection.x;
+        const float tx2 = (bmax.x - ray.origin.x) * ray.inverseDirection.x;
+
+        float tMin = std::min( tx1, tx2 );
+        float tMax = std::max( tx1, tx2 );
+
+        const float ty1 = (bmin.y - ray.origin.y) * ray.inverseDirection.y;
+        const float ty2 = (bmax.y - ray.origin.y) * ray.inverseDirection.y;
+
+        tMin = std::max( tMin, std::min( ty1, ty2 ) );
+        tMax = std::min( tMax, std::max( ty1, ty2 ) );
+
+        const float tz1 = (bmin.z - ray.origin.z) * ray.inverseDirection.z;
+        const float tz2 = (bmax.z - ray.origin.z) * ray.inverseDirection.z;
+
+        tMin = std::max( tMin, std::min( tz1, tz2 ) );
+        tMax = std::min( tMax, std::max( tz1, tz2 ) );
+
+        if (tMax >= tMin && tMin < maxDistance && tMax > 0) return tMin;
+        return FLT_MAX;
+    }
+
+    inline void BVH::IntersectLeaf(int first, int count, const Ray& ray, HitRecord& hitRecord, BVHTraversalStats* pStats) const
+    {
+        if (count & BVHNode::sphereLeafFlag)
+        {
+            count &= ~BVHNode::sphereLeafFlag;
+            if (pStats) pStats->spheresTested += count;
+
+            for (int i{}; i < count; ++i)
+            {
+                GeometryUtils::HitTest_Sphere(spheres[first + i], ray, hitRecord);
+            }
+            return;
+        }
+
+        if (pStats) pStats->trianglesTested += count;
+
+        if (m_LeafPackWidth == 8)
+        {
+            m_TrianglePacks8.Intersect(first, count, ray, hitRecord);
+            return;
+        }
+
+        if (m_LeafPackWidth == 4)
+        {
+            m_TrianglePacks4.Intersect(first, count, ray, hitRecord);
+            return;
+        }
+
+        for (int i{}; i < count; ++i)
+        {
+            GeometryUtils::HitTest_Triangle(triangles[first + i], ray, hitRecord);
+        }
+    }
+
+    inline bool BVH::IsLeafOccluding(int first, int count, const Ray& ray, int* pOccluder, BVHTraversalStats* pStats) const
+    {
+        if (count & BVHNode::sphereLeafFlag)
+        {
+            count &= ~BVHNode::sphereLeafFlag;
+            if (pStats) pStats->spheresTested += count;
+
+            for (int i{}; i < count; ++i)
+            {
+                if (!GeometryUtils::HitTest_Sphere(spheres[first + i], ray)) continue;
+
+                if (pOccluder) *pOccluder = (first + i) | BVHNode::sphereLeafFlag;
+                return true;
+            }
+            return false;
+        }
+
+        if (pStats) pStats->trianglesTested += count;
+
+        if (m_LeafPackWidth > 1)
+        {
+            const int occluder = m_LeafPackWidth == 8 ? m_TrianglePacks8.FindOccluder(first, count, ray) : m_TrianglePacks4.FindOccluder(first, count, ray);
+            if (occluder < 0) return false;
+
+            if (pOccluder) *pOccluder = occluder;
+            return true;
+        }
+
+        for (int i{}; i < count; ++i)
+        {
+            if (!GeometryUtils::HitTest_Triangle(triangles[first + i], ray)) continue;
+
+            if (pOccluder) *pOccluder = first + i;
+            return true;
+        }
+        return false;
+    }
 }
@@ -0,0 +1,111 @@
+#include "BVHStats.h"
+
+//Standard includes
+#include <fstream>
+
+//Project includes
+#include "BVHNode.h"
+
+namespace dae
+{
+	namespace
+	{
+		void WriteString(std::ostream& stream, const std::string& text)
+		{
+			stream << '"';
+			for (const char character : text)
+			{
+				if (character == '"' || character == '\\') stream << '\\';
+				stream << character;
+			}
+			stream << '"';
+		}
+
+		//Average per ray, 0 for an empty batch instead of a NaN that is no valid JSON
+		double GetAverage(int64_t total, int64_t rayCount)
+		{
+			return rayCount > 0 ? static_cast<double>(total) / static_cast<double>(rayCount) : 0.0;
+		}
+
+		void WriteRayStats(std::ostream& stream, const BVHRayStats& stats)
+		{
+			stream << "{ \"rays\": " << stats.rayCount
+				<< ", \"nodesPerRay\": " << GetAverage(stats.nodesVisited, stats.rayCount)
+				<< ", \"boxesPerRay\": " << GetAverage(stats.boxTests, stats.rayCount)
+				<< ", \"trianglesPerRay\": " << GetAverage(stats.trianglesTested, stats.rayCount)
+				<< ", \"spheresPerRay\": " << GetAverage(stats.spheresTested, stats.rayCount) << " }";
+		}
+
+		void WriteTreeStats(std::ostream& stream, const BVHStats& stats)
+		{
+			stream << "\t\t{\n\t\t\t\"name\": ";
+			WriteString(stream, stats.name);
+			stream << ",\n\t\t\t\"builder\": ";
+			WriteString(stream, stats.builder);
+			stream << ",\n\t\t\t\"leafPackWidth\": " << stats.leafPackWidth
+				<< ",\n\t\t\t\"sahCost\": " << stats.sahCost
+				<< ",\n\t\t\t\"nodes\": " << stats.nodeCount
+				<< ",\n\t\t\t\"leaves\": " << stats.leafCount
+				<< ",\n\t\t\t\"maxDepth\": " << stats.maxDepth
+				<< ",\n\t\t\t\"averageDepth\": " << stats.averageDepth
+				<< ",\n\t\t\t\"leafSizeHistogram\": [";
+
+			for (size_t i{}; i < stats.leafSizeHistogram.size(); ++i)
+			{
+				stream << (i > 0 ? ", " : "") << stats.leafSizeHistogram[i];
+			}
+
+			stream << "],\n\t\t\t\"memoryBytes\": " << stats.memoryUsed
+				<< ",\n\t\t\t\"overlapRatio\": " << stats.overlapRatio
+				<< ",\n\t\t\t\"duplicationRatio\": " << stats.duplicationRatio << "\n\t\t}";
+		}
+	}
+
+	void BVHRayStats::Add(const BVHTraversalStats& stats)
+	{
+		++rayCount;
+		nodesVisited += stats.nodesVisited;
+		boxTests += stats.boxTests;
+		trianglesTested += stats.trianglesTested;
+		spheresTested += stats.spheresTested;
+	}
+
+	void BVHReport::WriteJson(std::ostream& stream) const
+	{
+		stream << "{\n\t\"scene\": ";
+		WriteString(stream, sceneName);
+
+		stream << ",\n\t\"trees\": [\n";
+		for (size_t i{}; i < trees.size(); ++i)
+		{
+			if (i > 0) stream << ",\n";
+			WriteTreeStats(stream, trees[i]);
+		}
+
+		stream << "\n\t],\n\t\"traversalModes\": [\n";
+		for (size_t i{}; i < traversalModes.size(); ++i)
+		{
+			const BVHTraversalReport& report = traversalModes[i];
+			if (i > 0) stream << ",\n";
+
+			stream << "\t\t{\n\t\t\t\"mode\": ";
+			WriteString(stream, GetTraversalModeName(report.mode));
+			stream << ",\n\t\t\t\"raysPerSecond\": " << report.raysPerSecond << ",\n\t\t\t\"primaryRays\": ";
+			WriteRayStats(stream, report.primaryRays);
+			stream << ",\n\t\t\t\"shadowRays\": ";
+			WriteRayStats(stream, report.shadowRays);
+			stream << "\n\t\t}";
+		}
+
+		stream << "\n\t]\n}\n";
+	}
+
+	bool BVHReport::WriteJson(const std::string& path) const
+	{
+		std::ofstream file{ path, std::ios::trunc };
+		if (!file) return false;
+
+		WriteJson(file);
+		return static_cast<bool>(file);
+	}
+}
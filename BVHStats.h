@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace dae
+{
+	struct BVHTraversalStats;
+	enum class BVHTraversalMode;
+
+	//Counters of a batch of rays, summed from the per ray BVHTraversalStats
+	struct BVHRayStats
+	{
+		int64_t rayCount{};
+		int64_t nodesVisited{};
+		int64_t boxTests{};
+		int64_t trianglesTested{};
+		int64_t spheresTested{};
+
+		void Add(const BVHTraversalStats& stats);
+	};
+
+	//Quality of a built tree, filled in by BVH::CalculateStats
+	struct BVHStats
+	{
+		//What the tree is in the report, e.g. "BLAS 2"
+		std::string name{};
+		std::string builder{};
+
+		//Triangles per leaf pack, 1 when the leaves are not packed
+		int leafPackWidth{ 1 };
+
+		float sahCost{};
+		int nodeCount{};
+		int leafCount{};
+
+		//Depth of the leaves, the root is at depth 0
+		int maxDepth{};
+		float averageDepth{};
+
+		//Amount of leaves per primitive count, leafSizeHistogram[3] holds the leaves with 3 primitives
+		std::vector<int> leafSizeHistogram{};
+
+		//Nodes, leaf order and primitives, plus the wide or quantized copy of the current traversal mode
+		size_t memoryUsed{};
+
+		//Average over the interior nodes of the area both children cover, relative to the area of the node
+		float overlapRatio{};
+
+		//References in the leaves per primitive, see BVH::GetDuplicationRatio
+		float duplicationRatio{};
+	};
+
+	//Per ray cost of one traversal mode, measured on the rays of a render
+	struct BVHTraversalReport
+	{
+		BVHTraversalMode mode{};
+		double raysPerSecond{};
+		BVHRayStats primaryRays{};
+		BVHRayStats shadowRays{};
+	};
+
+	//Everything that is known about the acceleration structure of a scene, written as JSON so builders and layouts can be compared
+	struct BVHReport
+	{
+		std::string sceneName{};
+		std::vector<BVHStats> trees{};
+
+		//Empty until a benchmark traced rays through the trees
+		std::vector<BVHTraversalReport> traversalModes{};
+
+		void WriteJson(std::ostream& stream) const;
+
+		//Returns false when the file can't be written
+		bool WriteJson(const std::string& path) const;
+	};
+}
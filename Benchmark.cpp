@@ -0,0 +1,549 @@
+#include "Benchmark.h"
+
+//Standard includes
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+//Project includes
+#include "BVHNode.h"
+#include "CameraRays.h"
+#include "Counters.h"
+#include "Renderer.h"
+#include "Scene.h"
+#include "Timer.h"
+#include "Random/RandomNumberGenerator.h"
+
+namespace dae
+{
+	namespace
+	{
+		constexpr const char* g_TraversalStatsPath{ "BVHTraversalStats.json" };
+		constexpr const char* g_BuildStatsPath{ "BVHBuildStats.json" };
+
+		//1, 2, 4, ... and always maxThreadCount itself as the last one
+		std::vector<int> GetThreadCounts(int maxThreadCount)
+		{
+			std::vector<int> threadCounts{};
+			for (int threadCount{ 1 }; threadCount < maxThreadCount; threadCount *= 2)
+			{
+				threadCounts.emplace_back(threadCount);
+			}
+			threadCounts.emplace_back(maxThreadCount);
+			return threadCounts;
+		}
+
+		//The frames of a scene rendered on one thread count
+		struct FrameTimeStats
+		{
+			int threadCount{};
+			double p50{};
+			double p95{};
+			double p99{};
+			double min{};
+			double max{};
+			uint64_t imageHash{};
+
+#if RT_ENABLE_COUNTERS
+			//Of the last timed frame
+			CounterFrame counters{};
+#endif
+		};
+
+		struct SceneBenchmarkResult
+		{
+			std::string sceneName{};
+			double buildTime{};
+			int64_t primaryRayCount{};
+			int64_t shadowRayCount{};
+			std::vector<FrameTimeStats> threadScaling{};
+		};
+
+		//Nearest rank, sortedTimes is not empty
+		double GetPercentile(const std::vector<double>& sortedTimes, double percentile)
+		{
+			const auto rank = static_cast<size_t>(std::ceil(percentile / 100.0 * static_cast<double>(sortedTimes.size())));
+			return sortedTimes[std::clamp(rank, size_t{ 1 }, sortedTimes.size()) - 1];
+		}
+
+		//FNV-1a over the pixels, the same hash from two builds means they rendered the same image
+		uint64_t HashImage(const uint32_t* pPixels, int pixelCount)
+		{
+			uint64_t hash{ 14695981039346656037ull };
+			for (int pixelIdx{}; pixelIdx < pixelCount; ++pixelIdx)
+			{
+				for (int byteIdx{}; byteIdx < 4; ++byteIdx)
+				{
+					hash ^= (pPixels[pixelIdx] >> (byteIdx * 8)) & 0xff;
+					hash *= 1099511628211ull;
+				}
+			}
+			return hash;
+		}
+
+		//The renderer shoots a shadow ray towards every light from every primary hit, so the count only depends on the view and is found once, outside the timed frames
+		int64_t CountShadowRays(Scene* pScene, int width, int height)
+		{
+			CameraRayGenerator cameraRays{};
+			cameraRays.Setup(pScene->GetCamera(), width, height);
+
+			int64_t hitCount{};
+			for (int py{}; py < height; ++py)
+			{
+				for (int px{}; px < width; ++px)
+				{
+					HitRecord closestHit{};
+					pScene->GetClosestHit(cameraRays.GetRay(px, py), closestHit);
+					if (closestHit.didHit) ++hitCount;
+				}
+			}
+
+			return hitCount * static_cast<int64_t>(pScene->GetLights().size());
+		}
+
+		void WriteSceneResult(std::ostream& stream, const SceneBenchmarkResult& result)
+		{
+			//Rays per second at the median frame time
+			const auto perSecond = [](int64_t rayCount, double frameTime) { return frameTime > 0.0 ? static_cast<double>(rayCount) * 1000.0 / frameTime : 0.0; };
+
+			stream << "\t\t{\n\t\t\t\"scene\": \"" << result.sceneName << "\""
+				<< ",\n\t\t\t\"buildTimeMs\": " << result.buildTime
+				<< ",\n\t\t\t\"primaryRaysPerFrame\": " << result.primaryRayCount
+				<< ",\n\t\t\t\"shadowRaysPerFrame\": " << result.shadowRayCount
+				<< ",\n\t\t\t\"threadScaling\": [\n";
+
+			const double singleThreadTime = result.threadScaling.front().p50;
+			for (size_t i{}; i < result.threadScaling.size(); ++i)
+			{
+				const FrameTimeStats& stats = result.threadScaling[i];
+				if (i > 0) stream << ",\n";
+
+				stream << "\t\t\t\t{ \"threads\": " << stats.threadCount
+					<< ", \"frameTimeMs\": { \"p50\": " << stats.p50 << ", \"p95\": " << stats.p95 << ", \"p99\": " << stats.p99
+					<< ", \"min\": " << stats.min << ", \"max\": " << stats.max << " }"
+					<< ", \"primaryRaysPerSecond\": " << perSecond(result.primaryRayCount, stats.p50)
+					<< ", \"shadowRaysPerSecond\": " << perSecond(result.shadowRayCount, stats.p50)
+					<< ", \"speedup\": " << singleThreadTime / stats.p50
+					<< ", \"imageHash\": \"" << std::hex << std::setw(16) << std::setfill('0') << stats.imageHash << std::dec << std::setfill(' ') << "\"";
+
+#if RT_ENABLE_COUNTERS
+				stream << ", \"counters\": {";
+				for (int counterIdx{}; counterIdx < static_cast<int>(Counter::COUNT); ++counterIdx)
+				{
+					stream << " \"" << Counters::GetCounterName(static_cast<Counter>(counterIdx)) << "\": " << stats.counters.values[counterIdx] << ",";
+				}
+				stream << " \"busyTimeMs\": " << stats.counters.GetBusyTime() << ", \"idleTimeMs\": " << stats.counters.GetIdleTime() << " }";
+#endif
+
+				stream << " }";
+			}
+
+			stream << "\n\t\t\t]\n\t\t}";
+		}
+
+		//The box test as it was before the ray carried its inverse direction, kept as the baseline
+		float IntersectAABB_Divisions(const Ray& ray, const Vector3& bmin, const Vector3& bmax, float maxDistance)
+		{
+			const float tx1 = (bmin.x - ray.origin.x) / ray.direction.x;
+			const float tx2 = (bmax.x - ray.origin.x) / ray.direction.x;
+
+			float tMin = std::min(tx1, tx2);
+			float tMax = std::max(tx1, tx2);
+
+			const float ty1 = (bmin.y - ray.origin.y) / ray.direction.y;
+			const float ty2 = (bmax.y - ray.origin.y) / ray.direction.y;
+
+			tMin = std::max(tMin, std::min(ty1, ty2));
+			tMax = std::min(tMax, std::max(ty1, ty2));
+
+			const float tz1 = (bmin.z - ray.origin.z) / ray.direction.z;
+			const float tz2 = (bmax.z - ray.origin.z) / ray.direction.z;
+
+			tMin = std::max(tMin, std::min(tz1, tz2));
+			tMax = std::min(tMax, std::max(tz1, tz2));
+
+			if (tMax >= tMin && tMin < maxDistance && tMax > 0) return tMin;
+			return FLT_MAX;
+		}
+
+		template<typename BoxTest>
+		double TimeBoxTests(const std::vector<Ray>& rays, const std::vector<AABB>& boxes, int boxTestCount, BoxTest boxTest, int& hitCount)
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			//Every ray meets every box, as often as needed to reach the requested amount of tests
+			hitCount = 0;
+			for (int testsDone{}; testsDone < boxTestCount; testsDone += static_cast<int>(rays.size() * boxes.size()))
+			{
+				for (const AABB& box : boxes)
+				{
+					for (const Ray& ray : rays)
+					{
+						if (boxTest(ray, box.min, box.max, FLT_MAX) != FLT_MAX) ++hitCount;
+					}
+				}
+			}
+
+			const auto end = std::chrono::high_resolution_clock::now();
+			return std::chrono::duration<double, std::milli>(end - start).count();
+		}
+
+		//Bumpy grid in the XZ plane, big enough for the build to be worth spreading over threads
+		TriangleMesh CreateTerrainMesh(int gridSize)
+		{
+			TriangleMesh terrain{};
+			for (int z{}; z <= gridSize; ++z)
+			{
+				for (int x{}; x <= gridSize; ++x)
+				{
+					terrain.positionsX.emplace_back(static_cast<float>(x));
+					terrain.positionsY.emplace_back(RandomNumberGenerator::GetRandomValue(0.f, 2.f));
+					terrain.positionsZ.emplace_back(static_cast<float>(z));
+				}
+			}
+
+			for (int z{}; z < gridSize; ++z)
+			{
+				for (int x{}; x < gridSize; ++x)
+				{
+					const int corner = z * (gridSize + 1) + x;
+					terrain.indices.insert(terrain.indices.end(), { corner, corner + gridSize + 1, corner + 1 });
+					terrain.indices.insert(terrain.indices.end(), { corner + 1, corner + gridSize + 1, corner + gridSize + 2 });
+				}
+			}
+
+			terrain.CalculateNormals();
+			return terrain;
+		}
+
+		bool HasSameTree(const BVH& a, const BVH& b)
+		{
+			if (a.nodesUsed != b.nodesUsed || a.triangleIndex != b.triangleIndex) return false;
+			return std::memcmp(a.bvhNode.data(), b.bvhNode.data(), sizeof(BVHNode) * a.nodesUsed) == 0;
+		}
+	}
+
+	void Benchmark::RunAABBMicroBenchmark(int boxTestCount)
+	{
+		//Small enough to stay in the cache, we want the cost of the test and not of the memory
+		constexpr size_t rayCount{ 1024 };
+		constexpr size_t boxCount{ 1024 };
+
+		std::vector<Ray> rays{};
+		rays.reserve(rayCount);
+		for (size_t i{}; i < rayCount; ++i)
+		{
+			Vector3 direction{ Vector3::GetRandomUnitVector() };
+
+			//Every 8th ray is axis aligned, those hit the zero direction components
+			if (i % 8 == 0) direction = (i % 16 == 0) ? Vector3::UnitZ : -Vector3::UnitX;
+
+			rays.emplace_back(Vector3::GetRandomVector3(-5.f, 5.f), direction);
+		}
+
+		std::vector<AABB> boxes(boxCount);
+		for (AABB& box : boxes)
+		{
+			box.Grow(Vector3::GetRandomVector3(-5.f, 5.f));
+			box.Grow(Vector3::GetRandomVector3(-5.f, 5.f));
+		}
+
+		int divisionHits{};
+		int slabHits{};
+		const double divisionTime = TimeBoxTests(rays, boxes, boxTestCount, IntersectAABB_Divisions, divisionHits);
+		const double slabTime = TimeBoxTests(rays, boxes, boxTestCount, BVH::IntersectAABB, slabHits);
+
+		//The loops only stop after a full pass over every ray and box
+		const int testsPerPass = static_cast<int>(rayCount * boxCount);
+		const int testCount = (boxTestCount + testsPerPass - 1) / testsPerPass * testsPerPass;
+		const double millions = static_cast<double>(testCount) / 1'000'000.0;
+
+		std::cout << "**AABB MICROBENCHMARK** (" << testCount << " box tests)\n";
+		std::cout << ">> DIVISIONS = " << divisionTime / millions << " ms per million (" << divisionHits << " hits)\n";
+		std::cout << ">> SLAB      = " << slabTime / millions << " ms per million (" << slabHits << " hits)\n";
+		std::cout << ">> SPEEDUP   = " << divisionTime / slabTime << "x" << std::endl;
+	}
+
+	void Benchmark::RunTraversalBenchmark(Scene* pScene, int width, int height)
+	{
+		//Same primary rays as the renderer shoots, generated once so only the traversal is timed
+		CameraRayGenerator cameraRays{};
+		cameraRays.Setup(pScene->GetCamera(), width, height);
+
+		std::vector<Ray> rays{};
+		rays.reserve(static_cast<size_t>(width) * height);
+		for (int py{}; py < height; ++py)
+		{
+			for (int px{}; px < width; ++px)
+			{
+				rays.emplace_back(cameraRays.GetRay(px, py));
+			}
+		}
+
+		const BVHTraversalMode startMode = pScene->GetTraversalMode();
+		const std::vector<Light>& lights = pScene->GetLights();
+		BVHReport report{ pScene->CreateBVHReport() };
+
+		std::cout << "**TRAVERSAL BENCHMARK** (" << rays.size() << " primary rays)\n";
+		for (int modeIdx{}; modeIdx < static_cast<int>(BVHTraversalMode::COUNT); ++modeIdx)
+		{
+			const auto mode = static_cast<BVHTraversalMode>(modeIdx);
+			pScene->SetTraversalMode(mode);
+
+			BVHTraversalReport& modeReport = report.traversalModes.emplace_back();
+			modeReport.mode = mode;
+
+			//Only the primary rays are timed, the per ray counters are kept apart so counting does not slow the timed loop
+			std::vector<HitRecord> closestHits(rays.size());
+			const auto start = std::chrono::high_resolution_clock::now();
+			for (size_t rayIdx{}; rayIdx < rays.size(); ++rayIdx)
+			{
+				pScene->GetClosestHit(rays[rayIdx], closestHits[rayIdx]);
+			}
+			const auto end = std::chrono::high_resolution_clock::now();
+			modeReport.raysPerSecond = static_cast<double>(rays.size()) / std::chrono::duration<double>(end - start).count();
+
+			for (const Ray& ray : rays)
+			{
+				BVHTraversalStats stats{};
+				HitRecord closestHit{};
+				pScene->GetClosestHit(ray, closestHit, &stats);
+				modeReport.primaryRays.Add(stats);
+			}
+
+			//The shadow rays the renderer shoots from every hit, with an occlusion hint per light like it keeps
+			std::vector<OcclusionHint> occlusionHints(lights.size());
+			for (const HitRecord& closestHit : closestHits)
+			{
+				if (!closestHit.didHit) continue;
+
+				constexpr float rayOffset{ 0.001f };
+				const Vector3 offsetPosition{ closestHit.origin + closestHit.normal * rayOffset };
+				for (size_t lightIdx{}; lightIdx < lights.size(); ++lightIdx)
+				{
+					Vector3 lightDirection{ LightUtils::GetDirectionToLight(lights[lightIdx], offsetPosition) };
+					const float lightDistance{ lightDirection.Magnitude() };
+					lightDirection /= lightDistance;
+
+					BVHTraversalStats stats{};
+					pScene->DoesHit(Ray{ offsetPosition, lightDirection, FLT_MIN, lightDistance }, &occlusionHints[lightIdx], &stats);
+					modeReport.shadowRays.Add(stats);
+				}
+			}
+
+			const auto perRay = [](int64_t total, int64_t rayCount) { return rayCount > 0 ? static_cast<double>(total) / rayCount : 0.0; };
+			const BVHRayStats& primary = modeReport.primaryRays;
+			const BVHRayStats& shadow = modeReport.shadowRays;
+
+			std::cout << ">> " << GetTraversalModeName(mode) << " = " << modeReport.raysPerSecond / 1'000'000.0 << " Mrays/s, "
+				<< perRay(primary.nodesVisited, primary.rayCount) << " nodes, "
+				<< perRay(primary.trianglesTested, primary.rayCount) << " triangles and "
+				<< perRay(primary.spheresTested, primary.rayCount) << " spheres per ray\n";
+			std::cout << ">>   shadow rays = " << perRay(shadow.nodesVisited, shadow.rayCount) << " nodes, "
+				<< perRay(shadow.trianglesTested, shadow.rayCount) << " triangles and "
+				<< perRay(shadow.spheresTested, shadow.rayCount) << " spheres per ray\n";
+		}
+
+		if (report.WriteJson(g_TraversalStatsPath)) std::cout << ">> STATS WRITTEN TO " << g_TraversalStatsPath << "\n";
+		std::cout << std::flush;
+
+		pScene->SetTraversalMode(startMode);
+	}
+
+	void Benchmark::RunBuildBenchmark(Scene* pScene, int gridSize)
+	{
+		std::vector<TriangleMesh> meshes{ pScene->GetTriangleMeshGeometries() };
+		meshes.emplace_back(CreateTerrainMesh(gridSize));
+
+		size_t triangleCount{};
+		for (const TriangleMesh& mesh : meshes)
+		{
+			triangleCount += mesh.GetAmountOfTriangles();
+		}
+
+		const std::vector<int> threadCounts{ GetThreadCounts(std::max(1, static_cast<int>(std::thread::hardware_concurrency()))) };
+
+		std::cout << "**BUILD BENCHMARK** (" << meshes.size() << " meshes, " << triangleCount << " triangles)\n";
+
+		//The terrain tree of every builder, side by side
+		BVHReport report{};
+		report.sceneName = "terrain";
+
+		for (const BVHBuildMode mode : { BVHBuildMode::BinnedSAH, BVHBuildMode::LBVH, BVHBuildMode::SpatialSAH })
+		{
+			std::cout << "> " << GetBuildModeName(mode) << "\n";
+
+			//The single threaded trees are the reference every other thread count has to match
+			std::vector<BVH> referenceTrees(meshes.size());
+			double referenceTime{};
+
+			for (int threadCount : threadCounts)
+			{
+				//Best of a few builds, the first one also pays for warming up the allocator
+				constexpr int buildCount{ 3 };
+				double bestTime = DBL_MAX;
+				bool isDeterministic = true;
+
+				for (int build{}; build < buildCount; ++build)
+				{
+					std::vector<BVH> trees(meshes.size());
+
+					const auto start = std::chrono::high_resolution_clock::now();
+					for (size_t i{}; i < meshes.size(); ++i)
+					{
+						trees[i].buildSettings.mode = mode;
+						trees[i].buildSettings.threadCount = threadCount;
+						trees[i].BuildBLAS(meshes[i]);
+					}
+					const auto end = std::chrono::high_resolution_clock::now();
+					bestTime = std::min(bestTime, std::chrono::duration<double, std::milli>(end - start).count());
+
+					if (threadCount == 1)
+					{
+						referenceTrees = std::move(trees);
+						continue;
+					}
+
+					for (size_t i{}; i < meshes.size(); ++i)
+					{
+						isDeterministic &= HasSameTree(trees[i], referenceTrees[i]);
+					}
+				}
+
+				if (threadCount == 1) referenceTime = bestTime;
+
+				std::cout << ">> " << threadCount << " THREADS = " << bestTime << " ms, " << referenceTime / bestTime << "x"
+					<< (isDeterministic ? "" : " (TREE DIFFERS FROM 1 THREAD)") << "\n";
+			}
+
+			//Build speed is traded against trace speed, the SAH cost of the largest tree shows the second half
+			//The SBVH pays for its lower cost with primitives that are referenced from more than one leaf
+			std::cout << ">> TERRAIN SAH COST = " << referenceTrees.back().CalculateSAHCost()
+				<< ", " << referenceTrees.back().GetDuplicationRatio() << " references per primitive\n";
+
+			report.trees.emplace_back(referenceTrees.back().CalculateStats());
+			report.trees.back().name = "terrain";
+		}
+
+		if (report.WriteJson(g_BuildStatsPath)) std::cout << ">> STATS WRITTEN TO " << g_BuildStatsPath << "\n";
+		std::cout << std::flush;
+	}
+
+	bool Benchmark::RunSceneBenchmark(const SceneBenchmarkSettings& settings)
+	{
+		const int hardwareThreadCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		const int maxThreadCount = settings.maxThreadCount > 0 ? settings.maxThreadCount : hardwareThreadCount;
+		const int frameCount = std::max(1, settings.frameCount);
+
+		std::cout << "**SCENE BENCHMARK** (" << settings.width << "x" << settings.height << ", "
+			<< settings.warmupFrameCount << " warmup and " << frameCount << " timed frames per thread count)\n";
+
+		std::vector<SceneBenchmarkResult> results{};
+		for (const std::string& sceneName : SceneUtils::GetSceneNames())
+		{
+			Scene* pScene = SceneUtils::CreateScene(sceneName);
+			pScene->Initialize();
+
+			SceneBenchmarkResult& result = results.emplace_back();
+			result.sceneName = sceneName;
+			result.buildTime = pScene->GetBuildTime();
+
+			//The clock never runs, every frame updates the scene to the same moment
+			Timer timer{};
+			if (settings.animationTime > 0.f)
+			{
+				timer.SetFixedTimeStep(settings.animationTime);
+				timer.Start();
+				timer.Update();
+			}
+
+			//Headless there is no input to move the camera, it is put back every frame anyway so nothing can drift
+			const Camera startCamera{ pScene->GetCamera() };
+			pScene->Update(&timer);
+			result.shadowRayCount = CountShadowRays(pScene, settings.width, settings.height);
+
+			//Without accumulation every frame is one full sample per pixel, the same work every frame
+			Renderer renderer{ settings.width, settings.height };
+			renderer.SetAccumulation(false);
+
+			std::cout << "> " << sceneName << ", BVH built in " << result.buildTime << " ms\n";
+
+			for (const int threadCount : GetThreadCounts(maxThreadCount))
+			{
+				renderer.SetThreadCount(threadCount);
+
+				std::vector<double> frameTimes{};
+				frameTimes.reserve(frameCount);
+				for (int frameIdx{}; frameIdx < settings.warmupFrameCount + frameCount; ++frameIdx)
+				{
+					pScene->GetCamera() = startCamera;
+
+					//A frame is what the window loop does: update the scene, which refits the animated ones, and render it
+					const auto start = std::chrono::high_resolution_clock::now();
+					pScene->Update(&timer);
+					renderer.Render(pScene);
+					const auto end = std::chrono::high_resolution_clock::now();
+
+					if (frameIdx >= settings.warmupFrameCount) frameTimes.emplace_back(std::chrono::duration<double, std::milli>(end - start).count());
+				}
+
+				result.primaryRayCount = renderer.GetFrameRayCount();
+				std::sort(frameTimes.begin(), frameTimes.end());
+
+				FrameTimeStats& stats = result.threadScaling.emplace_back();
+				stats.threadCount = threadCount;
+				stats.p50 = GetPercentile(frameTimes, 50.0);
+				stats.p95 = GetPercentile(frameTimes, 95.0);
+				stats.p99 = GetPercentile(frameTimes, 99.0);
+				stats.min = frameTimes.front();
+				stats.max = frameTimes.back();
+				stats.imageHash = HashImage(renderer.GetPixels(), settings.width * settings.height);
+#if RT_ENABLE_COUNTERS
+				stats.counters = Counters::GetLastFrame();
+#endif
+
+				const bool isSameImage = stats.imageHash == result.threadScaling.front().imageHash;
+				std::cout << ">> " << threadCount << " THREADS = " << stats.p50 << " / " << stats.p95 << " / " << stats.p99 << " ms (p50 / p95 / p99), "
+					<< static_cast<double>(result.primaryRayCount + result.shadowRayCount) * 1000.0 / stats.p50 / 1'000'000.0 << " Mrays/s, "
+					<< result.threadScaling.front().p50 / stats.p50 << "x" << (isSameImage ? "" : " (IMAGE DIFFERS FROM 1 THREAD)") << "\n";
+#if RT_ENABLE_COUNTERS
+				Counters::Print(std::cout, stats.counters);
+#endif
+			}
+
+			delete pScene;
+		}
+
+		std::ofstream file{ settings.outputPath, std::ios::trunc };
+		if (file)
+		{
+			file << "{\n\t\"width\": " << settings.width
+				<< ",\n\t\"height\": " << settings.height
+				<< ",\n\t\"warmupFrames\": " << settings.warmupFrameCount
+				<< ",\n\t\"frames\": " << frameCount
+				<< ",\n\t\"animationTime\": " << settings.animationTime
+				<< ",\n\t\"hardwareThreads\": " << hardwareThreadCount
+				<< ",\n\t\"scenes\": [\n";
+
+			for (size_t i{}; i < results.size(); ++i)
+			{
+				if (i > 0) file << ",\n";
+				WriteSceneResult(file, results[i]);
+			}
+
+			file << "\n\t]\n}\n";
+		}
+
+		const bool isWritten = static_cast<bool>(file);
+		if (isWritten) std::cout << ">> STATS WRITTEN TO " << settings.outputPath << "\n";
+		std::cout << std::flush;
+		return isWritten;
+	}
+}
\ No newline at end of file
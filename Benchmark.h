@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+
+namespace dae
+{
+	class Scene;
+
+	struct SceneBenchmarkSettings
+	{
+		int width{ 640 };
+		int height{ 480 };
+
+		//Frames rendered before the timed ones, they start the helper threads of the tile scheduler and warm up the caches and the allocator
+		int warmupFrameCount{ 3 };
+		int frameCount{ 30 };
+
+		//Every frame shows the scene at this moment, in seconds, so the animated scenes render the same pose every frame and every run
+		float animationTime{ 1.f };
+
+		//Frames are timed on 1, 2, 4, ... up to this many threads, 0 is every hardware thread
+		int maxThreadCount{};
+
+		std::string outputPath{ "SceneBenchmark.json" };
+	};
+
+	namespace Benchmark
+	{
+		//Times BVH::IntersectAABB against the division based slab test it replaced,
+		//and prints the cost per million box tests of both to the console.
+		void RunAABBMicroBenchmark(int boxTestCount = 20'000'000);
+
+		//Shoots the primary rays of a width x height frame through the scene once per BVH traversal mode, followed by the shadow rays from their hits.
+		//Prints the rays per second and the nodes visited and primitives tested per ray of each mode, and writes them to BVHTraversalStats.json.
+		void RunTraversalBenchmark(Scene* pScene, int width = 640, int height = 480);
+
+		//Builds the BVH of every mesh in the scene and of a generated terrain of gridSize x gridSize quads, with the SAH, LBVH and SBVH builder,
+		//with 1, 2, 4, ... up to every hardware thread, and prints the build times, the speedup and whether every tree matched the single threaded one.
+		//The SAH cost of the terrain tree shows what each builder gives up in trace speed, the references per primitive what the SBVH spends on memory.
+		//The statistics of the terrain tree of every builder are written to BVHBuildStats.json.
+		void RunBuildBenchmark(Scene* pScene, int gridSize = 512);
+
+		//Renders every built-in scene headless from the camera it starts with, at a fixed animation time, and times the frames after the warmup ones.
+		//Prints and writes to settings.outputPath per scene the BVH build time, the p50, p95 and p99 frame time and the primary and shadow rays
+		//per second at every thread count, and a hash of the image, so two builds can be diffed for speed and for the image they render.
+		//Built with RT_ENABLE_COUNTERS, every thread count also gets the counters of its last frame.
+		//The bunny's BLAS is loaded from its cache file when there is one, its build time then only covers the TLAS. Returns false when the JSON could not be written
+		bool RunSceneBenchmark(const SceneBenchmarkSettings& settings = {});
+	}
+}
@@ -0,0 +1,57 @@
+#include "CameraRays.h"
+#include "Camera.h"
+#include "DataTypes.h"
+
+namespace dae
+{
+	void CameraRayGenerator::Setup(Camera& camera, int width, int height, float pixelOffsetX, float pixelOffsetY)
+	{
+		const Matrix cameraToWorld{ camera.CalculateCameraToWorld() };
+		const float aspectRatio = static_cast<float>(width) / static_cast<float>(height);
+
+		//The raster to camera mapping of pixel (px, py) is
+		//cx = (2 * (px + offsetX) / width - 1) * aspectRatio * fov
+		//cy = 1 - 2 * (py + offsetY) / height * fov
+		//which is linear in px and py, so it is split in the offset in the first pixel and a step per pixel
+		const float firstX = (2.f * pixelOffsetX / static_cast<float>(width) - 1.f) * aspectRatio * camera.fovAngle;
+		const float firstY = 1.f - 2.f * pixelOffsetY / static_cast<float>(height) * camera.fovAngle;
+		const float stepX = 2.f / static_cast<float>(width) * aspectRatio * camera.fovAngle;
+		const float stepY = -2.f / static_cast<float>(height) * camera.fovAngle;
+
+		//The basis is orthonormal, so the rays can be normalized after the transform instead of before
+		m_Origin = camera.origin;
+		m_FirstPixelDirection = cameraToWorld.TransformVector(firstX, firstY, 1.f);
+		m_PixelDeltaX = cameraToWorld.TransformVector(stepX, 0.f, 0.f);
+		m_PixelDeltaY = cameraToWorld.TransformVector(0.f, stepY, 0.f);
+	}
+
+	Vector3 CameraRayGenerator::GetPixelDirection(int px, int py) const
+	{
+		const float x = static_cast<float>(px);
+		const float y = static_cast<float>(py);
+
+		return Vector3{
+			m_FirstPixelDirection.x + m_PixelDeltaX.x * x + m_PixelDeltaY.x * y,
+			m_FirstPixelDirection.y + m_PixelDeltaX.y * x + m_PixelDeltaY.y * y,
+			m_FirstPixelDirection.z + m_PixelDeltaX.z * x + m_PixelDeltaY.z * y
+		};
+	}
+
+	Ray CameraRayGenerator::GetRay(int px, int py) const
+	{
+		return Ray{ m_Origin, GetRayDirection(px, py) };
+	}
+
+	RayDifferentials CameraRayGenerator::GetRayDifferentials(const Vector3& pixelDirection) const
+	{
+		//Derivative of d / |d| along a step s: (dot(d, d) * s - dot(d, s) * d) / |d|^3
+		const float lengthSquared = Vector3::Dot(pixelDirection, pixelDirection);
+		const float length = std::sqrt(lengthSquared);
+		const float scale = 1.f / (lengthSquared * length);
+
+		RayDifferentials differentials{};
+		differentials.directionDx = (lengthSquared * m_PixelDeltaX - Vector3::Dot(pixelDirection, m_PixelDeltaX) * pixelDirection) * scale;
+		differentials.directionDy = (lengthSquared * m_PixelDeltaY - Vector3::Dot(pixelDirection, m_PixelDeltaY) * pixelDirection) * scale;
+		return differentials;
+	}
+}
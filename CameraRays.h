@@ -0,0 +1,46 @@
+#pragma once
+#include "Math.h"
+
+namespace dae
+{
+	struct Camera;
+	struct Ray;
+
+	//How the normalized direction of a primary ray changes per pixel step along x and y, for filtering by the footprint of the ray.
+	//The rays of the pinhole camera share their origin, so it has no differentials.
+	struct RayDifferentials
+	{
+		Vector3 directionDx{};
+		Vector3 directionDy{};
+	};
+
+	//The camera as it is at the start of a frame, turned into the direction through the centre of the first pixel and the steps to the next pixel along x and y.
+	//A primary ray then costs a few adds instead of rebuilding the camera matrix, and the render threads only read this snapshot, never the Camera.
+	class CameraRayGenerator final
+	{
+	public:
+		//Call once per frame before rendering, from a single thread. Updates the basis of the camera, which moves along it.
+		//The rays go through (pixelOffsetX, pixelOffsetY) inside every pixel, the centre by default
+		void Setup(Camera& camera, int width, int height, float pixelOffsetX = 0.5f, float pixelOffsetY = 0.5f);
+
+		const Vector3& GetOrigin() const { return m_Origin; }
+
+		//Not normalized, adding GetPixelDeltaX steps to the next pixel of the row and GetPixelDeltaY to the next row.
+		//The renderer evaluates it for every pixel rather than stepping, so a pixel gets the same ray whatever tile or packet it is in
+		Vector3 GetPixelDirection(int px, int py) const;
+		const Vector3& GetPixelDeltaX() const { return m_PixelDeltaX; }
+		const Vector3& GetPixelDeltaY() const { return m_PixelDeltaY; }
+
+		Vector3 GetRayDirection(int px, int py) const { return GetPixelDirection(px, py).Normalized(); }
+		Ray GetRay(int px, int py) const;
+
+		//pixelDirection as returned by GetPixelDirection
+		RayDifferentials GetRayDifferentials(const Vector3& pixelDirection) const;
+
+	private:
+		Vector3 m_Origin{};
+		Vector3 m_FirstPixelDirection{};
+		Vector3 m_PixelDeltaX{};
+		Vector3 m_PixelDeltaY{};
+	};
+}
@@ -0,0 +1,120 @@
+#include "Counters.h"
+
+#include <algorithm>
+#include <numeric>
+
+#include "BVHNode.h"
+
+namespace dae
+{
+	double CounterFrame::GetBusyTime() const
+	{
+		return std::accumulate(busyTimes.begin(), busyTimes.end(), 0.0);
+	}
+
+	double CounterFrame::GetIdleTime() const
+	{
+		return std::accumulate(idleTimes.begin(), idleTimes.end(), 0.0);
+	}
+
+	namespace Counters
+	{
+		const char* GetCounterName(Counter counter)
+		{
+			switch (counter)
+			{
+			case Counter::PrimaryRays: return "primaryRays";
+			case Counter::ShadowRays: return "shadowRays";
+			case Counter::NodesVisited: return "nodesVisited";
+			case Counter::BoxTests: return "boxTests";
+			case Counter::TriangleTests: return "triangleTests";
+			case Counter::SphereTests: return "sphereTests";
+			case Counter::PlaneTests: return "planeTests";
+			case Counter::ShadeCalls: return "shadeCalls";
+			default: return "unknown";
+			}
+		}
+
+#if RT_ENABLE_COUNTERS
+		namespace
+		{
+			//Only resized by the rendering thread while no tiles are rendered, the threads only ever touch their own slot
+			std::vector<ThreadCounters> g_ThreadCounters{};
+
+			//Most threads any Run of the frame used, the slots past it stay empty
+			int g_FrameThreadCount{};
+			CounterFrame g_LastFrame{};
+		}
+
+		void Add(const BVHTraversalStats& stats)
+		{
+			if (!t_pThreadCounters) return;
+
+			int64_t* pValues = t_pThreadCounters->values;
+			pValues[static_cast<int>(Counter::NodesVisited)] += stats.nodesVisited;
+			pValues[static_cast<int>(Counter::BoxTests)] += stats.boxTests;
+			pValues[static_cast<int>(Counter::TriangleTests)] += stats.trianglesTested;
+			pValues[static_cast<int>(Counter::SphereTests)] += stats.spheresTested;
+		}
+
+		void BeginFrame()
+		{
+			std::fill(g_ThreadCounters.begin(), g_ThreadCounters.end(), ThreadCounters{});
+			g_FrameThreadCount = 0;
+		}
+
+		void EndFrame()
+		{
+			g_LastFrame = CounterFrame{};
+			for (int threadIdx{}; threadIdx < g_FrameThreadCount; ++threadIdx)
+			{
+				const ThreadCounters& threadCounters = g_ThreadCounters[threadIdx];
+				for (int counterIdx{}; counterIdx < static_cast<int>(Counter::COUNT); ++counterIdx)
+				{
+					g_LastFrame.values[counterIdx] += threadCounters.values[counterIdx];
+				}
+
+				g_LastFrame.busyTimes.emplace_back(threadCounters.busyTime);
+				g_LastFrame.idleTimes.emplace_back(threadCounters.idleTime);
+			}
+		}
+
+		void SetThreadCount(int threadCount)
+		{
+			if (static_cast<int>(g_ThreadCounters.size()) < threadCount) g_ThreadCounters.resize(threadCount);
+			g_FrameThreadCount = std::max(g_FrameThreadCount, threadCount);
+		}
+
+		void BindThread(int threadIdx)
+		{
+			t_pThreadCounters = &g_ThreadCounters[threadIdx];
+		}
+
+		void UnbindThread()
+		{
+			t_pThreadCounters = nullptr;
+		}
+
+		void AddThreadTime(int threadIdx, double busyTime, double idleTime)
+		{
+			g_ThreadCounters[threadIdx].busyTime += busyTime;
+			g_ThreadCounters[threadIdx].idleTime += idleTime;
+		}
+
+		const CounterFrame& GetLastFrame()
+		{
+			return g_LastFrame;
+		}
+#endif
+
+		void Print(std::ostream& os, const CounterFrame& frame)
+		{
+			os << "**COUNTERS**";
+			for (int counterIdx{}; counterIdx < static_cast<int>(Counter::COUNT); ++counterIdx)
+			{
+				os << (counterIdx > 0 ? ", " : " ") << GetCounterName(static_cast<Counter>(counterIdx)) << " " << frame.values[counterIdx];
+			}
+			os << "\n> busy " << frame.GetBusyTime() << " ms, idle " << frame.GetIdleTime() << " ms over " << frame.busyTimes.size() << " threads\n";
+		}
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+//Build with RT_ENABLE_COUNTERS defined as 1 to count the work of every frame. With 0 every RT_COUNT compiles to nothing
+//and the traversal is never asked for its statistics, so the counters cost nothing when they are off
+#ifndef RT_ENABLE_COUNTERS
+#define RT_ENABLE_COUNTERS 0
+#endif
+
+namespace dae
+{
+	struct BVHTraversalStats;
+
+	enum class Counter
+	{
+		//Closest hit queries, the renderer has no bounces so every one is a primary ray
+		PrimaryRays,
+		ShadowRays,
+		NodesVisited,
+		BoxTests,
+		TriangleTests,
+		SphereTests,
+		PlaneTests,
+		ShadeCalls,
+		//@end
+		COUNT
+	};
+
+	//Padded to a cache line so the render threads never write to the same one
+	struct alignas(64) ThreadCounters
+	{
+		int64_t values[static_cast<int>(Counter::COUNT)]{};
+
+		//Milliseconds the thread spent rendering tiles and waiting for the others, summed over the passes of the frame
+		double busyTime{};
+		double idleTime{};
+	};
+
+	//A frame's worth of counters, values summed over the threads and the times per thread
+	struct CounterFrame
+	{
+		int64_t values[static_cast<int>(Counter::COUNT)]{};
+		std::vector<double> busyTimes{};
+		std::vector<double> idleTimes{};
+
+		int64_t Get(Counter counter) const { return values[static_cast<int>(counter)]; }
+		double GetBusyTime() const;
+		double GetIdleTime() const;
+	};
+
+	namespace Counters
+	{
+		const char* GetCounterName(Counter counter);
+
+#if RT_ENABLE_COUNTERS
+		//The slot the calling thread counts into, nullptr outside of TileScheduler::Run, where the counts are dropped
+		inline thread_local ThreadCounters* t_pThreadCounters{};
+
+		inline void Add(Counter counter, int64_t amount)
+		{
+			if (t_pThreadCounters) t_pThreadCounters->values[static_cast<int>(counter)] += amount;
+		}
+
+		//The nodes, boxes, triangles and spheres the traversal counted for a ray
+		void Add(const BVHTraversalStats& stats);
+
+		//Call from the rendering thread around a frame, never while the tiles are being rendered
+		void BeginFrame();
+		void EndFrame();
+
+		//Gives the threads of TileScheduler::Run a slot each, before the helpers start
+		void SetThreadCount(int threadCount);
+		void BindThread(int threadIdx);
+		void UnbindThread();
+		void AddThreadTime(int threadIdx, double busyTime, double idleTime);
+
+		//The counters of the last frame between BeginFrame and EndFrame
+		const CounterFrame& GetLastFrame();
+#endif
+
+		void Print(std::ostream& os, const CounterFrame& frame);
+	}
+}
+
+#if RT_ENABLE_COUNTERS
+#define RT_COUNT(counter, amount) ::dae::Counters::Add(::dae::Counter::counter, amount)
+#else
+#define RT_COUNT(counter, amount) ((void)0)
+#endif
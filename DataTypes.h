@@ -56,6 +56,19 @@ namespace dae
 		unsigned char materialIndex{};
 	};
 
+	//Triangle as the BVH stores it, holds exactly what the hit-test needs
+	struct BVHTriangle
+	{
+		Vector3 v0{};
+		Vector3 edge1{};
+		Vector3 edge2{};
+
+		Vector3 normal{};
+
+		TriangleCullMode cullMode{};
+		unsigned char materialIndex{};
+	};
+
 	struct TriangleMesh
 	{
 		TriangleMesh() = default;
@@ -228,10 +241,15 @@ namespace dae
 			}
 		}
 
+		Matrix GetTransform() const
+		{
+			return scaleTransform * rotationTransform * translationTransform;
+		}
+
 		void UpdateTransforms()
 		{
 			//Create the final transformation matrix
-			const auto finalTransformation{ scaleTransform * rotationTransform * translationTransform };
+			const auto finalTransformation{ GetTransform() };
 			
 			transformedPositionsX.clear();
 			transformedPositionsY.clear();
@@ -334,11 +352,34 @@ namespace dae
 #pragma region MISC
 	struct Ray
 	{
+		Ray() = default;
+		Ray(const Vector3& _origin, const Vector3& _direction, float _min = 0.0001f, float _max = FLT_MAX) :
+			origin{ _origin }, direction{ _direction }, min{ _min }, max{ _max }
+		{
+			UpdateInverseDirection();
+		}
+
 		Vector3 origin{};
 		Vector3 direction{};
 
 		float min{ 0.0001f };
 		float max{ FLT_MAX };
+
+		//Used by the slab test, call UpdateInverseDirection after changing the direction
+		Vector3 inverseDirection{};
+
+		void UpdateInverseDirection()
+		{
+			//Replace zero components by a tiny value of the same sign,
+			//this keeps the inverse finite so the slab test never computes 0 * inf
+			constexpr float minComponent{ 1e-20f };
+			const auto safeInverse = [minComponent](float component)
+			{
+				return 1.f / (fabsf(component) < minComponent ? copysignf(minComponent, component) : component);
+			};
+
+			inverseDirection = { safeInverse(direction.x), safeInverse(direction.y), safeInverse(direction.z) };
+		}
 	};
 
 	struct HitRecord
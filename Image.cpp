@@ -0,0 +1,76 @@
+#include "Image.h"
+
+#include <fstream>
+#include <vector>
+
+namespace dae
+{
+	namespace ImageUtils
+	{
+		namespace
+		{
+			//BMP stores every field little endian, whatever the machine is
+			void WriteLittleEndian(std::vector<uint8_t>& bytes, uint32_t value, int byteCount)
+			{
+				for (int byteIdx{}; byteIdx < byteCount; ++byteIdx)
+				{
+					bytes.emplace_back(static_cast<uint8_t>(value >> (8 * byteIdx)));
+				}
+			}
+		}
+
+		bool WriteBMP(const std::string& path, const uint32_t* pPixels, int width, int height)
+		{
+			constexpr uint32_t headerSize{ 14 + 40 };
+
+			//Rows are padded to a multiple of 4 bytes
+			const uint32_t rowSize = (static_cast<uint32_t>(width) * 3 + 3) & ~3u;
+			const uint32_t imageSize = rowSize * static_cast<uint32_t>(height);
+
+			std::vector<uint8_t> bytes{};
+			bytes.reserve(headerSize + imageSize);
+
+			//File header
+			bytes.emplace_back('B');
+			bytes.emplace_back('M');
+			WriteLittleEndian(bytes, headerSize + imageSize, 4);
+			WriteLittleEndian(bytes, 0, 4);
+			WriteLittleEndian(bytes, headerSize, 4);
+
+			//BITMAPINFOHEADER, a positive height stores the rows from the bottom up
+			WriteLittleEndian(bytes, 40, 4);
+			WriteLittleEndian(bytes, static_cast<uint32_t>(width), 4);
+			WriteLittleEndian(bytes, static_cast<uint32_t>(height), 4);
+			WriteLittleEndian(bytes, 1, 2);
+			WriteLittleEndian(bytes, 24, 2);
+			WriteLittleEndian(bytes, 0, 4);
+			WriteLittleEndian(bytes, imageSize, 4);
+			WriteLittleEndian(bytes, 2835, 4);
+			WriteLittleEndian(bytes, 2835, 4);
+			WriteLittleEndian(bytes, 0, 4);
+			WriteLittleEndian(bytes, 0, 4);
+
+			for (int y = height - 1; y >= 0; --y)
+			{
+				const uint32_t* pRow = pPixels + static_cast<size_t>(y) * width;
+				for (int x{}; x < width; ++x)
+				{
+					bytes.emplace_back(static_cast<uint8_t>(pRow[x]));
+					bytes.emplace_back(static_cast<uint8_t>(pRow[x] >> 8));
+					bytes.emplace_back(static_cast<uint8_t>(pRow[x] >> 16));
+				}
+
+				for (uint32_t padding = static_cast<uint32_t>(width) * 3; padding < rowSize; ++padding)
+				{
+					bytes.emplace_back(0);
+				}
+			}
+
+			std::ofstream file{ path, std::ios::binary };
+			if (!file) return false;
+
+			file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+			return file.good();
+		}
+	}
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace dae
+{
+	namespace ImageUtils
+	{
+		//Writes 0xAARRGGBB pixels, stored row by row from the top, as an uncompressed 24 bit BMP. Returns false when the file can't be written
+		bool WriteBMP(const std::string& path, const uint32_t* pPixels, int width, int height);
+	}
+}
@@ -28,4 +28,19 @@ namespace dae
 	{
 		return abs(a - b) < epsilon;
 	}
+
+	//Mirrors the digits of index in base around the point, the Halton sequence in [0, 1) for a prime base
+	inline float RadicalInverse(int index, int base)
+	{
+		const float inverseBase = 1.f / static_cast<float>(base);
+		float digitWeight = inverseBase;
+		float result{};
+		while (index > 0)
+		{
+			result += static_cast<float>(index % base) * digitWeight;
+			index /= base;
+			digitWeight *= inverseBase;
+		}
+		return result;
+	}
 }
\ No newline at end of file
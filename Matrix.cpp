@@ -1,6 +1,7 @@
 #include "Matrix.h"
 #include <cassert>
 #include <cmath>
+#include <cfloat>
 
 namespace dae {
 	Matrix::Matrix(const Vector3& xAxis, const Vector3& yAxis, const Vector3& zAxis, const Vector3& t) :
@@ -79,6 +80,33 @@ namespace dae {
 		return out;
 	}
 
+	Matrix Matrix::Inverse(const Matrix& m)
+	{
+		//Only valid for affine matrices (last column 0,0,0,1), which is every matrix the renderer creates
+		const Vector3 xAxis{ m[0] };
+		const Vector3 yAxis{ m[1] };
+		const Vector3 zAxis{ m[2] };
+		const Vector3 t{ m[3] };
+
+		//The cross products of the axes are the columns of the inverse 3x3 part, scaled by the determinant
+		const Vector3 c0{ Vector3::Cross(yAxis, zAxis) };
+		const Vector3 c1{ Vector3::Cross(zAxis, xAxis) };
+		const Vector3 c2{ Vector3::Cross(xAxis, yAxis) };
+
+		const float determinant{ Vector3::Dot(xAxis, c0) };
+		assert(fabsf(determinant) > FLT_EPSILON && "Matrix is not invertible");
+		const float inverseDeterminant{ 1.f / determinant };
+
+		const Vector3 inverseX{ c0.x * inverseDeterminant, c1.x * inverseDeterminant, c2.x * inverseDeterminant };
+		const Vector3 inverseY{ c0.y * inverseDeterminant, c1.y * inverseDeterminant, c2.y * inverseDeterminant };
+		const Vector3 inverseZ{ c0.z * inverseDeterminant, c1.z * inverseDeterminant, c2.z * inverseDeterminant };
+
+		//Undo the translation in the rotated space
+		const Vector3 inverseT{ -(t.x * inverseX + t.y * inverseY + t.z * inverseZ) };
+
+		return { inverseX, inverseY, inverseZ, inverseT };
+	}
+
 	Vector3 Matrix::GetAxisX() const
 	{
 		return data[0];
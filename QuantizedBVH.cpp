@@ -0,0 +1,241 @@
+#include "QuantizedBVH.h"
+#include "BVHNode.h"
+#include "TraversalStack.h"
+
+#include <cmath>
+
+namespace dae
+{
+	template<typename T>
+	void QuantizedBVH<T>::Quantize(const BVHNode* binaryNodes, int nodeCount, int rootNodeIdx, int treeDepth)
+	{
+		m_Nodes.clear();
+		if (nodeCount == 0) return;
+
+		m_Nodes.resize(nodeCount);
+		m_RootNodeIdx = rootNodeIdx;
+		m_StackSize = treeDepth + 1;
+
+		const BVHNode& root = binaryNodes[rootNodeIdx];
+		m_RootMin = root.aabbMin;
+		m_RootMax = root.aabbMax;
+		m_Nodes[rootNodeIdx].leftFirst = root.leftFirst;
+		m_Nodes[rootNodeIdx].triangleCount = root.triangleCount;
+
+		QuantizeNode(binaryNodes, rootNodeIdx, m_RootMin, m_RootMax);
+	}
+
+	template<typename T>
+	void QuantizedBVH<T>::QuantizeNode(const BVHNode* binaryNodes, int nodeIdx, const Vector3& parentMin, const Vector3& parentMax)
+	{
+		const BVHNode& node = binaryNodes[nodeIdx];
+		if (node.isLeaf()) return;
+
+		//The children are stored relative to the quantized box of this node, which is what the traversal knows about
+		const Vector3 stepSize = GetStepSize(parentMin, parentMax);
+
+		for (const int childIdx : { node.leftFirst, node.leftFirst + 1 })
+		{
+			const BVHNode& child = binaryNodes[childIdx];
+
+			QuantizedBVHNode<T>& quantized = m_Nodes[childIdx];
+			quantized.leftFirst = child.leftFirst;
+			quantized.triangleCount = child.triangleCount;
+
+			for (int axis{}; axis < 3; ++axis)
+			{
+				//A flat parent has a flat child on this axis
+				if (stepSize[axis] == 0.f)
+				{
+					quantized.boundsMin[axis] = 0;
+					quantized.boundsMax[axis] = 0;
+					continue;
+				}
+
+				const float low = std::floor((child.aabbMin[axis] - parentMin[axis]) / stepSize[axis]);
+				const float high = std::ceil((child.aabbMax[axis] - parentMin[axis]) / stepSize[axis]);
+				quantized.boundsMin[axis] = static_cast<T>(std::clamp(low, 0.f, m_MaxValue));
+				quantized.boundsMax[axis] = static_cast<T>(std::clamp(high, 0.f, m_MaxValue));
+			}
+
+			//Float rounding can still leave a face just inside the real box, step those outwards
+			Vector3 childMin{};
+			Vector3 childMax{};
+			Dequantize(quantized, parentMin, stepSize, childMin, childMax);
+			for (int axis{}; axis < 3; ++axis)
+			{
+				while (childMin[axis] > child.aabbMin[axis] && quantized.boundsMin[axis] > 0)
+				{
+					--quantized.boundsMin[axis];
+					Dequantize(quantized, parentMin, stepSize, childMin, childMax);
+				}
+
+				while (childMax[axis] < child.aabbMax[axis] && quantized.boundsMax[axis] < static_cast<T>(m_MaxValue))
+				{
+					++quantized.boundsMax[axis];
+					Dequantize(quantized, parentMin, stepSize, childMin, childMax);
+				}
+			}
+
+			QuantizeNode(binaryNodes, childIdx, childMin, childMax);
+		}
+	}
+
+	template<typename T>
+	Vector3 QuantizedBVH<T>::GetStepSize(const Vector3& parentMin, const Vector3& parentMax)
+	{
+		//Slightly too large steps, so the last step always reaches the far side of the parent
+		constexpr float roundUp{ 1.f + 4.f * FLT_EPSILON };
+		constexpr float scale{ roundUp / m_MaxValue };
+		return Vector3{ (parentMax.x - parentMin.x) * scale, (parentMax.y - parentMin.y) * scale, (parentMax.z - parentMin.z) * scale };
+	}
+
+	template<typename T>
+	void QuantizedBVH<T>::Dequantize(const QuantizedBVHNode<T>& node, const Vector3& parentMin, const Vector3& stepSize, Vector3& boundsMin, Vector3& boundsMax)
+	{
+		boundsMin.x = parentMin.x + static_cast<float>(node.boundsMin[0]) * stepSize.x;
+		boundsMin.y = parentMin.y + static_cast<float>(node.boundsMin[1]) * stepSize.y;
+		boundsMin.z = parentMin.z + static_cast<float>(node.boundsMin[2]) * stepSize.z;
+		boundsMax.x = parentMin.x + static_cast<float>(node.boundsMax[0]) * stepSize.x;
+		boundsMax.y = parentMin.y + static_cast<float>(node.boundsMax[1]) * stepSize.y;
+		boundsMax.z = parentMin.z + static_cast<float>(node.boundsMax[2]) * stepSize.z;
+	}
+
+	template<typename T>
+	void QuantizedBVH<T>::Intersect(const Ray& ray, const BVH& bvh, HitRecord& hitRecord, BVHTraversalStats* pStats) const
+	{
+		if (m_Nodes.empty()) return;
+		if (pStats) ++pStats->boxTests;
+		if (BVH::IntersectAABB(ray, m_RootMin, m_RootMax, hitRecord.t) == FLT_MAX) return;
+
+		//The box of a node only exists relative to its parent, so every entry carries the box it was tested with
+		struct StackEntry
+		{
+			int nodeIdx;
+			float distance;
+			Vector3 boundsMin;
+			Vector3 boundsMax;
+		};
+
+		TraversalStack<StackEntry, m_MaxStackDepth> stack{ m_StackSize };
+		int stackPtr = 0;
+
+		int nodeIdx = m_RootNodeIdx;
+		Vector3 nodeMin = m_RootMin;
+		Vector3 nodeMax = m_RootMax;
+
+		while (true)
+		{
+			if (pStats) ++pStats->nodesVisited;
+
+			const QuantizedBVHNode<T>& node = m_Nodes[nodeIdx];
+			bool popNext = false;
+
+			if (node.isLeaf())
+			{
+				bvh.IntersectLeaf(node.leftFirst, node.triangleCount, ray, hitRecord, pStats);
+				popNext = true;
+			}
+			else
+			{
+				const Vector3 stepSize = GetStepSize(nodeMin, nodeMax);
+
+				Vector3 nearMin{}, nearMax{}, farMin{}, farMax{};
+				Dequantize(m_Nodes[node.leftFirst], nodeMin, stepSize, nearMin, nearMax);
+				Dequantize(m_Nodes[node.leftFirst + 1], nodeMin, stepSize, farMin, farMax);
+
+				//Visit the nearer child first, same as the binary traversal
+				if (pStats) pStats->boxTests += 2;
+				float nearDistance = BVH::IntersectAABB(ray, nearMin, nearMax, hitRecord.t);
+				float farDistance = BVH::IntersectAABB(ray, farMin, farMax, hitRecord.t);
+				int nearIdx = node.leftFirst;
+				int farIdx = node.leftFirst + 1;
+
+				if (nearDistance > farDistance)
+				{
+					std::swap(nearDistance, farDistance);
+					std::swap(nearIdx, farIdx);
+					std::swap(nearMin, farMin);
+					std::swap(nearMax, farMax);
+				}
+
+				if (nearDistance == FLT_MAX)
+				{
+					popNext = true;
+				}
+				else
+				{
+					nodeIdx = nearIdx;
+					nodeMin = nearMin;
+					nodeMax = nearMax;
+
+					if (farDistance != FLT_MAX)
+					{
+						assert(stackPtr < m_StackSize && "Quantized BVH is deeper than the traversal stack");
+						stack[stackPtr++] = { farIdx, farDistance, farMin, farMax };
+					}
+				}
+			}
+
+			if (!popNext) continue;
+
+			do
+			{
+				if (stackPtr == 0) return;
+				--stackPtr;
+			}
+			while (stack[stackPtr].distance >= hitRecord.t);
+
+			nodeIdx = stack[stackPtr].nodeIdx;
+			nodeMin = stack[stackPtr].boundsMin;
+			nodeMax = stack[stackPtr].boundsMax;
+		}
+	}
+
+	template<typename T>
+	bool QuantizedBVH<T>::IsOccluded(const Ray& ray, const BVH& bvh, int* pOccluder, BVHTraversalStats* pStats) const
+	{
+		if (m_Nodes.empty()) return false;
+
+		struct StackEntry
+		{
+			int nodeIdx;
+			Vector3 boundsMin;
+			Vector3 boundsMax;
+		};
+
+		TraversalStack<StackEntry, m_MaxStackDepth> stack{ m_StackSize };
+		int stackPtr = 0;
+		stack[stackPtr++] = { m_RootNodeIdx, m_RootMin, m_RootMax };
+
+		while (stackPtr > 0)
+		{
+			const StackEntry entry = stack[--stackPtr];
+			if (pStats) ++pStats->boxTests;
+			if (BVH::IntersectAABB(ray, entry.boundsMin, entry.boundsMax, ray.max) == FLT_MAX) continue;
+
+			if (pStats) ++pStats->nodesVisited;
+
+			const QuantizedBVHNode<T>& node = m_Nodes[entry.nodeIdx];
+			if (node.isLeaf())
+			{
+				if (bvh.IsLeafOccluding(node.leftFirst, node.triangleCount, ray, pOccluder, pStats)) return true;
+				continue;
+			}
+
+			const Vector3 stepSize = GetStepSize(entry.boundsMin, entry.boundsMax);
+			assert(stackPtr + 2 <= m_StackSize && "Quantized BVH is deeper than the traversal stack");
+			for (const int childIdx : { node.leftFirst, node.leftFirst + 1 })
+			{
+				StackEntry& child = stack[stackPtr++];
+				child.nodeIdx = childIdx;
+				Dequantize(m_Nodes[childIdx], entry.boundsMin, stepSize, child.boundsMin, child.boundsMax);
+			}
+		}
+
+		return false;
+	}
+
+	template class QuantizedBVH<uint8_t>;
+	template class QuantizedBVH<uint16_t>;
+}
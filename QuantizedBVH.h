@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "DataTypes.h"
+
+namespace dae
+{
+	struct BVH;
+	struct BVHNode;
+	struct BVHTraversalStats;
+
+	//Node with its bounds stored as 8 or 16 bit fractions of the bounds of its parent.
+	//Keeps the topology of the binary BVH it is made from, the children of a node are at leftFirst and leftFirst + 1.
+	template<typename T>
+	struct QuantizedBVHNode
+	{
+		T boundsMin[3];
+		T boundsMax[3];
+
+		//Interior node: index of the left child, leaf: first primitive
+		int leftFirst;
+		int triangleCount;
+
+		bool isLeaf() const { return triangleCount > 0; }
+	};
+
+	template<typename T>
+	class QuantizedBVH final
+	{
+		static_assert(std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>, "Only 8 and 16 bit quantization is supported");
+
+	public:
+		//Rounds the bounds of every node outwards, so the quantized box always contains the real one. treeDepth is the depth of the deepest leaf
+		void Quantize(const BVHNode* binaryNodes, int nodeCount, int rootNodeIdx, int treeDepth);
+		void Clear() { m_Nodes.clear(); }
+
+		//The leaves are tested by the BVH that was quantized, it owns the primitives
+		void Intersect(const Ray& ray, const BVH& bvh, HitRecord& hitRecord, BVHTraversalStats* pStats) const;
+		bool IsOccluded(const Ray& ray, const BVH& bvh, int* pOccluder, BVHTraversalStats* pStats) const;
+
+		bool IsBuild() const { return !m_Nodes.empty(); }
+		size_t GetMemoryUsed() const { return m_Nodes.size() * sizeof(QuantizedBVHNode<T>); }
+
+	private:
+		//Stacks up to this size live on the stack of the thread, see TraversalStack
+		static constexpr int m_MaxStackDepth{ 64 };
+		static constexpr float m_MaxValue{ static_cast<float>(std::numeric_limits<T>::max()) };
+
+		void QuantizeNode(const BVHNode* binaryNodes, int nodeIdx, const Vector3& parentMin, const Vector3& parentMax);
+
+		//Size of one quantization step inside the given parent bounds
+		static Vector3 GetStepSize(const Vector3& parentMin, const Vector3& parentMax);
+
+		//The one place that turns a quantized box back into floats, the build uses it as well to check its rounding
+		static void Dequantize(const QuantizedBVHNode<T>& node, const Vector3& parentMin, const Vector3& stepSize, Vector3& boundsMin, Vector3& boundsMax);
+
+		std::vector<QuantizedBVHNode<T>> m_Nodes{};
+
+		//The root has no parent to be relative to
+		Vector3 m_RootMin{};
+		Vector3 m_RootMax{};
+		int m_RootNodeIdx{};
+
+		//The same layout as the binary tree, so the same stack: one entry per level and one for the second child of the last
+		int m_StackSize{ 1 };
+	};
+
+	using QuantizedBVH8 = QuantizedBVH<uint8_t>;
+	using QuantizedBVH16 = QuantizedBVH<uint16_t>;
+}
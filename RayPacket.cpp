@@ -0,0 +1,222 @@
+#include "RayPacket.h"
+
+#include <algorithm>
+#include <immintrin.h>
+
+namespace dae
+{
+	namespace
+	{
+		//Bounds of (b - origin) * inverseDirection over every origin and inverse direction in the intervals.
+		//Rounding is monotonic, so the bounds also hold for the products the rays compute themselves
+		void GetProductBounds(float b, float originMin, float originMax, float inverseMin, float inverseMax, float& low, float& high)
+		{
+			const float offsetMin = b - originMax;
+			const float offsetMax = b - originMin;
+
+			const float products[4]{ offsetMin * inverseMin, offsetMin * inverseMax, offsetMax * inverseMin, offsetMax * inverseMax };
+			low = std::min({ products[0], products[1], products[2], products[3] });
+			high = std::max({ products[0], products[1], products[2], products[3] });
+		}
+	}
+
+	void RayPacket::SetRay(int rayIdx, const Ray& ray)
+	{
+		originX[rayIdx] = ray.origin.x;
+		originY[rayIdx] = ray.origin.y;
+		originZ[rayIdx] = ray.origin.z;
+		directionX[rayIdx] = ray.direction.x;
+		directionY[rayIdx] = ray.direction.y;
+		directionZ[rayIdx] = ray.direction.z;
+		inverseDirectionX[rayIdx] = ray.inverseDirection.x;
+		inverseDirectionY[rayIdx] = ray.inverseDirection.y;
+		inverseDirectionZ[rayIdx] = ray.inverseDirection.z;
+		minDistance[rayIdx] = ray.min;
+		maxDistance[rayIdx] = ray.max;
+	}
+
+	Ray RayPacket::GetRay(int rayIdx) const
+	{
+		//Copies the inverse direction instead of dividing again, see Ray::UpdateInverseDirection
+		Ray ray{};
+		ray.origin = Vector3{ originX[rayIdx], originY[rayIdx], originZ[rayIdx] };
+		ray.direction = Vector3{ directionX[rayIdx], directionY[rayIdx], directionZ[rayIdx] };
+		ray.min = minDistance[rayIdx];
+		ray.max = maxDistance[rayIdx];
+		ray.inverseDirection = Vector3{ inverseDirectionX[rayIdx], inverseDirectionY[rayIdx], inverseDirectionZ[rayIdx] };
+		return ray;
+	}
+
+	bool RayPacket::HasCommonDirectionSigns() const
+	{
+		//Bit per axis and sign, set by the rays that go that way
+		int signs{};
+		for (int rayIdx{}; rayIdx < rayCount; ++rayIdx)
+		{
+			if (!IsActive(rayIdx)) continue;
+
+			signs |= inverseDirectionX[rayIdx] < 0.f ? 1 << 0 : 1 << 1;
+			signs |= inverseDirectionY[rayIdx] < 0.f ? 1 << 2 : 1 << 3;
+			signs |= inverseDirectionZ[rayIdx] < 0.f ? 1 << 4 : 1 << 5;
+		}
+
+		return (signs & (signs >> 1) & 0b010101) == 0;
+	}
+
+	RayPacketBounds::RayPacketBounds(const RayPacket& packet)
+	{
+		const float* origins[3]{ packet.originX, packet.originY, packet.originZ };
+		const float* inverseDirections[3]{ packet.inverseDirectionX, packet.inverseDirectionY, packet.inverseDirectionZ };
+
+		for (int rayIdx{}; rayIdx < packet.rayCount; ++rayIdx)
+		{
+			if (!packet.IsActive(rayIdx)) continue;
+
+			for (int axis{}; axis < 3; ++axis)
+			{
+				originMin[axis] = std::min(originMin[axis], origins[axis][rayIdx]);
+				originMax[axis] = std::max(originMax[axis], origins[axis][rayIdx]);
+				inverseDirectionMin[axis] = std::min(inverseDirectionMin[axis], inverseDirections[axis][rayIdx]);
+				inverseDirectionMax[axis] = std::max(inverseDirectionMax[axis], inverseDirections[axis][rayIdx]);
+			}
+			maxDistance = std::max(maxDistance, packet.maxDistance[rayIdx]);
+		}
+	}
+
+	bool RayPacketBounds::Intersects(const Vector3& bmin, const Vector3& bmax) const
+	{
+		//Lowest distance at which any ray can enter all three slabs, highest distance at which any ray can leave one.
+		//Only valid when every ray goes the same way along each axis, that picks the near and far plane of every slab
+		const float boxMin[3]{ bmin.x, bmin.y, bmin.z };
+		const float boxMax[3]{ bmax.x, bmax.y, bmax.z };
+
+		float nearLow = -FLT_MAX;
+		float farHigh = FLT_MAX;
+
+		for (int axis{}; axis < 3; ++axis)
+		{
+			const bool isNegative = inverseDirectionMax[axis] < 0.f;
+			const float nearPlane = isNegative ? boxMax[axis] : boxMin[axis];
+			const float farPlane = isNegative ? boxMin[axis] : boxMax[axis];
+
+			float low{};
+			float high{};
+			GetProductBounds(nearPlane, originMin[axis], originMax[axis], inverseDirectionMin[axis], inverseDirectionMax[axis], low, high);
+			nearLow = std::max(nearLow, low);
+
+			GetProductBounds(farPlane, originMin[axis], originMax[axis], inverseDirectionMin[axis], inverseDirectionMax[axis], low, high);
+			farHigh = std::min(farHigh, high);
+		}
+
+		return farHigh >= nearLow && nearLow < maxDistance && farHigh > 0;
+	}
+
+	int PacketUtils::IntersectGroupAABB(const RayPacket& packet, int groupIdx, const Vector3& bmin, const Vector3& bmax)
+	{
+		const int first = groupIdx * RayPacket::groupSize;
+
+		const __m128 originX = _mm_load_ps(packet.originX + first);
+		const __m128 inverseX = _mm_load_ps(packet.inverseDirectionX + first);
+		const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.x), originX), inverseX);
+		const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.x), originX), inverseX);
+
+		__m128 tMin = _mm_min_ps(tx1, tx2);
+		__m128 tMax = _mm_max_ps(tx1, tx2);
+
+		const __m128 originY = _mm_load_ps(packet.originY + first);
+		const __m128 inverseY = _mm_load_ps(packet.inverseDirectionY + first);
+		const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.y), originY), inverseY);
+		const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.y), originY), inverseY);
+
+		tMin = _mm_max_ps(tMin, _mm_min_ps(ty1, ty2));
+		tMax = _mm_min_ps(tMax, _mm_max_ps(ty1, ty2));
+
+		const __m128 originZ = _mm_load_ps(packet.originZ + first);
+		const __m128 inverseZ = _mm_load_ps(packet.inverseDirectionZ + first);
+		const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.z), originZ), inverseZ);
+		const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.z), originZ), inverseZ);
+
+		tMin = _mm_max_ps(tMin, _mm_min_ps(tz1, tz2));
+		tMax = _mm_min_ps(tMax, _mm_max_ps(tz1, tz2));
+
+		__m128 hit = _mm_cmpge_ps(tMax, tMin);
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(tMin, _mm_load_ps(packet.maxDistance + first)));
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(tMax, _mm_setzero_ps()));
+
+		return _mm_movemask_ps(hit);
+	}
+
+	float PacketUtils::IntersectRayAABB(const RayPacket& packet, int rayIdx, const Vector3& bmin, const Vector3& bmax)
+	{
+		const float tx1 = (bmin.x - packet.originX[rayIdx]) * packet.inverseDirectionX[rayIdx];
+		const float tx2 = (bmax.x - packet.originX[rayIdx]) * packet.inverseDirectionX[rayIdx];
+
+		float tMin = std::min(tx1, tx2);
+		float tMax = std::max(tx1, tx2);
+
+		const float ty1 = (bmin.y - packet.originY[rayIdx]) * packet.inverseDirectionY[rayIdx];
+		const float ty2 = (bmax.y - packet.originY[rayIdx]) * packet.inverseDirectionY[rayIdx];
+
+		tMin = std::max(tMin, std::min(ty1, ty2));
+		tMax = std::min(tMax, std::max(ty1, ty2));
+
+		const float tz1 = (bmin.z - packet.originZ[rayIdx]) * packet.inverseDirectionZ[rayIdx];
+		const float tz2 = (bmax.z - packet.originZ[rayIdx]) * packet.inverseDirectionZ[rayIdx];
+
+		tMin = std::max(tMin, std::min(tz1, tz2));
+		tMax = std::min(tMax, std::max(tz1, tz2));
+
+		if (tMax >= tMin && tMin < packet.maxDistance[rayIdx] && tMax > 0) return tMin;
+		return FLT_MAX;
+	}
+
+	int PacketUtils::IntersectGroupTriangle(const RayPacket& packet, int groupIdx, int activeMask, const BVHTriangle& triangle, float* distances)
+	{
+		const int first = groupIdx * RayPacket::groupSize;
+
+		const __m128 directionX = _mm_load_ps(packet.directionX + first);
+		const __m128 directionY = _mm_load_ps(packet.directionY + first);
+		const __m128 directionZ = _mm_load_ps(packet.directionZ + first);
+
+		const __m128 edge1X = _mm_set1_ps(triangle.edge1.x);
+		const __m128 edge1Y = _mm_set1_ps(triangle.edge1.y);
+		const __m128 edge1Z = _mm_set1_ps(triangle.edge1.z);
+		const __m128 edge2X = _mm_set1_ps(triangle.edge2.x);
+		const __m128 edge2Y = _mm_set1_ps(triangle.edge2.y);
+		const __m128 edge2Z = _mm_set1_ps(triangle.edge2.z);
+
+		//Same operations in the same order as HitTest_Triangle, h = direction x edge2
+		const __m128 hX = _mm_sub_ps(_mm_mul_ps(directionY, edge2Z), _mm_mul_ps(directionZ, edge2Y));
+		const __m128 hY = _mm_sub_ps(_mm_mul_ps(directionZ, edge2X), _mm_mul_ps(directionX, edge2Z));
+		const __m128 hZ = _mm_sub_ps(_mm_mul_ps(directionX, edge2Y), _mm_mul_ps(directionY, edge2X));
+		const __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, hX), _mm_mul_ps(edge1Y, hY)), _mm_mul_ps(edge1Z, hZ));
+
+		//Culled faces and rays parallel to the triangle
+		__m128 hit = _mm_cmpge_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), determinant), _mm_set1_ps(FLT_EPSILON));
+		if (triangle.cullMode == TriangleCullMode::BackFaceCulling) hit = _mm_and_ps(hit, _mm_cmpge_ps(determinant, _mm_setzero_ps()));
+		else if (triangle.cullMode == TriangleCullMode::FrontFaceCulling) hit = _mm_and_ps(hit, _mm_cmple_ps(determinant, _mm_setzero_ps()));
+
+		const __m128 inverseDeterminant = _mm_div_ps(_mm_set1_ps(1.f), determinant);
+		const __m128 tX = _mm_sub_ps(_mm_load_ps(packet.originX + first), _mm_set1_ps(triangle.v0.x));
+		const __m128 tY = _mm_sub_ps(_mm_load_ps(packet.originY + first), _mm_set1_ps(triangle.v0.y));
+		const __m128 tZ = _mm_sub_ps(_mm_load_ps(packet.originZ + first), _mm_set1_ps(triangle.v0.z));
+
+		const __m128 u = _mm_mul_ps(inverseDeterminant, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tX, hX), _mm_mul_ps(tY, hY)), _mm_mul_ps(tZ, hZ)));
+		hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmple_ps(u, _mm_set1_ps(1.f))));
+
+		//q = t x edge1
+		const __m128 qX = _mm_sub_ps(_mm_mul_ps(tY, edge1Z), _mm_mul_ps(tZ, edge1Y));
+		const __m128 qY = _mm_sub_ps(_mm_mul_ps(tZ, edge1X), _mm_mul_ps(tX, edge1Z));
+		const __m128 qZ = _mm_sub_ps(_mm_mul_ps(tX, edge1Y), _mm_mul_ps(tY, edge1X));
+
+		const __m128 v = _mm_mul_ps(inverseDeterminant, _mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, qX), _mm_mul_ps(directionY, qY)), _mm_mul_ps(directionZ, qZ)));
+		hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()), _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f))));
+
+		const __m128 distance = _mm_mul_ps(inverseDeterminant, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)));
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(distance, _mm_load_ps(packet.minDistance + first)));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(distance, _mm_load_ps(packet.maxDistance + first)));
+
+		_mm_storeu_ps(distances, distance);
+		return _mm_movemask_ps(hit) & activeMask;
+	}
+}
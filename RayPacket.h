@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+
+#include "DataTypes.h"
+
+namespace dae
+{
+	//Coherent rays that are traced through the BVH together: the primary rays of a square block of pixels,
+	//or the shadow rays from their hits towards a light. Stored as SoA, the rays are tested in groups of 4 with SSE.
+	struct alignas(16) RayPacket
+	{
+		static constexpr int groupSize{ 4 };
+
+		//An 8x8 block of pixels
+		static constexpr int maxRayCount{ 64 };
+
+		//Every array starts on a 16 byte boundary and is a whole number of groups long, so each group is loaded with an aligned SSE load
+		float originX[maxRayCount];
+		float originY[maxRayCount];
+		float originZ[maxRayCount];
+		float directionX[maxRayCount];
+		float directionY[maxRayCount];
+		float directionZ[maxRayCount];
+		float inverseDirectionX[maxRayCount];
+		float inverseDirectionY[maxRayCount];
+		float inverseDirectionZ[maxRayCount];
+		float minDistance[maxRayCount];
+
+		//End of the interval of every ray, shrinks to the closest hit while tracing. Inactive rays end at -FLT_MAX and never hit anything
+		float maxDistance[maxRayCount];
+
+		//Always a multiple of groupSize. After the arrays, in front of them it would push every array off the alignment of the packet
+		int rayCount{};
+
+		void SetRay(int rayIdx, const Ray& ray);
+		void SetInactive(int rayIdx) { maxDistance[rayIdx] = -FLT_MAX; }
+		bool IsActive(int rayIdx) const { return maxDistance[rayIdx] >= minDistance[rayIdx]; }
+
+		//The ray as the single ray tests take it, ending at its current maxDistance
+		Ray GetRay(int rayIdx) const;
+
+		int GetGroupCount() const { return rayCount / groupSize; }
+
+		//True when the active rays all go the same way along each axis. Only then the packet shares enough nodes
+		//to be traced together, and its rays can be bounded by intervals (see RayPacketBounds)
+		bool HasCommonDirectionSigns() const;
+	};
+
+	static_assert(offsetof(RayPacket, originX) % 16 == 0 && sizeof(RayPacket::originX) % 16 == 0, "The SoA arrays of a RayPacket have to stay 16 byte aligned");
+
+	//Interval bounds of the active rays of a coherent packet, a box they miss is missed by every ray of the packet.
+	//Catches the nodes that are only entered by a ray of a later group with one test, instead of a test per group.
+	struct RayPacketBounds
+	{
+		explicit RayPacketBounds(const RayPacket& packet);
+
+		bool Intersects(const Vector3& bmin, const Vector3& bmax) const;
+
+		//Per axis, plain floats so the loops over the axes stay inline
+		float originMin[3]{ FLT_MAX, FLT_MAX, FLT_MAX };
+		float originMax[3]{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		float inverseDirectionMin[3]{ FLT_MAX, FLT_MAX, FLT_MAX };
+		float inverseDirectionMax[3]{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		float maxDistance{ -FLT_MAX };
+	};
+
+	namespace PacketUtils
+	{
+		//The slab test of BVH::IntersectAABB on the rays of a group, returns a bitmask of the rays that enter the box before their maxDistance
+		int IntersectGroupAABB(const RayPacket& packet, int groupIdx, const Vector3& bmin, const Vector3& bmax);
+
+		//Distance at which a single ray of the packet enters the box, FLT_MAX when it misses
+		float IntersectRayAABB(const RayPacket& packet, int rayIdx, const Vector3& bmin, const Vector3& bmax);
+
+		//HitTest_Triangle on the rays of a group in activeMask, returns a bitmask of the rays that hit before their maxDistance and their distances
+		int IntersectGroupTriangle(const RayPacket& packet, int groupIdx, int activeMask, const BVHTriangle& triangle, float* distances);
+	}
+}
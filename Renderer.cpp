@@ -1,7 +1,9 @@
 //External includes
 #include "SDL.h"
 #include "SDL_surface.h"
-#include <execution>
+#include <algorithm>
+#include <array>
+#include <iostream>
 
 //Project includes
 #include "Renderer.h"
@@ -9,6 +11,10 @@
 #include "Material.h"
 #include "Scene.h"
 #include "Utils.h"
+#include "RayPacket.h"
+#include "Wavefront.h"
+#include "Image.h"
+#include "Counters.h"
 
 
 
@@ -21,17 +27,31 @@ Renderer::Renderer(SDL_Window* pWindow) :
 	//Initialize
 	SDL_GetWindowSize(pWindow, &m_Width, &m_Height);
 	m_pBufferPixels = static_cast<uint32_t*>(m_pBuffer->pixels);
-	m_AspectRatio = static_cast<float>(m_Width) / static_cast<float>(m_Height);
+	Initialize();
+}
+
+Renderer::Renderer(int width, int height) :
+	m_Width(width),
+	m_Height(height)
+{
+	m_FrameBuffer.resize(static_cast<size_t>(m_Width) * m_Height);
+	m_pBufferPixels = m_FrameBuffer.data();
+	Initialize();
+}
+
+void Renderer::Initialize()
+{
 	m_LightingMode = LightingMode::Combined;
+
+	m_PixelSamples.resize(static_cast<size_t>(m_Width) * m_Height);
+	m_pPixelSamples = m_PixelSamples.data();
 	
-	SetupPixelIndices();
+	SetupTiles();
 }
 
-void Renderer::RenderPixel(Scene* pScene, const Vector2& rayLocation) const
+void Renderer::RenderPixel(Scene* pScene, int px, int py, const Vector3& rayDirection) const
 {
-	auto& materials = pScene->GetMaterials();
-	const auto rayDirection = GetRayDirection(static_cast<float>(rayLocation.x), static_cast<float>(rayLocation.y), &pScene->GetCamera());
-	const Ray viewRay = { pScene->GetCamera().origin, rayDirection };
+	const Ray viewRay = { m_CameraRays.GetOrigin(), rayDirection };
 	constexpr size_t bounces{ 1 };
 	ColorRGB finalColor{};
 	
@@ -47,10 +67,17 @@ void Renderer::RenderPixel(Scene* pScene, const Vector2& rayLocation) const
 		if (closestHit.didHit)
 		{
 			const Vector3 offsetPosition{ closestHit.origin + closestHit.normal * m_RayOffset };
+
+			//Last occluder per light, kept per thread so the pixels a thread renders after each other share it
+			const auto& lights = pScene->GetLights();
+			thread_local std::vector<OcclusionHint> occlusionHints{};
+			occlusionHints.resize(lights.size());
 			
 			//Go over all lights in the scene
-			for (const auto& light : pScene->GetLights())
+			for (size_t lightIdx{}; lightIdx < lights.size(); ++lightIdx)
 			{
+				const Light& light = lights[lightIdx];
+
 				//Calculate the direction of the light
 				Vector3 lightDirection{ LightUtils::GetDirectionToLight(light, offsetPosition) };
 
@@ -65,44 +92,13 @@ void Renderer::RenderPixel(Scene* pScene, const Vector2& rayLocation) const
 					const Ray lightRay{ offsetPosition, lightDirection, FLT_MIN, lightDistance  };
 
 					//if we hitted something, we are in shadow, so skip the Lighting calculation
-					if (pScene->DoesHit(lightRay))
+					if (pScene->DoesHit(lightRay, &occlusionHints[lightIdx]))
 					{
 						continue;
 					}
 				}
 	
-				switch (m_LightingMode)
-				{
-				case LightingMode::ObservedArea: //LambertCosine
-					{
-						const auto lightNormalAngle{ std::max(Vector3::Dot(closestHit.normal, lightDirection), 0.0f) };
-						finalColor += ColorRGB{ lightNormalAngle, lightNormalAngle, lightNormalAngle };
-						break;
-					}
-	
-				case LightingMode::Radiance:
-					{
-						finalColor += LightUtils::GetRadiance(light, closestHit.origin);
-						break;
-					}
-	
-				case LightingMode::BRDF:
-					{
-						const ColorRGB BRDF{ materials[closestHit.materialIndex]->Shade(closestHit, lightDirection, -rayDirection) };
-						finalColor += BRDF;
-						break;
-					}
-	
-				case LightingMode::Combined:
-					{
-						const float lightNormalAngle{ std::max(Vector3::Dot(closestHit.normal, lightDirection), 0.0f) };
-						const ColorRGB radiance{ LightUtils::GetRadiance(light, closestHit.origin) };
-						const auto material = materials[closestHit.materialIndex];
-						const ColorRGB BRDF{ material->Shade(closestHit, lightDirection, -rayDirection) };
-						finalColor += radiance * BRDF * lightNormalAngle;
-		
-					}
-				}
+				finalColor += ShadeLight(pScene, light, closestHit, lightDirection, rayDirection);
 			}
 		}
 		else
@@ -120,67 +116,727 @@ void Renderer::RenderPixel(Scene* pScene, const Vector2& rayLocation) const
 	
 	
 	//Update Color in Buffer
-	finalColor.MaxToOne();
-	
-	m_pBufferPixels[static_cast<uint32_t>(rayLocation.x) + (static_cast<uint32_t>(rayLocation.y) * m_Width)] = SDL_MapRGB(m_pBuffer->format,
-	static_cast<uint8_t>(finalColor.r * 255),
-	static_cast<uint8_t>(finalColor.g * 255),
-	static_cast<uint8_t>(finalColor.b * 255));
+	WritePixel(px, py, finalColor);
 }	
 
-void Renderer::SetupPixelIndices()
+void Renderer::RenderPacket(Scene* pScene, int firstX, int firstY) const
 {
-	m_amountOfPixels = m_Width * m_Height;
-	m_PixelIndices.reserve(m_amountOfPixels);
-	
-	for (int px{}; px < m_Width; ++px)
+	static_assert(m_MaxPacketSize * m_MaxPacketSize <= RayPacket::maxRayCount, "The largest packet has to fit in a RayPacket");
+
+	//Kept per thread, clearing buffers for the largest packet on every packet would cost more than tracing a small one
+	struct PacketBuffers
+	{
+		RayPacket viewRays;
+		RayPacket lightRays;
+		std::array<Vector3, RayPacket::maxRayCount> rayDirections;
+		std::array<Vector3, RayPacket::maxRayCount> lightDirections;
+		std::array<HitRecord, RayPacket::maxRayCount> closestHits;
+		std::array<ColorRGB, RayPacket::maxRayCount> finalColors;
+		std::array<bool, RayPacket::maxRayCount> isOccluded;
+
+		//Last occluder per light, like RenderPixel keeps
+		std::vector<OcclusionHint> occlusionHints;
+	};
+	thread_local PacketBuffers buffers{};
+
+	//A square block of pixels, the ones past the edge of the image repeat the last row or column so the packet stays full
+	const int rayCount = m_PacketSize * m_PacketSize;
+
+	RayPacket& viewRays = buffers.viewRays;
+	viewRays.rayCount = rayCount;
+	for (int rayIdx{}; rayIdx < rayCount; ++rayIdx)
+	{
+		const int px = std::min(firstX + rayIdx % m_PacketSize, m_Width - 1);
+		const int py = std::min(firstY + rayIdx / m_PacketSize, m_Height - 1);
+
+		buffers.rayDirections[rayIdx] = m_CameraRays.GetRayDirection(px, py);
+		viewRays.SetRay(rayIdx, Ray{ m_CameraRays.GetOrigin(), buffers.rayDirections[rayIdx] });
+		buffers.closestHits[rayIdx] = HitRecord{};
+	}
+
+	pScene->GetClosestHits(viewRays, buffers.closestHits.data());
+
+	for (int rayIdx{}; rayIdx < rayCount; ++rayIdx)
+	{
+		//if we didn't hit anything, we are looking at the skybox
+		buffers.finalColors[rayIdx] = buffers.closestHits[rayIdx].didHit ? ColorRGB{} : ColorRGB{ 0.2f, 0.3f, 0.5f };
+	}
+
+	//The shadow rays towards a light start from neighbouring hits and end in the same point, so they are traced as a packet too
+	const auto& lights = pScene->GetLights();
+	buffers.occlusionHints.resize(lights.size());
+
+	RayPacket& lightRays = buffers.lightRays;
+	lightRays.rayCount = rayCount;
+	for (size_t lightIdx{}; lightIdx < lights.size(); ++lightIdx)
+	{
+		const Light& light = lights[lightIdx];
+		for (int rayIdx{}; rayIdx < rayCount; ++rayIdx)
+		{
+			const HitRecord& closestHit = buffers.closestHits[rayIdx];
+			if (!closestHit.didHit)
+			{
+				lightRays.SetInactive(rayIdx);
+				continue;
+			}
+
+			const Vector3 offsetPosition{ closestHit.origin + closestHit.normal * m_RayOffset };
+			Vector3& lightDirection = buffers.lightDirections[rayIdx];
+			lightDirection = LightUtils::GetDirectionToLight(light, offsetPosition);
+
+			const auto lightDistance{ lightDirection.Magnitude() };
+			lightDirection /= lightDistance;
+
+			lightRays.SetRay(rayIdx, Ray{ offsetPosition, lightDirection, FLT_MIN, lightDistance });
+		}
+
+		if (m_ShadowsEnabled) pScene->DoesHit(lightRays, buffers.isOccluded.data(), &buffers.occlusionHints[lightIdx]);
+		else std::fill_n(buffers.isOccluded.begin(), rayCount, false);
+
+		for (int rayIdx{}; rayIdx < rayCount; ++rayIdx)
+		{
+			if (!buffers.closestHits[rayIdx].didHit || buffers.isOccluded[rayIdx]) continue;
+
+			buffers.finalColors[rayIdx] += ShadeLight(pScene, light, buffers.closestHits[rayIdx], buffers.lightDirections[rayIdx], buffers.rayDirections[rayIdx]);
+		}
+	}
+
+	for (int rayIdx{}; rayIdx < rayCount; ++rayIdx)
+	{
+		const int px = firstX + rayIdx % m_PacketSize;
+		const int py = firstY + rayIdx / m_PacketSize;
+		if (px < m_Width && py < m_Height) WritePixel(px, py, buffers.finalColors[rayIdx]);
+	}
+}
+
+ColorRGB Renderer::ShadeLight(Scene* pScene, const Light& light, const HitRecord& closestHit, const Vector3& lightDirection, const Vector3& rayDirection) const
+{
+	RT_COUNT(ShadeCalls, 1);
+	auto& materials = pScene->GetMaterials();
+
+	switch (m_LightingMode)
 	{
-		for (int py = 0; py < m_Height; ++py)
+	case LightingMode::ObservedArea: //LambertCosine
 		{
-			m_PixelIndices.emplace_back(static_cast<float>(px), static_cast<float>(py));
+			const auto lightNormalAngle{ std::max(Vector3::Dot(closestHit.normal, lightDirection), 0.0f) };
+			return ColorRGB{ lightNormalAngle, lightNormalAngle, lightNormalAngle };
+		}
+
+	case LightingMode::Radiance:
+		{
+			return LightUtils::GetRadiance(light, closestHit.origin);
+		}
+
+	case LightingMode::BRDF:
+		{
+			return materials[closestHit.materialIndex]->Shade(closestHit, lightDirection, -rayDirection);
+		}
+
+	case LightingMode::Combined:
+	default:
+		{
+			const float lightNormalAngle{ std::max(Vector3::Dot(closestHit.normal, lightDirection), 0.0f) };
+			const ColorRGB radiance{ LightUtils::GetRadiance(light, closestHit.origin) };
+			const auto material = materials[closestHit.materialIndex];
+			const ColorRGB BRDF{ material->Shade(closestHit, lightDirection, -rayDirection) };
+			return radiance * BRDF * lightNormalAngle;
 		}
 	}
 }
 
-void Renderer::Render(Scene* pScene) const
+void Renderer::WritePixel(int px, int py, ColorRGB finalColor) const
 {
-	std::for_each(std::execution::par, m_PixelIndices.begin(), m_PixelIndices.end(), [&](const Vector2& rayLocation)
+	const uint32_t pixelIdx = static_cast<uint32_t>(px) + (static_cast<uint32_t>(py) * m_Width);
+
+	//The average is taken before clamping, so bright samples keep their weight
+	if (m_AccumulationEnabled)
 	{
-		RenderPixel(pScene, rayLocation);
+		ColorRGB displayedColor{ finalColor };
+		displayedColor.MaxToOne();
+		const float luminance = 0.2126f * displayedColor.r + 0.7152f * displayedColor.g + 0.0722f * displayedColor.b;
+
+		PixelSamples& samples = m_pPixelSamples[pixelIdx];
+		samples.colorSum += finalColor;
+		samples.luminanceSum += luminance;
+		samples.luminanceSquaredSum += luminance * luminance;
+		++samples.sampleCount;
+
+		//Scaled as a copy, the non-const operator* of ColorRGB would scale the sum itself
+		finalColor = samples.colorSum;
+		finalColor *= 1.f / static_cast<float>(samples.sampleCount);
+	}
+
+	MapPixel(pixelIdx, finalColor);
+}
+
+void Renderer::MapPixel(uint32_t pixelIdx, ColorRGB color) const
+{
+	color.MaxToOne();
+
+	const auto r = static_cast<uint8_t>(color.r * 255);
+	const auto g = static_cast<uint8_t>(color.g * 255);
+	const auto b = static_cast<uint8_t>(color.b * 255);
+
+	if (m_pBuffer) m_pBufferPixels[pixelIdx] = SDL_MapRGB(m_pBuffer->format, r, g, b);
+	else m_pBufferPixels[pixelIdx] = 0xFF000000u | (static_cast<uint32_t>(r) << 16) | (static_cast<uint32_t>(g) << 8) | b;
+}
+
+void Renderer::RenderPass(Scene* pScene, const std::vector<int>* pTileIndices)
+{
+	//The first sample goes through the centre of the pixels, the next ones through the points of a Halton sequence inside them
+	float pixelOffsetX{ 0.5f };
+	float pixelOffsetY{ 0.5f };
+	if (m_PassCount > 0)
+	{
+		pixelOffsetX = RadicalInverse(m_PassCount, 2);
+		pixelOffsetY = RadicalInverse(m_PassCount, 3);
+	}
+
+	//Snapshot of the camera, the threads only read it
+	m_CameraRays.Setup(pScene->GetCamera(), m_Width, m_Height, pixelOffsetX, pixelOffsetY);
+
+	const bool isAdaptive = m_AccumulationEnabled && m_AdaptiveSampling.enabled;
+	m_TileScheduler.Run(m_ThreadCount, [&](const Tile& tile)
+	{
+		RenderTile(pScene, tile);
+
+		//Every tile is rendered by a single thread, and its pixels are still in cache
+		++m_TileSampleCounts[tile.index];
+		if (isAdaptive) m_TileErrors[tile.index] = EstimateTileError(tile);
+	}, pTileIndices);
+
+	if (pTileIndices)
+	{
+		for (int tileIdx : *pTileIndices)
+		{
+			const Tile& tile = m_TileScheduler.GetTiles()[tileIdx];
+			m_FrameRayCount += tile.width * tile.height;
+		}
+	}
+	else
+	{
+		m_FrameRayCount += m_Width * m_Height;
+	}
+
+	++m_PassCount;
+}
+
+int Renderer::GetMinSampleCount() const
+{
+	if (m_TileSampleCounts.empty()) return 0;
+	return *std::min_element(m_TileSampleCounts.begin(), m_TileSampleCounts.end());
+}
+
+int Renderer::GetMaxSampleCount() const
+{
+	if (m_TileSampleCounts.empty()) return 0;
+	return *std::max_element(m_TileSampleCounts.begin(), m_TileSampleCounts.end());
+}
+
+float Renderer::GetAverageSampleCount() const
+{
+	//Every pixel of a tile has the samples of the tile
+	int64_t sampleCount{};
+	for (int tileIdx{}; tileIdx < m_TileScheduler.GetTileCount(); ++tileIdx)
+	{
+		const Tile& tile = m_TileScheduler.GetTiles()[tileIdx];
+		sampleCount += static_cast<int64_t>(m_TileSampleCounts[tileIdx]) * tile.width * tile.height;
+	}
+	return static_cast<float>(static_cast<double>(sampleCount) / (static_cast<double>(m_Width) * m_Height));
+}
+
+void Renderer::SelectTiles(int rayBudget)
+{
+	const AdaptiveSamplingSettings& settings = m_AdaptiveSampling;
+
+	std::vector<int> candidates{};
+	for (int tileIdx{}; tileIdx < m_TileScheduler.GetTileCount(); ++tileIdx)
+	{
+		const int sampleCount = m_TileSampleCounts[tileIdx];
+		if (sampleCount >= settings.maxSampleCount) continue;
+		if (sampleCount < settings.minSampleCount || m_TileErrors[tileIdx] > settings.errorThreshold) candidates.emplace_back(tileIdx);
+	}
+
+	//The tiles that are still warming up come first, so the first passes after a reset cover the whole image
+	std::sort(candidates.begin(), candidates.end(), [&](int a, int b)
+	{
+		const bool isWarmingUpA = m_TileSampleCounts[a] < settings.minSampleCount;
+		const bool isWarmingUpB = m_TileSampleCounts[b] < settings.minSampleCount;
+		if (isWarmingUpA != isWarmingUpB) return isWarmingUpA;
+		if (isWarmingUpA) return m_TileSampleCounts[a] < m_TileSampleCounts[b];
+		return m_TileErrors[a] > m_TileErrors[b];
 	});
 
+	m_SelectedTiles.clear();
+	for (int tileIdx : candidates)
+	{
+		const Tile& tile = m_TileScheduler.GetTiles()[tileIdx];
+		const int rayCount = tile.width * tile.height;
+		if (rayCount > rayBudget) break;
+
+		m_SelectedTiles.emplace_back(tileIdx);
+		rayBudget -= rayCount;
+	}
+
+	//Back in curve order for the scheduler
+	std::sort(m_SelectedTiles.begin(), m_SelectedTiles.end());
+}
+
+float Renderer::EstimateTileError(const Tile& tile) const
+{
+	//The tile is as noisy as its noisiest pixel, a single edge through a flat wall has to be smoothed too
+	float maxError{};
+	for (int py = tile.y; py < tile.y + tile.height; ++py)
+	{
+		for (int px = tile.x; px < tile.x + tile.width; ++px)
+		{
+			const PixelSamples& samples = m_pPixelSamples[px + py * m_Width];
+			if (samples.sampleCount < 2) return FLT_MAX;
+
+			const float sampleCount = static_cast<float>(samples.sampleCount);
+			const float mean = samples.luminanceSum / sampleCount;
+			const float variance = std::max(samples.luminanceSquaredSum / sampleCount - mean * mean, 0.f);
+
+			//Standard error of the mean
+			maxError = std::max(maxError, std::sqrt(variance / sampleCount));
+		}
+	}
+	return maxError;
+}
+
+void Renderer::WriteAverages() const
+{
+	for (uint32_t pixelIdx{}; pixelIdx < m_PixelSamples.size(); ++pixelIdx)
+	{
+		const PixelSamples& samples = m_pPixelSamples[pixelIdx];
+		if (samples.sampleCount == 0) continue;
+
+		ColorRGB color{ samples.colorSum };
+		color *= 1.f / static_cast<float>(samples.sampleCount);
+		MapPixel(pixelIdx, color);
+	}
+}
+
+void Renderer::WriteSampleHeatmap() const
+{
+	const float maxSampleCount = static_cast<float>(std::max(2, m_AdaptiveSampling.maxSampleCount));
+	for (uint32_t pixelIdx{}; pixelIdx < m_PixelSamples.size(); ++pixelIdx)
+	{
+		const int sampleCount = m_AccumulationEnabled ? m_pPixelSamples[pixelIdx].sampleCount : 1;
+		const float factor = std::clamp((static_cast<float>(sampleCount) - 1.f) / (maxSampleCount - 1.f), 0.f, 1.f);
+		MapPixel(pixelIdx, ColorRGB::Lerp(colors::Blue, colors::Red, factor));
+	}
+}
+
+void Renderer::RenderTile(Scene* pScene, const Tile& tile) const
+{
+	const int endX = tile.x + tile.width;
+	const int endY = tile.y + tile.height;
+
+	if (m_UseWavefront)
+	{
+		RenderTileWavefront(pScene, tile);
+	}
+	else if (m_PacketSize > 1)
+	{
+		for (int py = tile.y; py < endY; py += m_PacketSize)
+		{
+			for (int px = tile.x; px < endX; px += m_PacketSize)
+			{
+				RenderPacket(pScene, px, py);
+			}
+		}
+	}
+	else
+	{
+		for (int py = tile.y; py < endY; ++py)
+		{
+			for (int px = tile.x; px < endX; ++px)
+			{
+				RenderPixel(pScene, px, py, m_CameraRays.GetRayDirection(px, py));
+			}
+		}
+	}
+}
+
+void Renderer::RenderTileWavefront(Scene* pScene, const Tile& tile) const
+{
+	//Kept per thread for the same reason as the packet buffers
+	thread_local WavefrontQueues queues{};
+	thread_local std::vector<OcclusionHint> occlusionHints{};
+
+	const auto& lights = pScene->GetLights();
+	occlusionHints.resize(lights.size());
+
+	const int pixelCount = tile.width * tile.height;
+	for (int firstPixel{}; firstPixel < pixelCount; firstPixel += WavefrontQueues::waveSize)
+	{
+		GenerateStage(tile, firstPixel, queues);
+		ExtendStage(pScene, queues);
+		SortHitsByMaterial(pScene, queues);
+
+		//Light by light, so the colors add up in the same order as in RenderPixel
+		for (size_t lightIdx{}; lightIdx < lights.size(); ++lightIdx)
+		{
+			ShadowStage(pScene, lights[lightIdx], occlusionHints[lightIdx], queues);
+			ShadeStage(pScene, lights[lightIdx], queues);
+		}
+
+		WriteStage(queues);
+	}
+}
+
+void Renderer::GenerateStage(const Tile& tile, int firstPixel, WavefrontQueues& queues) const
+{
+	//The pixels of the tile row by row, a wave starts where the last one stopped
+	queues.rayCount = std::min(WavefrontQueues::waveSize, tile.width * tile.height - firstPixel);
+	for (int rayIdx{}; rayIdx < queues.rayCount; ++rayIdx)
+	{
+		const int pixelIdx = firstPixel + rayIdx;
+		queues.pixelX[rayIdx] = tile.x + pixelIdx % tile.width;
+		queues.pixelY[rayIdx] = tile.y + pixelIdx / tile.width;
+	}
+
+	for (int rayIdx{}; rayIdx < queues.rayCount; ++rayIdx)
+	{
+		const Vector3 direction{ m_CameraRays.GetRayDirection(queues.pixelX[rayIdx], queues.pixelY[rayIdx]) };
+		queues.directionX[rayIdx] = direction.x;
+		queues.directionY[rayIdx] = direction.y;
+		queues.directionZ[rayIdx] = direction.z;
+	}
+
+	std::fill_n(queues.colorR, queues.rayCount, 0.f);
+	std::fill_n(queues.colorG, queues.rayCount, 0.f);
+	std::fill_n(queues.colorB, queues.rayCount, 0.f);
+}
+
+void Renderer::ExtendStage(Scene* pScene, WavefrontQueues& queues) const
+{
+	const ColorRGB skyColor{ 0.2f, 0.3f, 0.5f };
+
+	queues.hitCount = 0;
+	for (int rayIdx{}; rayIdx < queues.rayCount; ++rayIdx)
+	{
+		const Ray viewRay{ m_CameraRays.GetOrigin(), Vector3{ queues.directionX[rayIdx], queues.directionY[rayIdx], queues.directionZ[rayIdx] } };
+
+		HitRecord closestHit{};
+		pScene->GetClosestHit(viewRay, closestHit);
+
+		if (!closestHit.didHit)
+		{
+			queues.colorR[rayIdx] = skyColor.r;
+			queues.colorG[rayIdx] = skyColor.g;
+			queues.colorB[rayIdx] = skyColor.b;
+			continue;
+		}
+
+		const int hitIdx = queues.hitCount++;
+		queues.hitRayIdx[hitIdx] = rayIdx;
+		queues.hitOriginX[hitIdx] = closestHit.origin.x;
+		queues.hitOriginY[hitIdx] = closestHit.origin.y;
+		queues.hitOriginZ[hitIdx] = closestHit.origin.z;
+		queues.hitNormalX[hitIdx] = closestHit.normal.x;
+		queues.hitNormalY[hitIdx] = closestHit.normal.y;
+		queues.hitNormalZ[hitIdx] = closestHit.normal.z;
+		queues.hitDistance[hitIdx] = closestHit.t;
+		queues.hitMaterialIndex[hitIdx] = closestHit.materialIndex;
+	}
+}
+
+void Renderer::SortHitsByMaterial(Scene* pScene, WavefrontQueues& queues) const
+{
+	//Counting sort, the hits of a material keep their order
+	std::array<int, 256> materialStart{};
+	for (int hitIdx{}; hitIdx < queues.hitCount; ++hitIdx)
+	{
+		++materialStart[queues.hitMaterialIndex[hitIdx]];
+	}
+
+	const int materialCount = static_cast<int>(std::min<size_t>(pScene->GetMaterials().size(), materialStart.size()));
+	int start{};
+	for (int materialIdx{}; materialIdx < materialCount; ++materialIdx)
+	{
+		const int count = materialStart[materialIdx];
+		materialStart[materialIdx] = start;
+		start += count;
+	}
+
+	for (int hitIdx{}; hitIdx < queues.hitCount; ++hitIdx)
+	{
+		queues.materialOrder[materialStart[queues.hitMaterialIndex[hitIdx]]++] = hitIdx;
+	}
+}
+
+void Renderer::ShadowStage(Scene* pScene, const Light& light, OcclusionHint& hint, WavefrontQueues& queues) const
+{
+	for (int hitIdx{}; hitIdx < queues.hitCount; ++hitIdx)
+	{
+		const Vector3 origin{ queues.hitOriginX[hitIdx], queues.hitOriginY[hitIdx], queues.hitOriginZ[hitIdx] };
+		const Vector3 normal{ queues.hitNormalX[hitIdx], queues.hitNormalY[hitIdx], queues.hitNormalZ[hitIdx] };
+		const Vector3 offsetPosition{ origin + normal * m_RayOffset };
+
+		Vector3 lightDirection{ LightUtils::GetDirectionToLight(light, offsetPosition) };
+		const auto lightDistance{ lightDirection.Magnitude() };
+		lightDirection /= lightDistance;
+
+		queues.lightDirectionX[hitIdx] = lightDirection.x;
+		queues.lightDirectionY[hitIdx] = lightDirection.y;
+		queues.lightDirectionZ[hitIdx] = lightDirection.z;
+		queues.isLit[hitIdx] = !m_ShadowsEnabled || !pScene->DoesHit(Ray{ offsetPosition, lightDirection, FLT_MIN, lightDistance }, &hint);
+	}
+}
+
+void Renderer::ShadeStage(Scene* pScene, const Light& light, WavefrontQueues& queues) const
+{
+	const auto& materials = pScene->GetMaterials();
+
+	//The lit hits in material order, with the material looked up once per run of hits that share it
+	const auto forEachLitHit = [&](const auto& shade)
+	{
+		Material* pMaterial{};
+		int materialIndex{ -1 };
+
+		for (int orderIdx{}; orderIdx < queues.hitCount; ++orderIdx)
+		{
+			const int hitIdx = queues.materialOrder[orderIdx];
+			if (!queues.isLit[hitIdx]) continue;
+
+			if (queues.hitMaterialIndex[hitIdx] != materialIndex)
+			{
+				materialIndex = queues.hitMaterialIndex[hitIdx];
+				pMaterial = materials[materialIndex];
+			}
+
+			HitRecord hit{};
+			hit.origin = Vector3{ queues.hitOriginX[hitIdx], queues.hitOriginY[hitIdx], queues.hitOriginZ[hitIdx] };
+			hit.normal = Vector3{ queues.hitNormalX[hitIdx], queues.hitNormalY[hitIdx], queues.hitNormalZ[hitIdx] };
+			hit.t = queues.hitDistance[hitIdx];
+			hit.didHit = true;
+			hit.materialIndex = queues.hitMaterialIndex[hitIdx];
+
+			const int rayIdx = queues.hitRayIdx[hitIdx];
+			const Vector3 lightDirection{ queues.lightDirectionX[hitIdx], queues.lightDirectionY[hitIdx], queues.lightDirectionZ[hitIdx] };
+			const Vector3 viewDirection{ -queues.directionX[rayIdx], -queues.directionY[rayIdx], -queues.directionZ[rayIdx] };
+
+			RT_COUNT(ShadeCalls, 1);
+			const ColorRGB color{ shade(pMaterial, hit, lightDirection, viewDirection) };
+			queues.colorR[rayIdx] += color.r;
+			queues.colorG[rayIdx] += color.g;
+			queues.colorB[rayIdx] += color.b;
+		}
+	};
+
+	//Same terms as ShadeLight, with the switch taken once per light and wave instead of once per hit
+	switch (m_LightingMode)
+	{
+	case LightingMode::ObservedArea:
+		forEachLitHit([](Material*, const HitRecord& hit, const Vector3& lightDirection, const Vector3&)
+		{
+			const auto lightNormalAngle{ std::max(Vector3::Dot(hit.normal, lightDirection), 0.0f) };
+			return ColorRGB{ lightNormalAngle, lightNormalAngle, lightNormalAngle };
+		});
+		break;
+
+	case LightingMode::Radiance:
+		forEachLitHit([&light](Material*, const HitRecord& hit, const Vector3&, const Vector3&)
+		{
+			return LightUtils::GetRadiance(light, hit.origin);
+		});
+		break;
+
+	case LightingMode::BRDF:
+		forEachLitHit([](Material* pMaterial, const HitRecord& hit, const Vector3& lightDirection, const Vector3& viewDirection)
+		{
+			return pMaterial->Shade(hit, lightDirection, viewDirection);
+		});
+		break;
+
+	case LightingMode::Combined:
+	default:
+		forEachLitHit([&light](Material* pMaterial, const HitRecord& hit, const Vector3& lightDirection, const Vector3& viewDirection)
+		{
+			const float lightNormalAngle{ std::max(Vector3::Dot(hit.normal, lightDirection), 0.0f) };
+			const ColorRGB radiance{ LightUtils::GetRadiance(light, hit.origin) };
+			const ColorRGB BRDF{ pMaterial->Shade(hit, lightDirection, viewDirection) };
+			return radiance * BRDF * lightNormalAngle;
+		});
+		break;
+	}
+}
+
+void Renderer::WriteStage(const WavefrontQueues& queues) const
+{
+	for (int rayIdx{}; rayIdx < queues.rayCount; ++rayIdx)
+	{
+		WritePixel(queues.pixelX[rayIdx], queues.pixelY[rayIdx], ColorRGB{ queues.colorR[rayIdx], queues.colorG[rayIdx], queues.colorB[rayIdx] });
+	}
+}
+
+void Renderer::SetupTiles()
+{
+	m_TileScheduler.Setup(m_Width, m_Height, m_TileSize, m_TileOrder);
+
+	//The sample counts and errors are kept per tile
+	ResetAccumulation();
+}
+
+void Renderer::Render(Scene* pScene)
+{
+#if RT_ENABLE_COUNTERS
+	Counters::BeginFrame();
+#endif
+
+	if (HasViewChanged(pScene) || !m_AccumulationEnabled) ResetAccumulation();
+
+	m_FrameRayCount = 0;
+	if (!m_AccumulationEnabled || !m_AdaptiveSampling.enabled)
+	{
+		RenderPass(pScene, nullptr);
+	}
+	else
+	{
+		//Passes over the tiles that need samples most until the budget of the frame is spent, none once every tile is smooth
+		const int rayBudget = m_AdaptiveSampling.rayBudget > 0 ? m_AdaptiveSampling.rayBudget : m_Width * m_Height;
+		for (int pass{}; pass < m_AdaptiveSampling.maxPassCount && m_FrameRayCount < rayBudget; ++pass)
+		{
+			SelectTiles(rayBudget - m_FrameRayCount);
+			if (m_SelectedTiles.empty()) break;
+
+			RenderPass(pScene, &m_SelectedTiles);
+		}
+	}
+
+	if (m_ShowSampleHeatmap) WriteSampleHeatmap();
+
+#if RT_ENABLE_COUNTERS
+	Counters::EndFrame();
+#endif
+
 	//@END
 	//Update SDL Surface
-	SDL_UpdateWindowSurface(m_pWindow);
+	if (m_pWindow) SDL_UpdateWindowSurface(m_pWindow);
 }
 
 bool Renderer::SaveBufferToImage() const
 {
-	return SDL_SaveBMP(m_pBuffer, "RayTracing_Buffer.bmp");
+	return !SaveImage("RayTracing_Buffer.bmp");
+}
+
+bool Renderer::SaveImage(const std::string& path) const
+{
+	if (m_pBuffer) return SDL_SaveBMP(m_pBuffer, path.c_str()) == 0;
+	return ImageUtils::WriteBMP(path, m_pBufferPixels, m_Width, m_Height);
 }
 
 void Renderer::CycleLightingMode()
 {
 	//Increment the lighting mode
 	m_LightingMode = static_cast<LightingMode>((static_cast<int>(m_LightingMode) + 1) % static_cast<int>(LightingMode::COUNT));
+	ResetAccumulation();
 }
 
-Vector3 Renderer::GetRayDirection(float x, float y, Camera* pCamera) const
+void Renderer::ToggleAccumulation()
 {
-	//Get the middle of the pixel
-	const auto pcx{ x + 0.5f };
-	const auto pcy{ y + 0.5f };
+	m_AccumulationEnabled = !m_AccumulationEnabled;
+	ResetAccumulation();
+	std::cout << "Accumulation: " << (m_AccumulationEnabled ? "on" : "off") << "\n";
+}
 
-	//From pixel to raster space
-	const auto cx = (2.f * pcx / static_cast<float>(m_Width) - 1) * m_AspectRatio * pCamera->fovAngle;
-	const auto cy = 1 - 2.f * pcy / static_cast<float>(m_Height) * pCamera->fovAngle;
+void Renderer::SetAccumulation(bool isEnabled)
+{
+	m_AccumulationEnabled = isEnabled;
+	ResetAccumulation();
+}
 
-	//From raster to camera space
-	const auto ray = Vector3{ cx,cy,1 };
+void Renderer::ResetAccumulation()
+{
+	//Without accumulating the buffer is never read, turning it back on resets it again
+	if (m_AccumulationEnabled) std::fill(m_PixelSamples.begin(), m_PixelSamples.end(), PixelSamples{});
+	m_PassCount = 0;
 
-	//From camera to world space.
-	const Matrix cameraToWorld{ pCamera->CalculateCameraToWorld() };
+	m_TileSampleCounts.assign(m_TileScheduler.GetTileCount(), 0);
+	m_TileErrors.assign(m_TileScheduler.GetTileCount(), FLT_MAX);
+}
+
+void Renderer::SetAdaptiveSampling(const AdaptiveSamplingSettings& settings)
+{
+	m_AdaptiveSampling = settings;
+	ResetAccumulation();
+}
+
+void Renderer::ToggleAdaptiveSampling()
+{
+	m_AdaptiveSampling.enabled = !m_AdaptiveSampling.enabled;
+	ResetAccumulation();
+	std::cout << "Adaptive sampling: " << (m_AdaptiveSampling.enabled ? "on" : "off") << "\n";
+}
+
+void Renderer::ToggleSampleHeatmap()
+{
+	m_ShowSampleHeatmap = !m_ShowSampleHeatmap;
+
+	//The tiles that are done are not drawn again, so the image is put back from the sums
+	if (!m_ShowSampleHeatmap && m_AccumulationEnabled)
+	{
+		WriteAverages();
+		if (m_pWindow) SDL_UpdateWindowSurface(m_pWindow);
+	}
+}
+
+bool Renderer::HasViewChanged(Scene* pScene)
+{
+	const Camera& camera = pScene->GetCamera();
+	const auto isSameVector = [](const Vector3& a, const Vector3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+
+	const bool hasChanged = pScene != m_pLastScene || pScene->GetRevision() != m_LastSceneRevision
+		|| !isSameVector(camera.origin, m_LastCameraOrigin) || !isSameVector(camera.forward, m_LastCameraForward) || camera.fovAngle != m_LastCameraFov;
+
+	m_pLastScene = pScene;
+	m_LastSceneRevision = pScene->GetRevision();
+	m_LastCameraOrigin = camera.origin;
+	m_LastCameraForward = camera.forward;
+	m_LastCameraFov = camera.fovAngle;
+
+	return hasChanged;
+}
 
-	//Normalize and return
-	return Vector3{ cameraToWorld.TransformVector(ray.Normalized()) };
-}
\ No newline at end of file
+void Renderer::CyclePacketSize()
+{
+	//1 traces every pixel on its own, then 2x2, 4x4 and 8x8 packets
+	m_PacketSize = m_PacketSize * 2 > m_MaxPacketSize ? 1 : m_PacketSize * 2;
+
+	if (m_PacketSize == 1) std::cout << "Ray packets: off\n";
+	else std::cout << "Ray packets: " << m_PacketSize << "x" << m_PacketSize << "\n";
+}
+
+void Renderer::ToggleWavefront()
+{
+	m_UseWavefront = !m_UseWavefront;
+	std::cout << "Wavefront: " << (m_UseWavefront ? "on" : "off") << "\n";
+}
+
+void Renderer::SetTileSize(int tileSize)
+{
+	m_TileSize = std::max(1, (tileSize + m_MaxPacketSize - 1) / m_MaxPacketSize) * m_MaxPacketSize;
+	SetupTiles();
+}
+
+void Renderer::CycleTileSize()
+{
+	//8, 16, 32, 64 and back
+	SetTileSize(m_TileSize * 2 > 64 ? m_MaxPacketSize : m_TileSize * 2);
+	std::cout << "Tiles: " << m_TileSize << "x" << m_TileSize << "\n";
+}
+
+void Renderer::CycleTileOrder()
+{
+	m_TileOrder = static_cast<TileOrder>((static_cast<int>(m_TileOrder) + 1) % static_cast<int>(TileOrder::COUNT));
+	SetupTiles();
+	std::cout << "Tile order: " << TileUtils::GetTileOrderName(m_TileOrder) << "\n";
+}
+
+void Renderer::PrintSchedulerStats() const
+{
+	m_TileScheduler.PrintStats(std::cout);
+	std::cout << std::flush;
+}
@@ -1,6 +1,10 @@
 #pragma once
+#include <string>
 #include <vector>
 
+#include "CameraRays.h"
+#include "TileScheduler.h"
+
 struct SDL_Window;
 struct SDL_Surface;
 
@@ -15,11 +19,35 @@ namespace dae
 	struct Matrix;
 	struct Camera;
 	struct ColorRGB;
+	struct Light;
+	struct HitRecord;
+	struct OcclusionHint;
+	struct WavefrontQueues;
+
+	//Once every tile has minSampleCount samples, the next samples only go to the tiles whose pixels still change from sample to sample
+	struct AdaptiveSamplingSettings
+	{
+		bool enabled{ false };
+
+		//Samples every tile gets before its error estimate is trusted
+		int minSampleCount{ 4 };
+		int maxSampleCount{ 64 };
+
+		//Largest standard error of the mean luminance of a pixel of the tile, in display units, at which a tile stops getting samples
+		float errorThreshold{ 0.004f };
+
+		//Primary rays per frame, 0 is one per pixel of the image. The noisiest tiles get a sample each until it runs out, several times a frame when few are left
+		int rayBudget{};
+		int maxPassCount{ 8 };
+	};
 
 	class Renderer final
 	{
 	public:
 		Renderer(SDL_Window* pWindow);
+
+		//Headless, renders into a framebuffer in memory of 0xAARRGGBB pixels without touching SDL
+		Renderer(int width, int height);
 		~Renderer() = default;
 
 		Renderer(const Renderer&) = delete;
@@ -27,24 +55,147 @@ namespace dae
 		Renderer& operator=(const Renderer&) = delete;
 		Renderer& operator=(Renderer&&) noexcept = delete;
 
-		void Render(Scene* pScene) const;
+		void Render(Scene* pScene);
 		bool SaveBufferToImage() const;
 
+		//Writes the image as a BMP, returns false when it failed
+		bool SaveImage(const std::string& path) const;
+
+		int GetWidth() const { return m_Width; }
+		int GetHeight() const { return m_Height; }
+		const uint32_t* GetPixels() const { return m_pBufferPixels; }
+
 		void CycleLightingMode();
-		void ToggleShadows() { m_ShadowsEnabled = !m_ShadowsEnabled; }
+		void ToggleShadows() { m_ShadowsEnabled = !m_ShadowsEnabled; ResetAccumulation(); }
+
+		//While the camera and the scene stand still every frame adds a sample per pixel, through another spot in the pixel, and the average is shown
+		void ToggleAccumulation();
+		void SetAccumulation(bool isEnabled);
+		void ResetAccumulation();
+
+		//Samples per pixel since the last reset, of the least and the most sampled tile and on average over the image. 1 when not accumulating
+		int GetMinSampleCount() const;
+		int GetMaxSampleCount() const;
+		float GetAverageSampleCount() const;
+
+		//Primary rays traced during the last frame
+		int GetFrameRayCount() const { return m_FrameRayCount; }
+
+		void SetAdaptiveSampling(const AdaptiveSamplingSettings& settings);
+		void ToggleAdaptiveSampling();
+
+		//Shows the samples per pixel instead of the image, from blue for one sample to red for maxSampleCount
+		void ToggleSampleHeatmap();
+
+		//Switches between tracing every pixel on its own and tracing 2x2, 4x4 or 8x8 blocks of pixels as ray packets
+		void CyclePacketSize();
+
+		//Switches between rendering a pixel or packet from start to end, and rendering waves of pixels stage by stage
+		void ToggleWavefront();
+
+		//Tiles are squares of a multiple of the largest packet size, so a packet never crosses the edge of a tile
+		void SetTileSize(int tileSize);
+		void CycleTileSize();
+		void CycleTileOrder();
+
+		//0 renders on every hardware thread
+		void SetThreadCount(int threadCount) { m_ThreadCount = threadCount; }
+
+		//Prints how long every thread was busy during the last frame
+		void PrintSchedulerStats() const;
 
 	private:
-		Vector3 GetRayDirection(float x, float y, Camera* pCamera) const;
-		void RenderPixel(Scene* pScene, const Vector2& rayLocation) const;
-		void SetupPixelIndices();
-		
+		//rayDirection is the normalized direction of the primary ray through the pixel
+		void RenderPixel(Scene* pScene, int px, int py, const Vector3& rayDirection) const;
+
+		//Renders the block of m_PacketSize x m_PacketSize pixels starting at (firstX, firstY), with a packet of primary rays and a packet of shadow rays per light
+		void RenderPacket(Scene* pScene, int firstX, int firstY) const;
+
+		//Renders the pixels of a tile row by row, or its blocks of pixels as packets
+		void RenderTile(Scene* pScene, const Tile& tile) const;
+
+		//The wavefront path: the tile is cut in waves of pixels, and every stage runs over the whole wave before the next one starts
+		void RenderTileWavefront(Scene* pScene, const Tile& tile) const;
+		void GenerateStage(const Tile& tile, int firstPixel, WavefrontQueues& queues) const;
+		void ExtendStage(Scene* pScene, WavefrontQueues& queues) const;
+		void SortHitsByMaterial(Scene* pScene, WavefrontQueues& queues) const;
+		void ShadowStage(Scene* pScene, const Light& light, OcclusionHint& hint, WavefrontQueues& queues) const;
+		void ShadeStage(Scene* pScene, const Light& light, WavefrontQueues& queues) const;
+		void WriteStage(const WavefrontQueues& queues) const;
+
+		//Contribution of a single light that reaches the hit, without the shadow test
+		ColorRGB ShadeLight(Scene* pScene, const Light& light, const HitRecord& closestHit, const Vector3& lightDirection, const Vector3& rayDirection) const;
+		void WritePixel(int px, int py, ColorRGB finalColor) const;
+		void MapPixel(uint32_t pixelIdx, ColorRGB color) const;
+
+		//Renders a sample for every pixel of the tiles, all tiles when pTileIndices is nullptr
+		void RenderPass(Scene* pScene, const std::vector<int>* pTileIndices);
+
+		//Picks the tiles of the next adaptive pass into m_SelectedTiles, those with the fewest samples or the largest error first, as long as they fit in rayBudget
+		void SelectTiles(int rayBudget);
+		float EstimateTileError(const Tile& tile) const;
+
+		void WriteAverages() const;
+		void WriteSampleHeatmap() const;
+
+		//The part of the constructors that doesn't care where the pixels go
+		void Initialize();
+
+		void SetupTiles();
+
+		//Compares the camera and the scene with the ones of the last frame, and remembers them
+		bool HasViewChanged(Scene* pScene);
+
 		SDL_Window* m_pWindow{};
 		SDL_Surface* m_pBuffer{};
 		uint32_t* m_pBufferPixels{};
-		uint32_t m_amountOfPixels{};
-		std::vector<Vector2> m_PixelIndices{};
-		
-		float m_AspectRatio{};
+
+		//The pixels when there is no window
+		std::vector<uint32_t> m_FrameBuffer{};
+
+		//Sums of every sample of a pixel. The color is summed in HDR, the luminance as it shows on screen, for the error estimate
+		struct PixelSamples
+		{
+			ColorRGB colorSum{};
+			float luminanceSum{};
+			float luminanceSquaredSum{};
+			int sampleCount{};
+		};
+
+		//m_pPixelSamples points into it like m_pBufferPixels into the surface
+		std::vector<PixelSamples> m_PixelSamples{};
+		PixelSamples* m_pPixelSamples{};
+		bool m_AccumulationEnabled{ true };
+
+		//Passes since the last reset, with adaptive sampling a pass only covers the tiles that still need samples
+		int m_PassCount{};
+		int m_FrameRayCount{};
+
+		AdaptiveSamplingSettings m_AdaptiveSampling{};
+		bool m_ShowSampleHeatmap{ false };
+
+		//Per tile of m_TileScheduler
+		std::vector<int> m_TileSampleCounts{};
+		std::vector<float> m_TileErrors{};
+		std::vector<int> m_SelectedTiles{};
+
+		//What the last frame was rendered from
+		const Scene* m_pLastScene{};
+		int m_LastSceneRevision{};
+		Vector3 m_LastCameraOrigin{};
+		Vector3 m_LastCameraForward{};
+		float m_LastCameraFov{};
+		int m_PacketSize{ 8 };
+		bool m_UseWavefront{ false };
+		static constexpr int m_MaxPacketSize{ 8 };
+
+		//The camera of the frame being rendered
+		CameraRayGenerator m_CameraRays{};
+
+		TileScheduler m_TileScheduler{};
+		int m_TileSize{ 32 };
+		TileOrder m_TileOrder{ TileOrder::Hilbert };
+
 		static constexpr float m_RayOffset{ 0.001f };
 
 		int m_Width{};
@@ -67,6 +218,6 @@ namespace dae
 		bool m_ShadowsEnabled{ true };
 		LightingMode m_LightingMode{ LightingMode::Combined };
 
-		constexpr int static m_ThreadCount{ 8 };
+		int m_ThreadCount{};
 	};
 }
\ No newline at end of file
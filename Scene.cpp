@@ -1,10 +1,31 @@
 #include "Scene.h"
+#include <chrono>
 #include <iostream>
 #include "Utils.h"
 #include "Material.h"
+#include "BVHCache.h"
+#include "Counters.h"
 
 namespace dae {
 
+#if RT_ENABLE_COUNTERS
+	namespace
+	{
+		//Lets the traversal count into the counters of the thread for the rest of the query, unless the caller asked for the statistics itself
+		struct TraversalCounters final
+		{
+			explicit TraversalCounters(BVHTraversalStats*& pStats)
+			{
+				if (!pStats) pStats = &stats;
+			}
+
+			~TraversalCounters() { Counters::Add(stats); }
+
+			BVHTraversalStats stats{};
+		};
+	}
+#endif
+
 #pragma region Base Scene
 	//Initialize Scene with Default Solid Color Material (RED)
 	Scene::Scene() :
@@ -27,13 +48,15 @@ namespace dae {
 		m_Materials.clear();
 	}
 
-	void dae::Scene::GetClosestHit(const Ray& ray, HitRecord& closestHit)
+	void dae::Scene::GetClosestHit(const Ray& ray, HitRecord& closestHit, BVHTraversalStats* pStats)
 	{
-		for (const auto& sphere : m_SphereGeometries)
-		{
-			GeometryUtils::HitTest_Sphere(sphere, ray, closestHit);
-		}
+#if RT_ENABLE_COUNTERS
+		RT_COUNT(PrimaryRays, 1);
+		RT_COUNT(PlaneTests, static_cast<int64_t>(m_PlaneGeometries.size()));
+		const TraversalCounters traversalCounters{ pStats };
+#endif
 
+		//Planes are unbounded, they are the only geometry outside of the BVH
 		for (const auto& plane : m_PlaneGeometries)
 		{
 			GeometryUtils::HitTest_Plane(plane, ray, closestHit);
@@ -46,22 +69,27 @@ namespace dae {
 		// }	
 		
 			
-		//Handles Triangle(meshes) HitTest
-		m_BVH.IntersectBVH(ray, 0, closestHit);		
+		//Handles Triangle(meshes) and Sphere HitTest
+		if (m_UseTwoLevelBVH) m_TLAS.Intersect(ray, closestHit, pStats);
+		else m_BVH.IntersectBVH(ray, closestHit, pStats);
 	}
 
-	bool Scene::DoesHit(const Ray& ray)
+	bool Scene::DoesHit(const Ray& ray, OcclusionHint* pHint, BVHTraversalStats* pStats)
 	{
-		for (size_t i{}; i < m_SphereGeometries.size(); ++i)
+#if RT_ENABLE_COUNTERS
+		RT_COUNT(ShadowRays, 1);
+		const TraversalCounters traversalCounters{ pStats };
+#endif
+
+		//Neighbouring shadow rays towards the same light are usually blocked by the same primitive
+		if (pHint && pHint->IsValid())
 		{
-			if (GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray))
-			{
-				return true;
-			}
+			if (m_UseTwoLevelBVH ? m_TLAS.IsOccludedBy(ray, *pHint) : m_BVH.IsOccludedBy(ray, pHint->primitiveIdx)) return true;
 		}
 
 		for (size_t i{}; i < m_PlaneGeometries.size(); ++i)
 		{
+			RT_COUNT(PlaneTests, 1);
 			if (GeometryUtils::HitTest_Plane(m_PlaneGeometries[i], ray))
 			{
 				return true;
@@ -77,8 +105,101 @@ namespace dae {
 		// 	}
 		// }
 		
-		//Handles Triangle(meshes) HitTest
-		return  m_BVH.IntersectBVH(ray, 0);		
+		//Handles Triangle(meshes) and Sphere HitTest, a ray that gets through keeps the old hint
+		OcclusionHint occluder{};
+		const bool isOccluded = m_UseTwoLevelBVH ? m_TLAS.IsOccluded(ray, &occluder, pStats) : m_BVH.IsOccluded(ray, &occluder.primitiveIdx, pStats);
+		if (isOccluded && pHint) *pHint = occluder;
+
+		return isOccluded;
+	}
+
+	void Scene::GetClosestHits(RayPacket& packet, HitRecord* pClosestHits, BVHTraversalStats* pStats)
+	{
+#if RT_ENABLE_COUNTERS
+		const TraversalCounters traversalCounters{ pStats };
+#endif
+
+		for (int rayIdx{}; rayIdx < packet.rayCount; ++rayIdx)
+		{
+			if (!packet.IsActive(rayIdx)) continue;
+			RT_COUNT(PrimaryRays, 1);
+			RT_COUNT(PlaneTests, static_cast<int64_t>(m_PlaneGeometries.size()));
+
+			const Ray ray = packet.GetRay(rayIdx);
+			for (const auto& plane : m_PlaneGeometries)
+			{
+				GeometryUtils::HitTest_Plane(plane, ray, pClosestHits[rayIdx]);
+			}
+
+			if (m_UseTwoLevelBVH) m_TLAS.Intersect(ray, pClosestHits[rayIdx], pStats);
+		}
+
+		if (!m_UseTwoLevelBVH) m_BVH.IntersectPacket(packet, pClosestHits, pStats);
+	}
+
+	void Scene::DoesHit(RayPacket& packet, bool* pOccluded, OcclusionHint* pHint, BVHTraversalStats* pStats)
+	{
+#if RT_ENABLE_COUNTERS
+		const TraversalCounters traversalCounters{ pStats };
+#endif
+
+		const bool hasHint = pHint && pHint->IsValid();
+		for (int rayIdx{}; rayIdx < packet.rayCount; ++rayIdx)
+		{
+			pOccluded[rayIdx] = false;
+			if (!packet.IsActive(rayIdx)) continue;
+			RT_COUNT(ShadowRays, 1);
+
+			const Ray ray = packet.GetRay(rayIdx);
+			if (hasHint && (m_UseTwoLevelBVH ? m_TLAS.IsOccludedBy(ray, *pHint) : m_BVH.IsOccludedBy(ray, pHint->primitiveIdx)))
+			{
+				pOccluded[rayIdx] = true;
+				continue;
+			}
+
+			for (const auto& plane : m_PlaneGeometries)
+			{
+				RT_COUNT(PlaneTests, 1);
+				if (!GeometryUtils::HitTest_Plane(plane, ray)) continue;
+
+				pOccluded[rayIdx] = true;
+				break;
+			}
+
+			if (!m_UseTwoLevelBVH || pOccluded[rayIdx]) continue;
+
+			OcclusionHint occluder{};
+			pOccluded[rayIdx] = m_TLAS.IsOccluded(ray, &occluder, pStats);
+			if (pOccluded[rayIdx] && pHint) *pHint = occluder;
+		}
+
+		if (m_UseTwoLevelBVH) return;
+
+		OcclusionHint occluder{};
+		m_BVH.IsPacketOccluded(packet, pOccluded, &occluder.primitiveIdx, pStats);
+		if (occluder.IsValid() && pHint) *pHint = occluder;
+	}
+
+	void Scene::SetTraversalMode(BVHTraversalMode mode)
+	{
+		m_BVH.SetTraversalMode(mode);
+		m_TLAS.SetTraversalMode(mode);
+	}
+
+	void Scene::CycleTraversalMode()
+	{
+		const auto mode = static_cast<BVHTraversalMode>((static_cast<int>(GetTraversalMode()) + 1) % static_cast<int>(BVHTraversalMode::COUNT));
+		SetTraversalMode(mode);
+		std::cout << "BVH traversal: " << GetTraversalModeName(mode) << "\n";
+	}
+
+	void Scene::CycleLeafPackWidth()
+	{
+		BVHBuildSettings settings{ m_BVH.buildSettings };
+		settings.leafPackWidth = settings.leafPackWidth == 1 ? 4 : (settings.leafPackWidth == 4 ? 8 : 1);
+		SetBuildSettings(settings);
+		BuildAccelerationStructure();
+		std::cout << "BVH leaf packs: " << settings.leafPackWidth << " wide\n";
 	}
 
 #pragma region Scene Helpers
@@ -143,6 +264,73 @@ namespace dae {
 		m_Materials.push_back(pMaterial);
 		return static_cast<unsigned char>(m_Materials.size() - 1);
 	}
+
+	BVHReport Scene::CreateBVHReport() const
+	{
+		BVHReport report{};
+		report.sceneName = sceneName;
+
+		if (m_UseTwoLevelBVH)
+		{
+			const std::vector<BVH>& blas = m_TLAS.GetBLAS();
+			for (size_t blasIdx{}; blasIdx < blas.size(); ++blasIdx)
+			{
+				report.trees.emplace_back(blas[blasIdx].CalculateStats());
+				report.trees.back().name = "BLAS " + std::to_string(blasIdx);
+			}
+		}
+		else
+		{
+			report.trees.emplace_back(m_BVH.CalculateStats());
+			report.trees.back().name = "world";
+		}
+
+		return report;
+	}
+
+	void Scene::SetBuildSettings(const BVHBuildSettings& settings)
+	{
+		m_BVH.buildSettings = settings;
+		m_TLAS.SetBuildSettings(settings);
+	}
+
+	void Scene::BuildAccelerationStructure()
+	{
+		++m_Revision;
+		const auto start = std::chrono::high_resolution_clock::now();
+
+		if (m_UseTwoLevelBVH)
+		{
+			m_TLAS.BuildBLAS(m_TriangleMeshGeometries, m_SphereGeometries);
+			m_TLAS.Build(m_TriangleMeshGeometries);
+		}
+		else
+		{
+			m_BVH.BuildBVH(m_TriangleMeshGeometries, m_SphereGeometries);
+		}
+
+		const auto end = std::chrono::high_resolution_clock::now();
+		m_BuildTime = std::chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	void Scene::UpdateAccelerationStructure()
+	{
+		++m_Revision;
+
+		//The instances pick up the new transforms, the vertices stay untouched
+		if (m_UseTwoLevelBVH)
+		{
+			m_TLAS.Build(m_TriangleMeshGeometries);
+			return;
+		}
+
+		for (auto& mesh : m_TriangleMeshGeometries)
+		{
+			mesh.UpdateTransforms();
+		}
+
+		m_BVH.UpdateBVH(m_TriangleMeshGeometries, m_SphereGeometries);
+	}
 #pragma endregion
 #pragma endregion
 
@@ -168,6 +356,7 @@ namespace dae {
 		AddPlane({ 0.f, 75.f, 0.f }, { 0.f, -1.f,0.f }, matId_Solid_Yellow);
 		AddPlane({ 0.f, 0.f, 125.f }, { 0.f, 0.f,-1.f }, matId_Solid_Magenta);
 
+		BuildAccelerationStructure();
 	}
 
 	void Scene_W2::Initialize()
@@ -198,6 +387,8 @@ namespace dae {
 		AddPlane({ 0.f, 10.f, 0.f }, { 0.f, -1.f,0.f }, matId_Solid_Yellow);
 		AddPlane({ 0.f, 0.f, 10.f }, { 0.f, 0.f,-1.f }, matId_Solid_Magenta);
 
+		BuildAccelerationStructure();
+
 		AddPointLight({ 0.f, 5.f, -5.f }, 70.f, colors::White);
 	}
 
@@ -239,6 +430,8 @@ namespace dae {
 		AddPlane({ 5.f, 0.f, 0.f }, { -1.f, 0.f,0.f }, matLambert_GrayBlue);		//Right
 		AddPlane({ -5.f, 0.f, 0.f }, { 1.f, 0.f,0.f }, matLambert_GrayBlue);		//Left
 
+		BuildAccelerationStructure();
+
 		AddPointLight({ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, 0.61f, 0.45f });
 		AddPointLight({ -2.5f, 5.f, -5.f }, 70.f, ColorRGB{ 1.f, 0.8f, 0.45f });
 		AddPointLight({ 2.5f, 2.5f, -5.f }, 50.f, ColorRGB{ .34f, 0.47f, 0.68f });
@@ -256,10 +449,9 @@ namespace dae {
 		for(auto& mesh : m_TriangleMeshGeometries)
 		{
 			mesh.RotateY(yawAngle);
-			mesh.UpdateTransforms();
 		}
 
-		m_BVH.BuildBVH(m_TriangleMeshGeometries);
+		UpdateAccelerationStructure();
 	}
 
 	void Scene_W4::Initialize()
@@ -316,7 +508,9 @@ namespace dae {
 		m_Meshes.back()->AppendTriangle(baseTriangle, true);
 		m_Meshes.back()->Translate({ 1.75f,4.5f,0.f });
 		m_Meshes.back()->UpdateTransforms();
-		m_BVH.BuildBVH(m_TriangleMeshGeometries);
+
+		m_UseTwoLevelBVH = true;
+		BuildAccelerationStructure();
 
 		AddPointLight(Vector3{ 0.f, 5.f, 5.f }, 50.f, ColorRGB{ 1.f, .61f, .45f }); //Backlight
 		AddPointLight(Vector3{ -2.5f, 5.f, -5.f }, 70.f, ColorRGB{ 1.f, .8f, .45f }); //Front Light Left
@@ -335,10 +529,9 @@ namespace dae {
 		for(auto& mesh : m_TriangleMeshGeometries)
 		{
 			mesh.RotateY(yawAngle);
-			mesh.UpdateTransforms();
 		}
 
-		m_BVH.BuildBVH(m_TriangleMeshGeometries);
+		UpdateAccelerationStructure();
 	}
 
 	void Scene_W4_Bunny::Initialize()
@@ -372,8 +565,38 @@ namespace dae {
 		// Utils::ParseOBJ("Resources/simple_object.obj", m_Meshes[1]->positions, m_Meshes[1]->normals, m_Meshes[1]->indices);
 		// m_Meshes[1]->UpdateTransforms();
 		
-		m_BVH.BuildBVH(m_TriangleMeshGeometries);
+		m_UseTwoLevelBVH = true;
+
+		//The leaves of the bunny are tested 4 triangles at a time
+		BVHBuildSettings buildSettings{};
+		buildSettings.leafPackWidth = 4;
+		SetBuildSettings(buildSettings);
+
+		//The bunny never changes, its BLAS only has to be built on the very first launch
+		m_TLAS.SetBLASCachePath(0, BVHCache::GetCachePath("Resources/lowpoly_bunny.obj"));
+		BuildAccelerationStructure();
 	}
 
 #pragma endregion
-}
+
+#pragma region Scene Utils
+	namespace SceneUtils
+	{
+		Scene* CreateScene(const std::string& sceneName)
+		{
+			if (sceneName == "W1") return new Scene_W1();
+			if (sceneName == "W2") return new Scene_W2();
+			if (sceneName == "W3") return new Scene_W3();
+			if (sceneName == "W4") return new Scene_W4();
+			if (sceneName == "Bunny") return new Scene_W4_Bunny();
+			return nullptr;
+		}
+
+		const std::vector<std::string>& GetSceneNames()
+		{
+			static const std::vector<std::string> sceneNames{ "W1", "W2", "W3", "W4", "Bunny" };
+			return sceneNames;
+		}
+	}
+#pragma endregion
+}
\ No newline at end of file
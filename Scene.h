@@ -3,9 +3,11 @@
 #include <vector>
 
 #include "BVHNode.h"
+#include "TLAS.h"
 #include "Math.h"
 #include "DataTypes.h"
 #include "Camera.h"
+#include "RayPacket.h"
 
 namespace dae
 {
@@ -35,16 +37,43 @@ namespace dae
 		}
 
 		Camera& GetCamera() { return m_Camera; }
-		void GetClosestHit(const Ray& ray, HitRecord& closestHit);
-		bool DoesHit(const Ray& ray);
+		void GetClosestHit(const Ray& ray, HitRecord& closestHit, BVHTraversalStats* pStats = nullptr);
+
+		//Shadow ray query, only reports whether anything lies in [ray.min, ray.max].
+		//Pass the same hint for every shadow ray towards a light, it remembers the last occluder.
+		bool DoesHit(const Ray& ray, OcclusionHint* pHint = nullptr, BVHTraversalStats* pStats = nullptr);
+
+		//Closest hits of a packet of coherent rays, pClosestHits holds a record per ray. Two-level scenes trace the rays one by one
+		void GetClosestHits(RayPacket& packet, HitRecord* pClosestHits, BVHTraversalStats* pStats = nullptr);
+
+		//Shadow rays of a packet, pOccluded receives per ray whether anything lies in [min, max]. Inactive rays are never occluded.
+		//The hint works as for a single shadow ray, every ray of the packet is tested against it first
+		void DoesHit(RayPacket& packet, bool* pOccluded, OcclusionHint* pHint = nullptr, BVHTraversalStats* pStats = nullptr);
+
+		void SetTraversalMode(BVHTraversalMode mode);
+		BVHTraversalMode GetTraversalMode() const { return m_BVH.GetTraversalMode(); }
+		void CycleTraversalMode();
+
+		//Steps the leaf triangle packs through 1, 4 and 8 wide and rebuilds the acceleration structure
+		void CycleLeafPackWidth();
 
 		const std::vector<Plane>& GetPlaneGeometries() const { return m_PlaneGeometries; }
 		const std::vector<Sphere>& GetSphereGeometries() const { return m_SphereGeometries; }
+		const std::vector<TriangleMesh>& GetTriangleMeshGeometries() const { return m_TriangleMeshGeometries; }
 		const std::vector<Light>& GetLights() const { return m_Lights; }
-		const std::vector<Material*> GetMaterials() const { return m_Materials; }
+		const std::vector<Material*>& GetMaterials() const { return m_Materials; }
 
 		const std::string GetSceneName() const {return sceneName;}
 
+		//Counts the builds and updates of the acceleration structure, it moves on whenever the geometry changes
+		int GetRevision() const { return m_Revision; }
+
+		//Milliseconds the last BuildAccelerationStructure took, refits not included
+		double GetBuildTime() const { return m_BuildTime; }
+
+		//Static statistics of the single BVH, or of every BLAS when the scene uses two levels
+		BVHReport CreateBVHReport() const;
+
 	protected:
 		std::string	sceneName;
 		std::vector<Plane> m_PlaneGeometries{};
@@ -67,8 +96,25 @@ namespace dae
 		Light* AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color);
 		Light* AddDirectionalLight(const Vector3& direction, float intensity, const ColorRGB& color);
 		unsigned char AddMaterial(Material* pMaterial);
+
+		//Picks the builder of the scene, e.g. the LBVH for meshes that deform every frame. Call before BuildAccelerationStructure
+		void SetBuildSettings(const BVHBuildSettings& settings);
+
+		//Builds the acceleration structure over m_TriangleMeshGeometries and m_SphereGeometries
+		void BuildAccelerationStructure();
+
+		//Call after changing the transforms of the triangle meshes
+		void UpdateAccelerationStructure();
 		
 		BVH m_BVH{};
+
+		//Object space BVH per mesh plus a top level over the instances, moving a mesh then only costs a TLAS rebuild.
+		//Meshes that deform (not just move) need the single world space BVH instead.
+		TLAS m_TLAS{};
+		bool m_UseTwoLevelBVH{ false };
+
+		int m_Revision{};
+		double m_BuildTime{};
 	};
 
 
@@ -165,4 +211,11 @@ namespace dae
 	private:
 		std::vector<TriangleMesh*> m_Meshes{};
 	};
-}
+
+	namespace SceneUtils
+	{
+		//The built-in scenes by the names GetSceneNames returns, nullptr for any other name. The scene still has to be initialized
+		Scene* CreateScene(const std::string& sceneName);
+		const std::vector<std::string>& GetSceneNames();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,361 @@
+#include "TLAS.h"
+#include "BVHCache.h"
+#include "TraversalStack.h"
+#include "Utils.h"
+
+#include <chrono>
+#include <iostream>
+
+namespace dae
+{
+	void TLAS::BuildBLAS(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries)
+	{
+		m_BLAS.clear();
+		m_BLAS.resize(triangleMeshes.size() + (sphereGeometries.empty() ? 0 : 1));
+
+		if (!sphereGeometries.empty())
+		{
+			m_BLAS.back().buildSettings = m_BuildSettings;
+			m_BLAS.back().SetTraversalMode(m_TraversalMode);
+			m_BLAS.back().BuildBLAS(sphereGeometries);
+		}
+
+		for (size_t i{}; i < triangleMeshes.size(); ++i)
+		{
+			m_BLAS[i].buildSettings = m_BuildSettings;
+			m_BLAS[i].SetTraversalMode(m_TraversalMode);
+
+			//A mesh without triangles builds an empty tree, there is nothing worth caching
+			const std::string cachePath = i < m_BLASCachePaths.size() ? m_BLASCachePaths[i] : std::string{};
+			if (cachePath.empty() || triangleMeshes[i].indices.empty())
+			{
+				m_BLAS[i].BuildBLAS(triangleMeshes[i]);
+				continue;
+			}
+
+			const auto start = std::chrono::high_resolution_clock::now();
+			const bool isCached = BVHCache::Load(cachePath, triangleMeshes[i], m_BLAS[i]);
+			bool isSaved{};
+			if (!isCached)
+			{
+				m_BLAS[i].BuildBLAS(triangleMeshes[i]);
+				isSaved = BVHCache::Save(cachePath, triangleMeshes[i], m_BLAS[i]);
+			}
+			const auto end = std::chrono::high_resolution_clock::now();
+
+			const char* pResult = isCached ? "BLAS loaded from " : (isSaved ? "BLAS built and cached to " : "BLAS built, failed to cache it to ");
+			std::cout << pResult << cachePath << " in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms\n";
+		}
+	}
+
+	void TLAS::SetBLASCachePath(size_t meshIdx, const std::string& cachePath)
+	{
+		if (m_BLASCachePaths.size() <= meshIdx) m_BLASCachePaths.resize(meshIdx + 1);
+		m_BLASCachePaths[meshIdx] = cachePath;
+	}
+
+	void TLAS::Build(const std::vector<TriangleMesh>& triangleMeshes)
+	{
+		if (m_BLAS.size() < triangleMeshes.size()) BuildBLAS(triangleMeshes);
+
+		//Place every mesh that has triangles, and the spheres where they are
+		m_Instances.clear();
+		m_Instances.reserve(m_BLAS.size());
+		for (size_t i{}; i < m_BLAS.size(); ++i)
+		{
+			const BVH& blas = m_BLAS[i];
+			if (!blas.isBuild) continue;
+
+			BVHInstance instance{};
+			instance.blasIdx = static_cast<int>(i);
+
+			const BVHNode& root = blas.bvhNode[blas.rootNodeIdx];
+			if (i >= triangleMeshes.size())
+			{
+				instance.isWorldSpace = true;
+				instance.worldBounds = AABB{ root.aabbMin, root.aabbMax };
+				m_Instances.emplace_back(instance);
+				continue;
+			}
+
+			instance.objectToWorld = triangleMeshes[i].GetTransform();
+			instance.worldToObject = Matrix::Inverse(instance.objectToWorld);
+			instance.normalToWorld = Matrix::Transpose(instance.worldToObject);
+
+			//World bounds are the bounds of the 8 transformed corners of the object space root
+			for (int corner{}; corner < 8; ++corner)
+			{
+				const Vector3 position
+				{
+					(corner & 1) ? root.aabbMax.x : root.aabbMin.x,
+					(corner & 2) ? root.aabbMax.y : root.aabbMin.y,
+					(corner & 4) ? root.aabbMax.z : root.aabbMin.z
+				};
+
+				instance.worldBounds.Grow(instance.objectToWorld.TransformPoint(position));
+			}
+
+			m_Instances.emplace_back(instance);
+		}
+
+		m_Nodes.clear();
+		if (m_Instances.empty()) return;
+
+		//One leaf per instance
+		m_Nodes.reserve(m_Instances.size() * 2 - 1);
+		std::vector<int> nodeIndices{};
+		nodeIndices.reserve(m_Instances.size());
+		for (size_t i{}; i < m_Instances.size(); ++i)
+		{
+			TLASNode leaf{};
+			leaf.aabbMin = m_Instances[i].worldBounds.min;
+			leaf.aabbMax = m_Instances[i].worldBounds.max;
+			leaf.instanceIdx = static_cast<int>(i);
+
+			nodeIndices.emplace_back(static_cast<int>(m_Nodes.size()));
+			m_Nodes.emplace_back(leaf);
+		}
+
+		//Agglomerative clustering: keep merging the two nodes that are each others best match,
+		//a handful of instances makes the quadratic search cheaper than any binning
+		int nodeA = 0;
+		int nodeB = FindBestMatch(nodeIndices, nodeA);
+		while (nodeIndices.size() > 1)
+		{
+			const int nodeC = FindBestMatch(nodeIndices, nodeB);
+			if (nodeA != nodeC)
+			{
+				nodeA = nodeB;
+				nodeB = nodeC;
+				continue;
+			}
+
+			const TLASNode& left = m_Nodes[nodeIndices[nodeA]];
+			const TLASNode& right = m_Nodes[nodeIndices[nodeB]];
+
+			TLASNode parent{};
+			parent.aabbMin = Vector3::Min(left.aabbMin, right.aabbMin);
+			parent.aabbMax = Vector3::Max(left.aabbMax, right.aabbMax);
+			parent.leftChild = nodeIndices[nodeA];
+			parent.rightChild = nodeIndices[nodeB];
+
+			//The parent takes the place of A, the last entry fills the hole B leaves behind
+			nodeIndices[nodeA] = static_cast<int>(m_Nodes.size());
+			m_Nodes.emplace_back(parent);
+
+			const int lastIdx = static_cast<int>(nodeIndices.size()) - 1;
+			nodeIndices[nodeB] = nodeIndices[lastIdx];
+			nodeIndices.pop_back();
+			if (nodeA == lastIdx) nodeA = nodeB;
+
+			if (nodeIndices.size() > 1) nodeB = FindBestMatch(nodeIndices, nodeA);
+		}
+
+		m_RootNodeIdx = nodeIndices[0];
+		m_StackSize = CalculateMaxDepth() + 1;
+	}
+
+	int TLAS::CalculateMaxDepth() const
+	{
+		//Node and depth
+		std::vector<std::pair<int, int>> stack{ { m_RootNodeIdx, 0 } };
+		int maxDepth{};
+
+		while (!stack.empty())
+		{
+			const auto [nodeIdx, depth] = stack.back();
+			stack.pop_back();
+
+			const TLASNode& node = m_Nodes[nodeIdx];
+			if (node.isLeaf())
+			{
+				maxDepth = std::max(maxDepth, depth);
+				continue;
+			}
+
+			stack.emplace_back(node.leftChild, depth + 1);
+			stack.emplace_back(node.rightChild, depth + 1);
+		}
+
+		return maxDepth;
+	}
+
+	void TLAS::SetTraversalMode(BVHTraversalMode mode)
+	{
+		m_TraversalMode = mode;
+		for (BVH& blas : m_BLAS)
+		{
+			blas.SetTraversalMode(mode);
+		}
+	}
+
+	int TLAS::FindBestMatch(const std::vector<int>& nodeIndices, int nodeIdxA) const
+	{
+		//The best match is the node that gives the smallest combined box
+		float smallestArea = FLT_MAX;
+		int bestIdx = -1;
+
+		const TLASNode& nodeA = m_Nodes[nodeIndices[nodeIdxA]];
+		for (int i{}; i < static_cast<int>(nodeIndices.size()); ++i)
+		{
+			if (i == nodeIdxA) continue;
+
+			const TLASNode& nodeB = m_Nodes[nodeIndices[i]];
+			const AABB combined{ Vector3::Min(nodeA.aabbMin, nodeB.aabbMin), Vector3::Max(nodeA.aabbMax, nodeB.aabbMax) };
+
+			const float area = combined.Area();
+			if (area < smallestArea)
+			{
+				smallestArea = area;
+				bestIdx = i;
+			}
+		}
+
+		return bestIdx;
+	}
+
+	Ray TLAS::ToObjectSpace(const Ray& ray, const BVHInstance& instance)
+	{
+		//The direction is not normalized, this way t means the same distance in both spaces
+		return Ray
+		{
+			instance.worldToObject.TransformPoint(ray.origin),
+			instance.worldToObject.TransformVector(ray.direction),
+			ray.min,
+			ray.max
+		};
+	}
+
+	void TLAS::IntersectInstance(const Ray& ray, const BVHInstance& instance, HitRecord& hitRecord, BVHTraversalStats* pStats) const
+	{
+		if (instance.isWorldSpace)
+		{
+			m_BLAS[instance.blasIdx].IntersectBVH(ray, hitRecord, pStats);
+			return;
+		}
+
+		const float closestDistance = hitRecord.t;
+		m_BLAS[instance.blasIdx].IntersectBVH(ToObjectSpace(ray, instance), hitRecord, pStats);
+
+		//The BLAS filled in an object space hit, move it back to world space
+		if (hitRecord.t < closestDistance)
+		{
+			hitRecord.origin = ray.origin + hitRecord.t * ray.direction;
+			hitRecord.normal = instance.normalToWorld.TransformVector(hitRecord.normal).Normalized();
+		}
+	}
+
+	void TLAS::Intersect(const Ray& ray, HitRecord& hitRecord, BVHTraversalStats* pStats) const
+	{
+		if (m_Nodes.empty()) return;
+
+		const TLASNode* node = &m_Nodes[m_RootNodeIdx];
+		if (pStats) ++pStats->boxTests;
+		if (BVH::IntersectAABB(ray, node->aabbMin, node->aabbMax, hitRecord.t) == FLT_MAX) return;
+
+		struct StackEntry
+		{
+			int nodeIdx;
+			float distance;
+		};
+
+		TraversalStack<StackEntry, m_MaxStackDepth> stack{ m_StackSize };
+		int stackPtr = 0;
+
+		while (true)
+		{
+			bool popNext = false;
+
+			if (node->isLeaf())
+			{
+				IntersectInstance(ray, m_Instances[node->instanceIdx], hitRecord, pStats);
+				popNext = true;
+			}
+			else
+			{
+				//Same front-to-back order as the BVH traversal
+				if (pStats) pStats->boxTests += 2;
+				float childDistance = BVH::IntersectAABB(ray, m_Nodes[node->leftChild].aabbMin, m_Nodes[node->leftChild].aabbMax, hitRecord.t);
+				float otherDistance = BVH::IntersectAABB(ray, m_Nodes[node->rightChild].aabbMin, m_Nodes[node->rightChild].aabbMax, hitRecord.t);
+				int nearIdx = node->leftChild;
+				int farIdx = node->rightChild;
+
+				if (childDistance > otherDistance)
+				{
+					std::swap(childDistance, otherDistance);
+					std::swap(nearIdx, farIdx);
+				}
+
+				if (childDistance == FLT_MAX)
+				{
+					popNext = true;
+				}
+				else
+				{
+					node = &m_Nodes[nearIdx];
+					if (otherDistance != FLT_MAX)
+					{
+						assert(stackPtr < m_StackSize && "TLAS is deeper than the traversal stack");
+						stack[stackPtr++] = { farIdx, otherDistance };
+					}
+				}
+			}
+
+			if (!popNext) continue;
+
+			do
+			{
+				if (stackPtr == 0) return;
+				--stackPtr;
+			}
+			while (stack[stackPtr].distance >= hitRecord.t);
+
+			node = &m_Nodes[stack[stackPtr].nodeIdx];
+		}
+	}
+
+	bool TLAS::IsOccluded(const Ray& ray, OcclusionHint* pOccluder, BVHTraversalStats* pStats) const
+	{
+		if (m_Nodes.empty()) return false;
+
+		TraversalStack<int, m_MaxStackDepth> stack{ m_StackSize };
+		int stackPtr = 0;
+		stack[stackPtr++] = m_RootNodeIdx;
+
+		while (stackPtr > 0)
+		{
+			const TLASNode& node = m_Nodes[stack[--stackPtr]];
+			if (pStats) ++pStats->boxTests;
+			if (BVH::IntersectAABB(ray, node.aabbMin, node.aabbMax, ray.max) == FLT_MAX) continue;
+
+			if (node.isLeaf())
+			{
+				const BVHInstance& instance = m_Instances[node.instanceIdx];
+				const BVH& blas = m_BLAS[instance.blasIdx];
+
+				const Ray instanceRay = instance.isWorldSpace ? ray : ToObjectSpace(ray, instance);
+
+				int primitiveIdx{ -1 };
+				if (!blas.IsOccluded(instanceRay, &primitiveIdx, pStats)) continue;
+
+				if (pOccluder) *pOccluder = OcclusionHint{ node.instanceIdx, primitiveIdx };
+				return true;
+			}
+
+			assert(stackPtr + 2 <= m_StackSize && "TLAS is deeper than the traversal stack");
+			stack[stackPtr++] = node.leftChild;
+			stack[stackPtr++] = node.rightChild;
+		}
+
+		return false;
+	}
+
+	bool TLAS::IsOccludedBy(const Ray& ray, const OcclusionHint& occluder) const
+	{
+		if (occluder.instanceIdx < 0 || occluder.instanceIdx >= static_cast<int>(m_Instances.size())) return false;
+
+		const BVHInstance& instance = m_Instances[occluder.instanceIdx];
+		const BVH& blas = m_BLAS[instance.blasIdx];
+		return blas.IsOccludedBy(instance.isWorldSpace ? ray : ToObjectSpace(ray, instance), occluder.primitiveIdx);
+	}
+}
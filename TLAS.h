@@ -0,0 +1,99 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "BVHNode.h"
+#include "Matrix.h"
+
+namespace dae
+{
+	//A placed copy of a bottom level BVH
+	struct BVHInstance
+	{
+		int blasIdx{};
+
+		Matrix objectToWorld{};
+		Matrix worldToObject{};
+
+		//Inverse transpose of objectToWorld, keeps the normals perpendicular to the surface under non-uniform scale and shear
+		Matrix normalToWorld{};
+
+		//The BLAS is already in world space, rays enter it untransformed
+		bool isWorldSpace{};
+
+		AABB worldBounds{};
+	};
+
+	struct TLASNode
+	{
+		Vector3 aabbMin{};
+		Vector3 aabbMax{};
+
+		//Interior nodes point to two children, leaves to a single instance
+		int leftChild{};
+		int rightChild{};
+		int instanceIdx{ -1 };
+
+		bool isLeaf() const { return instanceIdx >= 0; }
+	};
+
+	//Two-level acceleration structure:
+	//every mesh gets an object space BVH that is built once (the BLAS),
+	//and a small top level tree over the world bounds of the instances is rebuilt when they move (the TLAS).
+	//Rays are moved into object space when they enter an instance.
+	class TLAS final
+	{
+	public:
+		//Builds one BLAS per mesh, plus one over all spheres in world space. Only needed when the mesh data or the spheres change
+		void BuildBLAS(const std::vector<TriangleMesh>& triangleMeshes, const std::vector<Sphere>& sphereGeometries = {});
+
+		//The BLAS of this mesh is loaded from the cache file when it is still valid, and written to it after a build otherwise
+		void SetBLASCachePath(size_t meshIdx, const std::string& cachePath);
+
+		//Picks up the current transform of every mesh and rebuilds the top level tree, O(instances)
+		void Build(const std::vector<TriangleMesh>& triangleMeshes);
+
+		void Intersect(const Ray& ray, HitRecord& hitRecord, BVHTraversalStats* pStats = nullptr) const;
+
+		//Occlusion query, see BVH::IsOccluded. pOccluder receives the instance and primitive that was hit
+		bool IsOccluded(const Ray& ray, OcclusionHint* pOccluder = nullptr, BVHTraversalStats* pStats = nullptr) const;
+		bool IsOccludedBy(const Ray& ray, const OcclusionHint& occluder) const;
+
+		//Applies to every BLAS, the top level tree is too small to gain from a wide layout
+		void SetTraversalMode(BVHTraversalMode mode);
+
+		//Used by the next BuildBLAS
+		void SetBuildSettings(const BVHBuildSettings& settings) { m_BuildSettings = settings; }
+
+		bool IsBuild() const { return !m_Nodes.empty(); }
+
+		//One per mesh, followed by the one over the spheres
+		const std::vector<BVH>& GetBLAS() const { return m_BLAS; }
+
+	private:
+		//Stacks up to this size live on the stack of the thread, see TraversalStack
+		static constexpr int m_MaxStackDepth{ 64 };
+
+		//Moves the ray into the object space of the instance
+		static Ray ToObjectSpace(const Ray& ray, const BVHInstance& instance);
+
+		void IntersectInstance(const Ray& ray, const BVHInstance& instance, HitRecord& hitRecord, BVHTraversalStats* pStats) const;
+		int FindBestMatch(const std::vector<int>& nodeIndices, int nodeIdxA) const;
+
+		//Depth of the deepest leaf, the root is at depth 0
+		int CalculateMaxDepth() const;
+
+		//One per mesh, in mesh order, followed by the sphere BLAS when there are spheres
+		std::vector<BVH> m_BLAS{};
+		std::vector<std::string> m_BLASCachePaths{};
+		std::vector<BVHInstance> m_Instances{};
+		std::vector<TLASNode> m_Nodes{};
+		int m_RootNodeIdx{};
+
+		//Most entries a traversal of the top level tree holds at once, the clustering can make it as deep as there are instances
+		int m_StackSize{ 1 };
+
+		BVHTraversalMode m_TraversalMode{ BVHTraversalMode::Binary };
+		BVHBuildSettings m_BuildSettings{};
+	};
+}
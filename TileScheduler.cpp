@@ -0,0 +1,309 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "Counters.h"
+
+namespace dae
+{
+	TileScheduler::~TileScheduler()
+	{
+		{
+			std::lock_guard lock{ m_RunMutex };
+			m_IsStopping = true;
+		}
+		m_RunStarted.notify_all();
+
+		for (std::thread& helper : m_Helpers)
+		{
+			helper.join();
+		}
+	}
+
+	void TileScheduler::Setup(int width, int height, int tileSize, TileOrder order)
+	{
+		m_TileSize = std::max(1, tileSize);
+		m_TileOrder = order;
+
+		const int tileCountX = (width + m_TileSize - 1) / m_TileSize;
+		const int tileCountY = (height + m_TileSize - 1) / m_TileSize;
+
+		//The curves fill a square power of two grid, the tiles outside the image are skipped
+		uint32_t gridSize{ 1 };
+		while (gridSize < static_cast<uint32_t>(std::max(tileCountX, tileCountY))) gridSize *= 2;
+
+		std::vector<std::pair<uint32_t, Tile>> sortedTiles{};
+		sortedTiles.reserve(static_cast<size_t>(tileCountX) * tileCountY);
+
+		for (int tileY{}; tileY < tileCountY; ++tileY)
+		{
+			for (int tileX{}; tileX < tileCountX; ++tileX)
+			{
+				Tile tile{};
+				tile.x = tileX * m_TileSize;
+				tile.y = tileY * m_TileSize;
+				tile.width = std::min(m_TileSize, width - tile.x);
+				tile.height = std::min(m_TileSize, height - tile.y);
+
+				const uint32_t curveIdx = order == TileOrder::Hilbert
+					? TileUtils::GetHilbertIndex(static_cast<uint32_t>(tileX), static_cast<uint32_t>(tileY), gridSize)
+					: TileUtils::GetMortonIndex(static_cast<uint32_t>(tileX), static_cast<uint32_t>(tileY));
+
+				sortedTiles.emplace_back(curveIdx, tile);
+			}
+		}
+
+		std::sort(sortedTiles.begin(), sortedTiles.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+		m_Tiles.clear();
+		m_Tiles.reserve(sortedTiles.size());
+		for (const auto& sortedTile : sortedTiles)
+		{
+			m_Tiles.emplace_back(sortedTile.second);
+			m_Tiles.back().index = static_cast<int>(m_Tiles.size()) - 1;
+		}
+	}
+
+	void TileScheduler::Run(int threadCount, const TileFunction& tileFunction, const std::vector<int>* pTileIndices)
+	{
+		const int tileCount = pTileIndices ? static_cast<int>(pTileIndices->size()) : GetTileCount();
+
+		if (threadCount <= 0) threadCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+		threadCount = std::max(1, std::min(threadCount, tileCount));
+
+		const auto frameStart = std::chrono::high_resolution_clock::now();
+
+		//Every thread owns an equal run of the curve
+		if (static_cast<int>(m_Queues.size()) != threadCount)
+		{
+			m_Queues.clear();
+			for (int threadIdx{}; threadIdx < threadCount; ++threadIdx)
+			{
+				m_Queues.emplace_back(std::make_unique<WorkQueue>());
+			}
+		}
+
+		for (int threadIdx{}; threadIdx < threadCount; ++threadIdx)
+		{
+			WorkQueue& queue = *m_Queues[threadIdx];
+			queue.tiles.clear();
+			queue.stats = TileThreadStats{};
+
+			const int first = static_cast<int>(static_cast<int64_t>(tileCount) * threadIdx / threadCount);
+			const int end = static_cast<int>(static_cast<int64_t>(tileCount) * (threadIdx + 1) / threadCount);
+			for (int runIdx = first; runIdx < end; ++runIdx)
+			{
+				queue.tiles.push_back(pTileIndices ? (*pTileIndices)[runIdx] : runIdx);
+			}
+		}
+
+#if RT_ENABLE_COUNTERS
+		Counters::SetThreadCount(threadCount);
+#endif
+
+		//Only the first runs on more threads than before pay for starting them
+		while (static_cast<int>(m_Helpers.size()) < threadCount - 1)
+		{
+			m_Helpers.emplace_back(&TileScheduler::HelperLoop, this, static_cast<int>(m_Helpers.size()) + 1, m_RunIdx);
+		}
+
+		{
+			std::lock_guard lock{ m_RunMutex };
+			m_pTileFunction = &tileFunction;
+			m_RunThreadCount = threadCount;
+			m_PendingHelperCount = threadCount - 1;
+			++m_RunIdx;
+		}
+		m_RunStarted.notify_all();
+
+		RenderTiles(0, tileFunction);
+
+		{
+			std::unique_lock lock{ m_RunMutex };
+			m_RunFinished.wait(lock, [this] { return m_PendingHelperCount == 0; });
+			m_pTileFunction = nullptr;
+		}
+
+		const auto frameEnd = std::chrono::high_resolution_clock::now();
+		m_FrameTime = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+
+#if RT_ENABLE_COUNTERS
+		for (int threadIdx{}; threadIdx < threadCount; ++threadIdx)
+		{
+			const double busyTime = m_Queues[threadIdx]->stats.busyTime;
+			Counters::AddThreadTime(threadIdx, busyTime, m_FrameTime - busyTime);
+		}
+#endif
+	}
+
+	void TileScheduler::RenderTiles(int threadIdx, const TileFunction& tileFunction)
+	{
+		TileThreadStats& stats = m_Queues[threadIdx]->stats;
+
+#if RT_ENABLE_COUNTERS
+		Counters::BindThread(threadIdx);
+#endif
+
+		//No tiles are added while rendering, so a thread that finds every queue empty is done
+		int tileIdx{};
+		while (true)
+		{
+			const bool isOwnTile = PopTile(threadIdx, tileIdx);
+			if (!isOwnTile && !StealTile(threadIdx, tileIdx)) break;
+
+			const auto start = std::chrono::high_resolution_clock::now();
+			tileFunction(m_Tiles[tileIdx]);
+			const auto end = std::chrono::high_resolution_clock::now();
+
+			stats.busyTime += std::chrono::duration<double, std::milli>(end - start).count();
+			++stats.tileCount;
+			if (!isOwnTile) ++stats.stolenTileCount;
+		}
+
+#if RT_ENABLE_COUNTERS
+		Counters::UnbindThread();
+#endif
+	}
+
+	void TileScheduler::HelperLoop(int threadIdx, int runIdx)
+	{
+		//runIdx is the last run this helper has seen, a run on fewer threads leaves it asleep
+		std::unique_lock lock{ m_RunMutex };
+		while (true)
+		{
+			m_RunStarted.wait(lock, [this, threadIdx, runIdx] { return m_IsStopping || (m_RunIdx != runIdx && threadIdx < m_RunThreadCount); });
+			if (m_IsStopping) return;
+
+			runIdx = m_RunIdx;
+			const TileFunction& tileFunction = *m_pTileFunction;
+
+			lock.unlock();
+			RenderTiles(threadIdx, tileFunction);
+			lock.lock();
+
+			if (--m_PendingHelperCount == 0) m_RunFinished.notify_one();
+		}
+	}
+
+	std::vector<TileThreadStats> TileScheduler::GetThreadStats() const
+	{
+		std::vector<TileThreadStats> threadStats{};
+		threadStats.reserve(m_Queues.size());
+		for (const auto& queue : m_Queues)
+		{
+			threadStats.emplace_back(queue->stats);
+		}
+		return threadStats;
+	}
+
+	double TileScheduler::GetImbalance() const
+	{
+		double busyTimeSum{};
+		double busyTimeMax{};
+		for (const auto& queue : m_Queues)
+		{
+			busyTimeSum += queue->stats.busyTime;
+			busyTimeMax = std::max(busyTimeMax, queue->stats.busyTime);
+		}
+
+		if (busyTimeSum <= 0.0) return 1.0;
+		return busyTimeMax / (busyTimeSum / static_cast<double>(m_Queues.size()));
+	}
+
+	void TileScheduler::PrintStats(std::ostream& os) const
+	{
+		os << "**TILES** " << m_TileSize << "x" << m_TileSize << " " << TileUtils::GetTileOrderName(m_TileOrder)
+			<< ", " << GetTileCount() << " tiles on " << m_Queues.size() << " threads in " << m_FrameTime << " ms\n";
+
+		for (size_t threadIdx{}; threadIdx < m_Queues.size(); ++threadIdx)
+		{
+			const TileThreadStats& stats = m_Queues[threadIdx]->stats;
+			os << "> thread " << threadIdx << ": busy " << stats.busyTime << " ms, "
+				<< stats.tileCount << " tiles (" << stats.stolenTileCount << " stolen)\n";
+		}
+
+		os << "> imbalance " << GetImbalance() << " (slowest over average busy time)\n";
+	}
+
+	bool TileScheduler::PopTile(int threadIdx, int& tileIdx)
+	{
+		WorkQueue& queue = *m_Queues[threadIdx];
+		std::lock_guard lock{ queue.mutex };
+		if (queue.tiles.empty()) return false;
+
+		tileIdx = queue.tiles.front();
+		queue.tiles.pop_front();
+		return true;
+	}
+
+	bool TileScheduler::StealTile(int threadIdx, int& tileIdx)
+	{
+		//Every victim once, starting at the next thread so the thieves don't all line up at the same queue
+		const int threadCount = static_cast<int>(m_Queues.size());
+		for (int offset{ 1 }; offset < threadCount; ++offset)
+		{
+			WorkQueue& victim = *m_Queues[(threadIdx + offset) % threadCount];
+			std::lock_guard lock{ victim.mutex };
+			if (victim.tiles.empty()) continue;
+
+			tileIdx = victim.tiles.back();
+			victim.tiles.pop_back();
+			return true;
+		}
+
+		return false;
+	}
+
+	namespace TileUtils
+	{
+		const char* GetTileOrderName(TileOrder order)
+		{
+			switch (order)
+			{
+			case TileOrder::Morton: return "Morton";
+			case TileOrder::Hilbert: return "Hilbert";
+			default: return "Unknown";
+			}
+		}
+
+		uint32_t GetMortonIndex(uint32_t x, uint32_t y)
+		{
+			//Spreads the lower 16 bits of value over the even bits
+			const auto expandBits = [](uint32_t value)
+			{
+				value &= 0x0000ffff;
+				value = (value | (value << 8)) & 0x00ff00ff;
+				value = (value | (value << 4)) & 0x0f0f0f0f;
+				value = (value | (value << 2)) & 0x33333333;
+				value = (value | (value << 1)) & 0x55555555;
+				return value;
+			};
+
+			return expandBits(x) | (expandBits(y) << 1);
+		}
+
+		uint32_t GetHilbertIndex(uint32_t x, uint32_t y, uint32_t gridSize)
+		{
+			uint32_t index{};
+			for (uint32_t half = gridSize / 2; half > 0; half /= 2)
+			{
+				const uint32_t quadrantX = (x & half) > 0 ? 1 : 0;
+				const uint32_t quadrantY = (y & half) > 0 ? 1 : 0;
+				index += half * half * ((3 * quadrantX) ^ quadrantY);
+
+				//Rotate the quadrant so the curve inside it connects to its neighbours
+				if (quadrantY == 0)
+				{
+					if (quadrantX == 1)
+					{
+						x = gridSize - 1 - x;
+						y = gridSize - 1 - y;
+					}
+					std::swap(x, y);
+				}
+			}
+			return index;
+		}
+	}
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	//Order in which the tiles are handed out, both keep the tiles a thread renders after each other next to each other on screen
+	enum class TileOrder
+	{
+		Morton,
+		Hilbert,
+		//@end
+		COUNT
+	};
+
+	//A block of pixels rendered by a single thread, cut off at the right and bottom edge of the image
+	struct Tile
+	{
+		//Position along the curve, the index of the tile in TileScheduler::GetTiles
+		int index{};
+
+		int x{};
+		int y{};
+		int width{};
+		int height{};
+	};
+
+	//What a single thread did during the last frame
+	struct TileThreadStats
+	{
+		//Milliseconds spent rendering tiles, the rest of the frame the thread was looking for work or waiting on the others
+		double busyTime{};
+		int tileCount{};
+
+		//Tiles taken from the queue of another thread after running out of its own
+		int stolenTileCount{};
+	};
+
+	//Splits the image in tiles and renders them on a number of threads. Every thread starts on its own run of tiles along a
+	//space filling curve, and when it runs out it steals from the far end of the run of another thread, so the threads only
+	//meet when the frame is almost done and the slow parts of the image are spread over every thread.
+	//The helper threads are started by the first Run that needs them and sleep between runs, they live as long as the scheduler.
+	class TileScheduler final
+	{
+	public:
+		using TileFunction = std::function<void(const Tile& tile)>;
+
+		TileScheduler() = default;
+		~TileScheduler();
+
+		TileScheduler(const TileScheduler&) = delete;
+		TileScheduler(TileScheduler&&) noexcept = delete;
+		TileScheduler& operator=(const TileScheduler&) = delete;
+		TileScheduler& operator=(TileScheduler&&) noexcept = delete;
+
+		void Setup(int width, int height, int tileSize, TileOrder order);
+
+		//Calls tileFunction once for every tile, on threadCount threads of which the calling thread is one. 0 uses every hardware thread.
+		//pTileIndices limits it to those tiles, best given in curve order so the runs of the threads stay together on screen
+		void Run(int threadCount, const TileFunction& tileFunction, const std::vector<int>* pTileIndices = nullptr);
+
+		int GetTileSize() const { return m_TileSize; }
+		TileOrder GetTileOrder() const { return m_TileOrder; }
+		int GetTileCount() const { return static_cast<int>(m_Tiles.size()); }
+		const std::vector<Tile>& GetTiles() const { return m_Tiles; }
+
+		//Stats of every thread of the last Run
+		std::vector<TileThreadStats> GetThreadStats() const;
+		double GetFrameTime() const { return m_FrameTime; }
+
+		//The slowest thread's busy time over the average one, 1 when the work was spread perfectly
+		double GetImbalance() const;
+
+		void PrintStats(std::ostream& os) const;
+
+	private:
+		//Padded to a cache line so the threads popping their own tiles don't share one
+		struct alignas(64) WorkQueue
+		{
+			std::mutex mutex{};
+			std::deque<int> tiles{};
+			TileThreadStats stats{};
+		};
+
+		//Renders tiles until every queue is empty, first its own then those of the others
+		void RenderTiles(int threadIdx, const TileFunction& tileFunction);
+
+		//Body of a helper thread, joins every run that includes its threadIdx
+		void HelperLoop(int threadIdx, int runIdx);
+
+		//The owner takes its tiles from the front of its queue, in curve order
+		bool PopTile(int threadIdx, int& tileIdx);
+
+		//Thieves take them from the back, as far away as possible from where the owner is working
+		bool StealTile(int threadIdx, int& tileIdx);
+
+		int m_TileSize{};
+		TileOrder m_TileOrder{};
+
+		//Sorted along the curve
+		std::vector<Tile> m_Tiles{};
+
+		std::vector<std::unique_ptr<WorkQueue>> m_Queues{};
+		double m_FrameTime{};
+
+		//Helper i is thread i + 1, the calling thread of Run is thread 0
+		std::vector<std::thread> m_Helpers{};
+
+		//Guards everything below, the helpers wait on m_RunStarted for a new m_RunIdx and Run on m_RunFinished for the last of them
+		std::mutex m_RunMutex{};
+		std::condition_variable m_RunStarted{};
+		std::condition_variable m_RunFinished{};
+		int m_RunIdx{};
+		int m_RunThreadCount{};
+		int m_PendingHelperCount{};
+		const TileFunction* m_pTileFunction{};
+		bool m_IsStopping{};
+	};
+
+	namespace TileUtils
+	{
+		const char* GetTileOrderName(TileOrder order);
+
+		//Position of the tile at (x, y) along the curve
+		uint32_t GetMortonIndex(uint32_t x, uint32_t y);
+
+		//gridSize is the side of the square grid the curve fills, a power of two
+		uint32_t GetHilbertIndex(uint32_t x, uint32_t y, uint32_t gridSize);
+	}
+}
@@ -19,6 +19,9 @@ namespace dae
 
 		void StartBenchmark(int numFrames = 10);
 
+		//When above 0 every Update moves the time on by timeStep instead of by the clock, so the frames of an offline render show the same moments however long they take
+		void SetFixedTimeStep(float timeStep) { m_FixedTimeStep = timeStep; }
+
 		void Reset();
 		void Start();
 		void Update();
@@ -49,6 +52,7 @@ namespace dae
 
 		bool m_IsStopped = true;
 		bool m_ForceElapsedUpperBound = false;
+		float m_FixedTimeStep = 0.0f;
 
 		bool m_BenchmarkActive = false;
 		float m_BenchmarkHigh{ 0.f };
@@ -0,0 +1,33 @@
+#pragma once
+#include <vector>
+
+namespace dae
+{
+	//The stack of a tree traversal. Every tree that needs at most InlineSize entries gets a fixed array on the stack of the thread,
+	//a deeper one (degenerate geometry, long runs of equal Morton codes, a tree from a cache file) gets one on the heap instead of overflowing it.
+	template<typename T, int InlineSize>
+	class TraversalStack final
+	{
+	public:
+		//requiredSize is the most entries the traversal of the tree can hold at once
+		explicit TraversalStack(int requiredSize)
+		{
+			if (requiredSize <= InlineSize) return;
+
+			m_HeapEntries.resize(requiredSize);
+			m_pEntries = m_HeapEntries.data();
+		}
+
+		TraversalStack(const TraversalStack&) = delete;
+		TraversalStack(TraversalStack&&) noexcept = delete;
+		TraversalStack& operator=(const TraversalStack&) = delete;
+		TraversalStack& operator=(TraversalStack&&) noexcept = delete;
+
+		T& operator[](int idx) { return m_pEntries[idx]; }
+
+	private:
+		T m_InlineEntries[InlineSize];
+		std::vector<T> m_HeapEntries{};
+		T* m_pEntries{ m_InlineEntries };
+	};
+}
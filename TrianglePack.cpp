@@ -0,0 +1,230 @@
+#include "TrianglePack.h"
+#include "BVHNode.h"
+
+#include <bit>
+#include <immintrin.h>
+
+namespace dae
+{
+	namespace
+	{
+		//HitTest_Triangle for the 4 lanes starting at laneOffset, with the same operations in the same order
+		template<int Width>
+		int IntersectLanesSSE(const TrianglePack<Width>& pack, int laneOffset, const Ray& ray, float maxDistance, float* distances)
+		{
+			const auto load = [laneOffset](const float* lanes) { return _mm_load_ps(lanes + laneOffset); };
+
+			const __m128 directionX = _mm_set1_ps(ray.direction.x);
+			const __m128 directionY = _mm_set1_ps(ray.direction.y);
+			const __m128 directionZ = _mm_set1_ps(ray.direction.z);
+
+			const __m128 edge1X = load(pack.edge1X);
+			const __m128 edge1Y = load(pack.edge1Y);
+			const __m128 edge1Z = load(pack.edge1Z);
+			const __m128 edge2X = load(pack.edge2X);
+			const __m128 edge2Y = load(pack.edge2Y);
+			const __m128 edge2Z = load(pack.edge2Z);
+
+			//h = direction x edge2
+			const __m128 hX = _mm_sub_ps(_mm_mul_ps(directionY, edge2Z), _mm_mul_ps(directionZ, edge2Y));
+			const __m128 hY = _mm_sub_ps(_mm_mul_ps(directionZ, edge2X), _mm_mul_ps(directionX, edge2Z));
+			const __m128 hZ = _mm_sub_ps(_mm_mul_ps(directionX, edge2Y), _mm_mul_ps(directionY, edge2X));
+			const __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, hX), _mm_mul_ps(edge1Y, hY)), _mm_mul_ps(edge1Z, hZ));
+
+			//Culled faces and rays parallel to the triangle
+			const __m128 absDeterminant = _mm_andnot_ps(_mm_set1_ps(-0.f), determinant);
+			__m128 hit = _mm_cmpge_ps(_mm_mul_ps(determinant, load(pack.cullSign)), _mm_setzero_ps());
+			hit = _mm_and_ps(hit, _mm_cmpge_ps(absDeterminant, _mm_set1_ps(FLT_EPSILON)));
+
+			const __m128 inverseDeterminant = _mm_div_ps(_mm_set1_ps(1.f), determinant);
+			const __m128 tX = _mm_sub_ps(_mm_set1_ps(ray.origin.x), load(pack.v0X));
+			const __m128 tY = _mm_sub_ps(_mm_set1_ps(ray.origin.y), load(pack.v0Y));
+			const __m128 tZ = _mm_sub_ps(_mm_set1_ps(ray.origin.z), load(pack.v0Z));
+
+			const __m128 u = _mm_mul_ps(inverseDeterminant, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tX, hX), _mm_mul_ps(tY, hY)), _mm_mul_ps(tZ, hZ)));
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmple_ps(u, _mm_set1_ps(1.f))));
+
+			//q = t x edge1
+			const __m128 qX = _mm_sub_ps(_mm_mul_ps(tY, edge1Z), _mm_mul_ps(tZ, edge1Y));
+			const __m128 qY = _mm_sub_ps(_mm_mul_ps(tZ, edge1X), _mm_mul_ps(tX, edge1Z));
+			const __m128 qZ = _mm_sub_ps(_mm_mul_ps(tX, edge1Y), _mm_mul_ps(tY, edge1X));
+
+			const __m128 v = _mm_mul_ps(inverseDeterminant, _mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, qX), _mm_mul_ps(directionY, qY)), _mm_mul_ps(directionZ, qZ)));
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()), _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.f))));
+
+			const __m128 distance = _mm_mul_ps(inverseDeterminant, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)));
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(distance, _mm_set1_ps(ray.min)), _mm_cmplt_ps(distance, _mm_set1_ps(maxDistance))));
+
+			_mm_storeu_ps(distances, distance);
+			return _mm_movemask_ps(hit);
+		}
+
+#ifdef __AVX__
+		//8 lanes at once, only compiled when the compiler is allowed to emit AVX
+		int IntersectLanesAVX(const TrianglePack<8>& pack, const Ray& ray, float maxDistance, float* distances)
+		{
+			const __m256 directionX = _mm256_set1_ps(ray.direction.x);
+			const __m256 directionY = _mm256_set1_ps(ray.direction.y);
+			const __m256 directionZ = _mm256_set1_ps(ray.direction.z);
+
+			const __m256 edge1X = _mm256_load_ps(pack.edge1X);
+			const __m256 edge1Y = _mm256_load_ps(pack.edge1Y);
+			const __m256 edge1Z = _mm256_load_ps(pack.edge1Z);
+			const __m256 edge2X = _mm256_load_ps(pack.edge2X);
+			const __m256 edge2Y = _mm256_load_ps(pack.edge2Y);
+			const __m256 edge2Z = _mm256_load_ps(pack.edge2Z);
+
+			//h = direction x edge2
+			const __m256 hX = _mm256_sub_ps(_mm256_mul_ps(directionY, edge2Z), _mm256_mul_ps(directionZ, edge2Y));
+			const __m256 hY = _mm256_sub_ps(_mm256_mul_ps(directionZ, edge2X), _mm256_mul_ps(directionX, edge2Z));
+			const __m256 hZ = _mm256_sub_ps(_mm256_mul_ps(directionX, edge2Y), _mm256_mul_ps(directionY, edge2X));
+			const __m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1X, hX), _mm256_mul_ps(edge1Y, hY)), _mm256_mul_ps(edge1Z, hZ));
+
+			//Culled faces and rays parallel to the triangle
+			const __m256 absDeterminant = _mm256_andnot_ps(_mm256_set1_ps(-0.f), determinant);
+			__m256 hit = _mm256_cmp_ps(_mm256_mul_ps(determinant, _mm256_load_ps(pack.cullSign)), _mm256_setzero_ps(), _CMP_GE_OQ);
+			hit = _mm256_and_ps(hit, _mm256_cmp_ps(absDeterminant, _mm256_set1_ps(FLT_EPSILON), _CMP_GE_OQ));
+
+			const __m256 inverseDeterminant = _mm256_div_ps(_mm256_set1_ps(1.f), determinant);
+			const __m256 tX = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_load_ps(pack.v0X));
+			const __m256 tY = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_load_ps(pack.v0Y));
+			const __m256 tZ = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_load_ps(pack.v0Z));
+
+			const __m256 u = _mm256_mul_ps(inverseDeterminant, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tX, hX), _mm256_mul_ps(tY, hY)), _mm256_mul_ps(tZ, hZ)));
+			hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(u, _mm256_set1_ps(1.f), _CMP_LE_OQ)));
+
+			//q = t x edge1
+			const __m256 qX = _mm256_sub_ps(_mm256_mul_ps(tY, edge1Z), _mm256_mul_ps(tZ, edge1Y));
+			const __m256 qY = _mm256_sub_ps(_mm256_mul_ps(tZ, edge1X), _mm256_mul_ps(tX, edge1Z));
+			const __m256 qZ = _mm256_sub_ps(_mm256_mul_ps(tX, edge1Y), _mm256_mul_ps(tY, edge1X));
+
+			const __m256 v = _mm256_mul_ps(inverseDeterminant, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(directionX, qX), _mm256_mul_ps(directionY, qY)), _mm256_mul_ps(directionZ, qZ)));
+			hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.f), _CMP_LE_OQ)));
+
+			const __m256 distance = _mm256_mul_ps(inverseDeterminant, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge2X, qX), _mm256_mul_ps(edge2Y, qY)), _mm256_mul_ps(edge2Z, qZ)));
+			hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(distance, _mm256_set1_ps(ray.min), _CMP_GT_OQ), _mm256_cmp_ps(distance, _mm256_set1_ps(maxDistance), _CMP_LT_OQ)));
+
+			_mm256_storeu_ps(distances, distance);
+			return _mm256_movemask_ps(hit);
+		}
+#endif
+
+		float GetCullSign(TriangleCullMode cullMode)
+		{
+			if (cullMode == TriangleCullMode::BackFaceCulling) return 1.f;
+			if (cullMode == TriangleCullMode::FrontFaceCulling) return -1.f;
+			return 0.f;
+		}
+	}
+
+	template<int Width>
+	void TrianglePacks<Width>::Build(const BVHNode* nodes, int nodeCount, const std::vector<BVHTriangle>& triangles)
+	{
+		m_Packs.clear();
+		m_FirstPack.assign(triangles.size(), -1);
+
+		for (int nodeIdx{}; nodeIdx < nodeCount; ++nodeIdx)
+		{
+			//Padding node
+			if (nodeIdx == 1) continue;
+
+			const BVHNode& node = nodes[nodeIdx];
+			if (!node.isLeaf() || node.isSphereLeaf()) continue;
+
+			m_FirstPack[node.leftFirst] = static_cast<int>(m_Packs.size());
+			for (int packFirst{}; packFirst < node.triangleCount; packFirst += Width)
+			{
+				//Value initialized, the lanes that stay empty have no area
+				TrianglePack<Width>& pack = m_Packs.emplace_back();
+
+				for (int lane{}; lane < Width && packFirst + lane < node.triangleCount; ++lane)
+				{
+					const BVHTriangle& triangle = triangles[node.leftFirst + packFirst + lane];
+					pack.v0X[lane] = triangle.v0.x;
+					pack.v0Y[lane] = triangle.v0.y;
+					pack.v0Z[lane] = triangle.v0.z;
+					pack.edge1X[lane] = triangle.edge1.x;
+					pack.edge1Y[lane] = triangle.edge1.y;
+					pack.edge1Z[lane] = triangle.edge1.z;
+					pack.edge2X[lane] = triangle.edge2.x;
+					pack.edge2Y[lane] = triangle.edge2.y;
+					pack.edge2Z[lane] = triangle.edge2.z;
+					pack.normalX[lane] = triangle.normal.x;
+					pack.normalY[lane] = triangle.normal.y;
+					pack.normalZ[lane] = triangle.normal.z;
+					pack.cullSign[lane] = GetCullSign(triangle.cullMode);
+					pack.materialIndex[lane] = triangle.materialIndex;
+				}
+			}
+		}
+	}
+
+	template<int Width>
+	void TrianglePacks<Width>::Clear()
+	{
+		m_Packs.clear();
+		m_FirstPack.clear();
+	}
+
+	template<int Width>
+	int TrianglePacks<Width>::IntersectLanes(const TrianglePack<Width>& pack, const Ray& ray, float maxDistance, float* distances)
+	{
+		if constexpr (Width == 4)
+		{
+			return IntersectLanesSSE(pack, 0, ray, maxDistance, distances);
+		}
+		else
+		{
+#ifdef __AVX__
+			return IntersectLanesAVX(pack, ray, maxDistance, distances);
+#else
+			//Without AVX the 8 lanes are tested as two halves
+			return IntersectLanesSSE(pack, 0, ray, maxDistance, distances) | IntersectLanesSSE(pack, 4, ray, maxDistance, distances + 4) << 4;
+#endif
+		}
+	}
+
+	template<int Width>
+	void TrianglePacks<Width>::Intersect(int first, int count, const Ray& ray, HitRecord& hitRecord) const
+	{
+		const TrianglePack<Width>* pPack = &m_Packs[m_FirstPack[first]];
+		for (int packFirst{}; packFirst < count; packFirst += Width, ++pPack)
+		{
+			alignas(32) float distances[Width];
+			int hitMask = IntersectLanes(*pPack, ray, std::min(ray.max, hitRecord.t), distances);
+			if (!hitMask) continue;
+
+			//Nearest lane of the pack, every lane in the mask is closer than the current hit already
+			int nearestLane = std::countr_zero(static_cast<unsigned>(hitMask));
+			for (hitMask &= hitMask - 1; hitMask; hitMask &= hitMask - 1)
+			{
+				const int lane = std::countr_zero(static_cast<unsigned>(hitMask));
+				if (distances[lane] < distances[nearestLane]) nearestLane = lane;
+			}
+
+			const float t = distances[nearestLane];
+			hitRecord.t = t;
+			hitRecord.didHit = true;
+			hitRecord.materialIndex = pPack->materialIndex[nearestLane];
+			hitRecord.origin = ray.origin + (t * ray.direction);
+			hitRecord.normal = Vector3{ pPack->normalX[nearestLane], pPack->normalY[nearestLane], pPack->normalZ[nearestLane] };
+		}
+	}
+
+	template<int Width>
+	int TrianglePacks<Width>::FindOccluder(int first, int count, const Ray& ray) const
+	{
+		const TrianglePack<Width>* pPack = &m_Packs[m_FirstPack[first]];
+		for (int packFirst{}; packFirst < count; packFirst += Width, ++pPack)
+		{
+			alignas(32) float distances[Width];
+			const int hitMask = IntersectLanes(*pPack, ray, ray.max, distances);
+			if (hitMask) return first + packFirst + std::countr_zero(static_cast<unsigned>(hitMask));
+		}
+
+		return -1;
+	}
+
+	template class TrianglePacks<4>;
+	template class TrianglePacks<8>;
+}
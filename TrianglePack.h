@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+
+#include "DataTypes.h"
+
+namespace dae
+{
+	struct BVHNode;
+
+	//Width triangles stored as SoA lanes, so one SIMD Moller-Trumbore test checks the ray against all of them at once.
+	//Unused lanes hold a degenerate triangle that no ray can hit.
+	template<int Width>
+	struct alignas(32) TrianglePack
+	{
+		float v0X[Width];
+		float v0Y[Width];
+		float v0Z[Width];
+		float edge1X[Width];
+		float edge1Y[Width];
+		float edge1Z[Width];
+		float edge2X[Width];
+		float edge2Y[Width];
+		float edge2Z[Width];
+		float normalX[Width];
+		float normalY[Width];
+		float normalZ[Width];
+
+		//TriangleCullMode as the sign of the determinants that are culled: 1 culls back faces, -1 front faces, 0 nothing
+		float cullSign[Width];
+
+		unsigned char materialIndex[Width];
+	};
+
+	//The triangle leaves of a BVH repacked into TrianglePacks, every leaf starts a pack of its own.
+	//A leaf of n triangles takes ceil(n / Width) packs, which is why the builder counts packs and not triangles in its leaf cost.
+	template<int Width>
+	class TrianglePacks final
+	{
+		static_assert(Width == 4 || Width == 8, "Only packs of 4 and 8 triangles are supported");
+
+	public:
+		//The triangles are in leaf order, the leaves of the nodes index them
+		void Build(const BVHNode* nodes, int nodeCount, const std::vector<BVHTriangle>& triangles);
+		void Clear();
+
+		bool IsBuild() const { return !m_Packs.empty(); }
+		size_t GetMemoryUsed() const { return m_Packs.size() * sizeof(TrianglePack<Width>) + m_FirstPack.size() * sizeof(int); }
+
+		//Same as HitTest_Triangle on every triangle of the leaf, first and count as stored in the leaf
+		void Intersect(int first, int count, const Ray& ray, HitRecord& hitRecord) const;
+
+		//Returns the leaf order index of a triangle that blocks the ray, or -1 when none of them does
+		int FindOccluder(int first, int count, const Ray& ray) const;
+
+	private:
+		//Tests every lane of the pack, returns a bitmask of the lanes hit in (ray.min, maxDistance) and their distances
+		static int IntersectLanes(const TrianglePack<Width>& pack, const Ray& ray, float maxDistance, float* distances);
+
+		std::vector<TrianglePack<Width>> m_Packs{};
+
+		//First pack of the leaf that starts at every triangle, the other entries are unused
+		std::vector<int> m_FirstPack{};
+	};
+}
@@ -90,13 +90,10 @@ namespace dae
 #pragma endregion
 #pragma region Triangle HitTest
 		//TRIANGLE HIT-TESTS
-		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		inline bool HitTest_Triangle(const BVHTriangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
 		{
-			const auto edge1 = triangle.v1 - triangle.v0;
-			const auto edge2 = triangle.v2 - triangle.v0;
-
-			const auto h = Vector3::Cross(ray.direction, edge2);
-			const auto determinant = Vector3::Dot(edge1, h);
+			const auto h = Vector3::Cross(ray.direction, triangle.edge2);
+			const auto determinant = Vector3::Dot(triangle.edge1, h);
 
 
 			//if backface culling is active, and the determinant is negative, return false.
@@ -116,14 +113,14 @@ namespace dae
 
 			if (u < 0.0f || u > 1.0f) return false;
 
-			const auto q = Vector3::Cross(tVector, edge1);
+			const auto q = Vector3::Cross(tVector, triangle.edge1);
 			const auto v = inverseDeterminant * Vector3::Dot(ray.direction, q);
 
 
 			if (v < 0.0 || u + v > 1.0) return false;
 
 			//Calculate where the intersection happens on the line.
-			const auto t = inverseDeterminant * Vector3::Dot(edge2, q);
+			const auto t = inverseDeterminant * Vector3::Dot(triangle.edge2, q);
 
 			if (t > ray.min && t < ray.max)
 			{
@@ -142,6 +139,27 @@ namespace dae
 			return false;
 		}
 
+		inline bool HitTest_Triangle(const BVHTriangle& triangle, const Ray& ray)
+		{
+			HitRecord temp{};
+			return HitTest_Triangle(triangle, ray, temp, true);
+		}
+
+		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		{
+			const BVHTriangle hitTriangle
+			{
+				triangle.v0,
+				triangle.v1 - triangle.v0,
+				triangle.v2 - triangle.v0,
+				triangle.normal,
+				triangle.cullMode,
+				triangle.materialIndex
+			};
+
+			return HitTest_Triangle(hitTriangle, ray, hitRecord, ignoreHitRecord);
+		}
+
 		inline bool HitTest_Triangle(const Triangle& triangle, const Ray& ray)
 		{
 			HitRecord temp{};
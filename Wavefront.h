@@ -0,0 +1,45 @@
+#pragma once
+
+namespace dae
+{
+	//The work of a wave of primary rays as it goes through the stages of the wavefront renderer: generate, extend, shadow and shade.
+	//Every stage is a loop over the arrays the stage before it filled. A wave is small enough for all of them to stay in the L1/L2 cache.
+	struct alignas(32) WavefrontQueues
+	{
+		static constexpr int waveSize{ 256 };
+
+		//Generate: a primary ray per pixel of the wave, all leaving the camera origin
+		int rayCount{};
+		int pixelX[waveSize];
+		int pixelY[waveSize];
+		float directionX[waveSize];
+		float directionY[waveSize];
+		float directionZ[waveSize];
+
+		//Summed over the lights by the shade stage
+		float colorR[waveSize];
+		float colorG[waveSize];
+		float colorB[waveSize];
+
+		//Extend: the rays that hit something, the misses already got the color of the sky
+		int hitCount{};
+		int hitRayIdx[waveSize];
+		float hitOriginX[waveSize];
+		float hitOriginY[waveSize];
+		float hitOriginZ[waveSize];
+		float hitNormalX[waveSize];
+		float hitNormalY[waveSize];
+		float hitNormalZ[waveSize];
+		float hitDistance[waveSize];
+		unsigned char hitMaterialIndex[waveSize];
+
+		//The hits sorted by material, so the shade stage calls the same material back to back
+		int materialOrder[waveSize];
+
+		//Shadow: per hit, the direction towards the light being shaded and whether it reaches the hit
+		float lightDirectionX[waveSize];
+		float lightDirectionY[waveSize];
+		float lightDirectionZ[waveSize];
+		bool isLit[waveSize];
+	};
+}
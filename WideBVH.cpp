@@ -0,0 +1,298 @@
+#include "WideBVH.h"
+#include "BVHNode.h"
+#include "TraversalStack.h"
+
+#include <immintrin.h>
+
+namespace dae
+{
+	template<int Width>
+	void WideBVH<Width>::Collapse(const BVHNode* binaryNodes, int nodeCount, int rootNodeIdx, int treeDepth)
+	{
+		m_Nodes.clear();
+		if (nodeCount == 0) return;
+
+		m_StackSize = 1 + (Width - 1) * treeDepth;
+
+		//A collapsed tree never has more nodes than the binary one
+		m_Nodes.reserve(nodeCount / 2 + 1);
+		m_Nodes.emplace_back();
+		CollapseNode(binaryNodes, rootNodeIdx, 0);
+	}
+
+	template<int Width>
+	void WideBVH<Width>::CollapseNode(const BVHNode* binaryNodes, int binaryNodeIdx, int wideNodeIdx)
+	{
+		//Start with the two children and keep opening the largest interior child until all lanes are used
+		int children[Width]{};
+		int childCount{};
+
+		const BVHNode& binaryNode = binaryNodes[binaryNodeIdx];
+		if (binaryNode.isLeaf())
+		{
+			//Only happens for a root that is a leaf
+			children[childCount++] = binaryNodeIdx;
+		}
+		else
+		{
+			children[childCount++] = binaryNode.leftFirst;
+			children[childCount++] = binaryNode.leftFirst + 1;
+		}
+
+		while (childCount < Width)
+		{
+			int largestIdx = -1;
+			float largestArea = -1.f;
+			for (int i{}; i < childCount; ++i)
+			{
+				const BVHNode& child = binaryNodes[children[i]];
+				if (child.isLeaf()) continue;
+
+				const float area = AABB{ child.aabbMin, child.aabbMax }.Area();
+				if (area > largestArea)
+				{
+					largestArea = area;
+					largestIdx = i;
+				}
+			}
+
+			if (largestIdx == -1) break;
+
+			const int openedIdx = children[largestIdx];
+			children[largestIdx] = binaryNodes[openedIdx].leftFirst;
+			children[childCount++] = binaryNodes[openedIdx].leftFirst + 1;
+		}
+
+		WideBVHNode<Width> wideNode{};
+		wideNode.childCount = childCount;
+
+		for (int lane{}; lane < childCount; ++lane)
+		{
+			const BVHNode& child = binaryNodes[children[lane]];
+
+			wideNode.minX[lane] = child.aabbMin.x;
+			wideNode.minY[lane] = child.aabbMin.y;
+			wideNode.minZ[lane] = child.aabbMin.z;
+			wideNode.maxX[lane] = child.aabbMax.x;
+			wideNode.maxY[lane] = child.aabbMax.y;
+			wideNode.maxZ[lane] = child.aabbMax.z;
+
+			if (child.isLeaf())
+			{
+				wideNode.child[lane] = child.leftFirst;
+				wideNode.triangleCount[lane] = child.triangleCount;
+			}
+			else
+			{
+				//Reserve the slot first, the recursion appends more nodes
+				wideNode.child[lane] = static_cast<int>(m_Nodes.size());
+				wideNode.triangleCount[lane] = 0;
+				m_Nodes.emplace_back();
+			}
+		}
+
+		m_Nodes[wideNodeIdx] = wideNode;
+
+		for (int lane{}; lane < childCount; ++lane)
+		{
+			if (wideNode.triangleCount[lane] > 0) continue;
+			CollapseNode(binaryNodes, children[lane], wideNode.child[lane]);
+		}
+	}
+
+	//Same slab test as BVH::IntersectAABB, for 4 boxes at once
+	static int IntersectLanesSSE(const float* minX, const float* minY, const float* minZ,
+		const float* maxX, const float* maxY, const float* maxZ,
+		const Ray& ray, float maxDistance, float* distances)
+	{
+		const __m128 originX = _mm_set1_ps(ray.origin.x);
+		const __m128 originY = _mm_set1_ps(ray.origin.y);
+		const __m128 originZ = _mm_set1_ps(ray.origin.z);
+		const __m128 inverseX = _mm_set1_ps(ray.inverseDirection.x);
+		const __m128 inverseY = _mm_set1_ps(ray.inverseDirection.y);
+		const __m128 inverseZ = _mm_set1_ps(ray.inverseDirection.z);
+
+		const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(minX), originX), inverseX);
+		const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxX), originX), inverseX);
+		const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(minY), originY), inverseY);
+		const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxY), originY), inverseY);
+		const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(minZ), originZ), inverseZ);
+		const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxZ), originZ), inverseZ);
+
+		const __m128 tMin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+		const __m128 tMax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+
+		const __m128 hit = _mm_and_ps(
+			_mm_and_ps(_mm_cmpge_ps(tMax, tMin), _mm_cmplt_ps(tMin, _mm_set1_ps(maxDistance))),
+			_mm_cmpgt_ps(tMax, _mm_setzero_ps()));
+
+		_mm_storeu_ps(distances, tMin);
+		return _mm_movemask_ps(hit);
+	}
+
+#ifdef __AVX__
+	//8 boxes at once, only compiled when the compiler is allowed to emit AVX
+	static int IntersectLanesAVX(const float* minX, const float* minY, const float* minZ,
+		const float* maxX, const float* maxY, const float* maxZ,
+		const Ray& ray, float maxDistance, float* distances)
+	{
+		const __m256 originX = _mm256_set1_ps(ray.origin.x);
+		const __m256 originY = _mm256_set1_ps(ray.origin.y);
+		const __m256 originZ = _mm256_set1_ps(ray.origin.z);
+		const __m256 inverseX = _mm256_set1_ps(ray.inverseDirection.x);
+		const __m256 inverseY = _mm256_set1_ps(ray.inverseDirection.y);
+		const __m256 inverseZ = _mm256_set1_ps(ray.inverseDirection.z);
+
+		const __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(minX), originX), inverseX);
+		const __m256 tx2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(maxX), originX), inverseX);
+		const __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(minY), originY), inverseY);
+		const __m256 ty2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(maxY), originY), inverseY);
+		const __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(minZ), originZ), inverseZ);
+		const __m256 tz2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(maxZ), originZ), inverseZ);
+
+		const __m256 tMin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx1, tx2), _mm256_min_ps(ty1, ty2)), _mm256_min_ps(tz1, tz2));
+		const __m256 tMax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx1, tx2), _mm256_max_ps(ty1, ty2)), _mm256_max_ps(tz1, tz2));
+
+		const __m256 hit = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(tMax, tMin, _CMP_GE_OQ), _mm256_cmp_ps(tMin, _mm256_set1_ps(maxDistance), _CMP_LT_OQ)),
+			_mm256_cmp_ps(tMax, _mm256_setzero_ps(), _CMP_GT_OQ));
+
+		_mm256_storeu_ps(distances, tMin);
+		return _mm256_movemask_ps(hit);
+	}
+#endif
+
+	template<int Width>
+	int WideBVH<Width>::IntersectChildren(const WideBVHNode<Width>& node, const Ray& ray, float maxDistance, float* distances)
+	{
+		int hitMask{};
+
+		if constexpr (Width == 4)
+		{
+			hitMask = IntersectLanesSSE(node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ, ray, maxDistance, distances);
+		}
+		else
+		{
+#ifdef __AVX__
+			hitMask = IntersectLanesAVX(node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ, ray, maxDistance, distances);
+#else
+			//Without AVX the 8 lanes are tested as two halves
+			hitMask = IntersectLanesSSE(node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ, ray, maxDistance, distances);
+			hitMask |= IntersectLanesSSE(node.minX + 4, node.minY + 4, node.minZ + 4, node.maxX + 4, node.maxY + 4, node.maxZ + 4,
+				ray, maxDistance, distances + 4) << 4;
+#endif
+		}
+
+		//Unused lanes hold empty boxes that would pass the test
+		return hitMask & ((1 << node.childCount) - 1);
+	}
+
+	template<int Width>
+	void WideBVH<Width>::Intersect(const Ray& ray, const BVH& bvh, HitRecord& hitRecord, BVHTraversalStats* pStats) const
+	{
+		if (m_Nodes.empty()) return;
+
+		//Leaf children are pushed as well, a leaf entry has a primitive count
+		struct StackEntry
+		{
+			int index;
+			int triangleCount;
+			float distance;
+		};
+
+		TraversalStack<StackEntry, m_MaxStackDepth> stack{ m_StackSize };
+		int stackPtr = 0;
+		stack[stackPtr++] = { 0, 0, 0.f };
+
+		while (stackPtr > 0)
+		{
+			const StackEntry entry = stack[--stackPtr];
+
+			//The closest hit moved in front of this entry since it was pushed
+			if (entry.distance >= hitRecord.t) continue;
+
+			if (entry.triangleCount > 0)
+			{
+				bvh.IntersectLeaf(entry.index, entry.triangleCount, ray, hitRecord, pStats);
+				continue;
+			}
+
+			if (pStats) ++pStats->nodesVisited;
+
+			const WideBVHNode<Width>& node = m_Nodes[entry.index];
+			if (pStats) pStats->boxTests += Width;
+
+			alignas(32) float distances[Width];
+			int hitMask = IntersectChildren(node, ray, hitRecord.t, distances);
+
+			//Sort the hit children far to near, so the nearest one ends up on top of the stack
+			int hitLanes[Width];
+			int hitCount{};
+			while (hitMask)
+			{
+				int lane{};
+				while (!(hitMask & (1 << lane))) ++lane;
+				hitMask &= hitMask - 1;
+
+				int insertIdx = hitCount++;
+				while (insertIdx > 0 && distances[hitLanes[insertIdx - 1]] < distances[lane])
+				{
+					hitLanes[insertIdx] = hitLanes[insertIdx - 1];
+					--insertIdx;
+				}
+				hitLanes[insertIdx] = lane;
+			}
+
+			assert(stackPtr + hitCount <= m_StackSize && "Wide BVH is deeper than the traversal stack");
+			for (int i{}; i < hitCount; ++i)
+			{
+				const int lane = hitLanes[i];
+				stack[stackPtr++] = { node.child[lane], node.triangleCount[lane], distances[lane] };
+			}
+		}
+	}
+
+	template<int Width>
+	bool WideBVH<Width>::IsOccluded(const Ray& ray, const BVH& bvh, int* pOccluder, BVHTraversalStats* pStats) const
+	{
+		if (m_Nodes.empty()) return false;
+
+		//Any hit will do, so there is no point in ordering the children
+		TraversalStack<int, m_MaxStackDepth> stack{ m_StackSize };
+		int stackPtr = 0;
+		stack[stackPtr++] = 0;
+
+		while (stackPtr > 0)
+		{
+			if (pStats) ++pStats->nodesVisited;
+
+			const WideBVHNode<Width>& node = m_Nodes[stack[--stackPtr]];
+			if (pStats) pStats->boxTests += Width;
+
+			alignas(32) float distances[Width];
+			int hitMask = IntersectChildren(node, ray, ray.max, distances);
+
+			while (hitMask)
+			{
+				int lane{};
+				while (!(hitMask & (1 << lane))) ++lane;
+				hitMask &= hitMask - 1;
+
+				const int triangleCount = node.triangleCount[lane];
+				if (triangleCount == 0)
+				{
+					assert(stackPtr < m_StackSize && "Wide BVH is deeper than the traversal stack");
+					stack[stackPtr++] = node.child[lane];
+					continue;
+				}
+
+				if (bvh.IsLeafOccluding(node.child[lane], triangleCount, ray, pOccluder, pStats)) return true;
+			}
+		}
+
+		return false;
+	}
+
+	template class WideBVH<4>;
+	template class WideBVH<8>;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <vector>
+
+#include "DataTypes.h"
+
+namespace dae
+{
+	struct BVH;
+	struct BVHNode;
+	struct BVHTraversalStats;
+
+	//Node of a collapsed BVH with up to Width children.
+	//The child bounds are stored as SoA lanes, so one SIMD test checks the ray against every child at once.
+	template<int Width>
+	struct alignas(32) WideBVHNode
+	{
+		float minX[Width];
+		float minY[Width];
+		float minZ[Width];
+		float maxX[Width];
+		float maxY[Width];
+		float maxZ[Width];
+
+		//Interior child: index of its wide node, leaf child: first primitive
+		int child[Width];
+
+		//Leaf child: the count of the binary leaf (see BVHNode), 0 for interior children
+		int triangleCount[Width];
+
+		int childCount;
+	};
+
+	template<int Width>
+	class WideBVH final
+	{
+		static_assert(Width == 4 || Width == 8, "Only 4 and 8 wide BVHs are supported");
+
+	public:
+		//Builds the wide tree by pulling the largest grandchildren of the binary tree up into their parent, treeDepth is the depth of its deepest leaf
+		void Collapse(const BVHNode* binaryNodes, int nodeCount, int rootNodeIdx, int treeDepth);
+		void Clear() { m_Nodes.clear(); }
+
+		//The leaves are tested by the BVH that was collapsed, it owns the primitives
+		void Intersect(const Ray& ray, const BVH& bvh, HitRecord& hitRecord, BVHTraversalStats* pStats) const;
+		bool IsOccluded(const Ray& ray, const BVH& bvh, int* pOccluder, BVHTraversalStats* pStats) const;
+
+		bool IsBuild() const { return !m_Nodes.empty(); }
+		size_t GetMemoryUsed() const { return m_Nodes.size() * sizeof(WideBVHNode<Width>); }
+
+	private:
+		//Stacks up to this size live on the stack of the thread, see TraversalStack
+		static constexpr int m_MaxStackDepth{ 64 * (Width - 1) };
+
+		void CollapseNode(const BVHNode* binaryNodes, int binaryNodeIdx, int wideNodeIdx);
+
+		//Tests the ray against every child box of the node, returns a bitmask of the hit children and their entry distances
+		static int IntersectChildren(const WideBVHNode<Width>& node, const Ray& ray, float maxDistance, float* distances);
+
+		std::vector<WideBVHNode<Width>> m_Nodes{};
+
+		//Every visited node can push all but one of its children, and the wide tree is never deeper than the binary one
+		int m_StackSize{ 1 };
+	};
+
+	using BVH4 = WideBVH<4>;
+	using BVH8 = WideBVH<8>;
+}
@@ -3,12 +3,20 @@
 #undef main
 
 //Standard includes
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
+#include <string>
 
 //Project includes
 #include "Timer.h"
 #include "Renderer.h"
 #include "Scene.h"
+#include "Benchmark.h"
+#include "Counters.h"
 
 using namespace dae;
 
@@ -18,26 +26,179 @@ void ShutDown(SDL_Window* pWindow)
 	SDL_Quit();
 }
 
-int main(int argc, char* args[])
+namespace
 {
-	//Unreferenced parameters
-	(void)argc;
-	(void)args;
-	
-	//Create window + surfaces
-	SDL_Init(SDL_INIT_VIDEO);
-	constexpr uint32_t width = 640;
-	constexpr uint32_t height = 480;
+	struct Options
+	{
+		//Renders to files without opening a window or initializing SDL
+		bool isHeadless{ false };
 
-	//const auto pScene = new Scene_W1();
-	//const auto pScene = new Scene_W2();
-	//const auto pScene = new Scene_W3();
-	const auto pScene = new Scene_W4();
+		//Times every scene headless with Benchmark::RunSceneBenchmark, only --width, --height, --threads and --output apply
+		bool isBenchmark{ false };
 
-	//const auto pScene = new Scene_W4_Bunny();
+		std::string sceneName{ "W4" };
+		int width{ 640 };
+		int height{ 480 };
+
+		//Headless only
+		int frameCount{ 1 };
+		int samplesPerPixel{ 1 };
+		//Empty writes RayTracing_Buffer.bmp, or SceneBenchmark.json for the benchmark
+		std::string outputPath{};
+		int threadCount{};
+		bool useAdaptiveSampling{ false };
+	};
+
+	void PrintUsage()
+	{
+		std::cout << "Usage: RayTracer [--headless] [--scene W1|W2|W3|W4|Bunny] [--width N] [--height N]\n"
+			<< "                 [--frames N] [--spp N] [--output path.bmp] [--threads N] [--adaptive]\n"
+			<< "       RayTracer --benchmark [--width N] [--height N] [--threads N] [--output path.json]\n"
+			<< "Headless renders --frames frames of --spp samples per pixel, at 30 frames per second of scene time.\n"
+			<< "With --adaptive a tile gets up to --spp samples per pixel, and fewer once its pixels stop changing.\n"
+			<< "More than one frame writes path_0000.bmp, path_0001.bmp, ...\n"
+			<< "The benchmark times every scene on 1, 2, 4, ... up to --threads threads and writes the results as JSON.\n";
+	}
+
+	bool ParseOptions(int argc, char* args[], Options& options)
+	{
+		for (int argIdx{ 1 }; argIdx < argc; ++argIdx)
+		{
+			const std::string arg{ args[argIdx] };
+			const bool hasValue = argIdx + 1 < argc;
+
+			if (arg == "--headless") options.isHeadless = true;
+			else if (arg == "--benchmark") options.isBenchmark = true;
+			else if (arg == "--adaptive") options.useAdaptiveSampling = true;
+			else if (arg == "--scene" && hasValue) options.sceneName = args[++argIdx];
+			else if (arg == "--output" && hasValue) options.outputPath = args[++argIdx];
+			else if (arg == "--width" && hasValue) options.width = std::atoi(args[++argIdx]);
+			else if (arg == "--height" && hasValue) options.height = std::atoi(args[++argIdx]);
+			else if (arg == "--frames" && hasValue) options.frameCount = std::atoi(args[++argIdx]);
+			else if (arg == "--spp" && hasValue) options.samplesPerPixel = std::atoi(args[++argIdx]);
+			else if (arg == "--threads" && hasValue) options.threadCount = std::atoi(args[++argIdx]);
+			else
+			{
+				std::cout << "Unknown or incomplete argument: " << arg << "\n";
+				return false;
+			}
+		}
 
+		if (options.outputPath.empty()) options.outputPath = options.isBenchmark ? SceneBenchmarkSettings{}.outputPath : "RayTracing_Buffer.bmp";
+
+		return options.width > 0 && options.height > 0 && options.frameCount > 0 && options.samplesPerPixel > 0 && options.threadCount >= 0;
+	}
+
+	std::string GetFramePath(const Options& options, int frameIdx)
+	{
+		if (options.frameCount == 1) return options.outputPath;
+
+		const std::filesystem::path path{ options.outputPath };
+		char frameNumber[16]{};
+		std::snprintf(frameNumber, sizeof(frameNumber), "_%04d", frameIdx);
+
+		std::filesystem::path framePath{ path.parent_path() / path.stem() };
+		framePath += frameNumber;
+		framePath += path.extension();
+		return framePath.string();
+	}
+
+	//Renders every frame into memory and writes it out, SDL is never initialized so it runs on machines without a display
+	int RunHeadless(const Options& options, Scene* pScene)
+	{
+		Timer timer{};
+		timer.SetFixedTimeStep(1.f / 30.f);
+		timer.Start();
+
+		Renderer renderer{ options.width, options.height };
+		renderer.SetThreadCount(options.threadCount);
+
+		//With adaptive sampling --spp is the most a tile gets, the smooth ones stop before
+		AdaptiveSamplingSettings adaptiveSampling{};
+		adaptiveSampling.enabled = options.useAdaptiveSampling;
+		adaptiveSampling.maxSampleCount = options.samplesPerPixel;
+		adaptiveSampling.minSampleCount = std::min(adaptiveSampling.minSampleCount, options.samplesPerPixel);
+		renderer.SetAdaptiveSampling(adaptiveSampling);
+
+		for (int frameIdx{}; frameIdx < options.frameCount; ++frameIdx)
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			pScene->Update(&timer);
+
+			//A static scene would otherwise keep adding to the last frame
+			renderer.ResetAccumulation();
+			while (options.useAdaptiveSampling || renderer.GetMinSampleCount() < options.samplesPerPixel)
+			{
+				renderer.Render(pScene);
+
+				//Adaptive sampling stops tracing once every tile is smooth or has --spp samples
+				if (renderer.GetFrameRayCount() == 0) break;
+			}
+
+			const auto end = std::chrono::high_resolution_clock::now();
+			timer.Update();
+
+			const std::string framePath = GetFramePath(options, frameIdx);
+			if (!renderer.SaveImage(framePath))
+			{
+				std::cout << "Could not write " << framePath << std::endl;
+				return 1;
+			}
+
+			std::cout << "Frame " << frameIdx << ": " << renderer.GetAverageSampleCount() << " spp (" << renderer.GetMinSampleCount()
+				<< " to " << renderer.GetMaxSampleCount() << " per tile) in "
+				<< std::chrono::duration<double, std::milli>(end - start).count() << " ms -> " << framePath << std::endl;
+		}
+
+		return 0;
+	}
+}
+
+int main(int argc, char* args[])
+{
+	Options options{};
+	if (!ParseOptions(argc, args, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (options.isBenchmark)
+	{
+		SceneBenchmarkSettings settings{};
+		settings.width = options.width;
+		settings.height = options.height;
+		settings.maxThreadCount = options.threadCount;
+		settings.outputPath = options.outputPath;
+		return Benchmark::RunSceneBenchmark(settings) ? 0 : 1;
+	}
+
+	const auto pScene = SceneUtils::CreateScene(options.sceneName);
+	if (!pScene)
+	{
+		std::cout << "Unknown scene: " << options.sceneName << "\n";
+		PrintUsage();
+		return 1;
+	}
 
 	pScene->Initialize();
+
+	if (options.isHeadless)
+	{
+		const int result = RunHeadless(options, pScene);
+		delete pScene;
+		return result;
+	}
+
+	//Quality of the freshly built acceleration structure, to compare builders and layouts
+	pScene->CreateBVHReport().WriteJson("BVHStats.json");
+
+	//Create window + surfaces
+	SDL_Init(SDL_INIT_VIDEO);
+	const int width = options.width;
+	const int height = options.height;
+
 	std::string title = "RayTracer - Xander Berten (2DAE09) - ";
 	title += pScene->GetSceneName();
 	
@@ -81,9 +242,22 @@ int main(int argc, char* args[])
 			case SDL_KEYUP:
 
 				if (e.key.keysym.scancode == SDL_SCANCODE_X) takeScreenshot = true;
+				if (e.key.keysym.scancode == SDL_SCANCODE_M) pRenderer->ToggleWavefront();
+				if (e.key.keysym.scancode == SDL_SCANCODE_P) pRenderer->ToggleAccumulation();
+				if (e.key.keysym.scancode == SDL_SCANCODE_O) pRenderer->ToggleAdaptiveSampling();
+				if (e.key.keysym.scancode == SDL_SCANCODE_H) pRenderer->ToggleSampleHeatmap();
+				if (e.key.keysym.scancode == SDL_SCANCODE_L) pScene->CycleLeafPackWidth();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F1) pRenderer->CycleTileOrder();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F2) pRenderer->ToggleShadows();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F3) pRenderer->CycleLightingMode();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F4) pRenderer->CyclePacketSize();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F5) pRenderer->PrintSchedulerStats();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F6) pTimer->StartBenchmark();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F7) Benchmark::RunAABBMicroBenchmark();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F8) pScene->CycleTraversalMode();
+				if (e.key.keysym.scancode == SDL_SCANCODE_F9) Benchmark::RunTraversalBenchmark(pScene, width, height);
+				if (e.key.keysym.scancode == SDL_SCANCODE_F10) Benchmark::RunBuildBenchmark(pScene);
+				if (e.key.keysym.scancode == SDL_SCANCODE_F11) pRenderer->CycleTileSize();
 
 				break;
 			}
@@ -101,7 +275,10 @@ int main(int argc, char* args[])
 		if (printTimer >= 1.f)
 		{
 			printTimer = 0.f;
-			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+			std::cout << "dFPS: " << pTimer->GetdFPS() << " (" << pRenderer->GetAverageSampleCount() << " spp)" << std::endl;
+#if RT_ENABLE_COUNTERS
+			Counters::Print(std::cout, Counters::GetLastFrame());
+#endif
 		}
 
 		//Save screenshot after full render